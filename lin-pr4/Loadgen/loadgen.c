@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+/*
+ * Multi-threaded load generator for the practice modules.
+ *
+ * Every thread opens the target on its own and issues operations in a loop,
+ * timing each one. The latencies go to a log-linear histogram per thread and
+ * operation type, which are merged at the end to report throughput and
+ * p50/p99/p999. With -j the results are printed as a single JSON object, so
+ * runs can be stored and compared across module versions.
+ *
+ * Targets:
+ *	mymod       /proc/my_mod     read = full read of the list, write = "add N"
+ *	prodcons    /proc/prodcons   read/write = one message of -s bytes
+ *	devprodcons /dev/prodcons    same as prodcons
+ *	modtimer    /proc/modtimer   read = one read() of the numbers (read only)
+ *
+ * For mymod every thread mixes reads and writes according to -r. The FIFO
+ * targets need producers and consumers on separate files, so -r splits the
+ * threads into consumers and producers instead (at least one of each).
+ * /proc/modtimer only admits one opener, so modtimer always runs a single
+ * thread; its blocking read() is interrupted with a signal when -d expires.
+ */
+
+typedef enum { TARGET_MYMOD, TARGET_FIFO, TARGET_TIMER } target_kind_t;
+
+typedef struct {
+	const char* name;
+	const char* path;
+	target_kind_t kind;
+} target_t;
+
+static const target_t targets[] = {
+	{ "mymod", "/proc/my_mod", TARGET_MYMOD },
+	{ "prodcons", "/proc/prodcons", TARGET_FIFO },
+	{ "devprodcons", "/dev/prodcons", TARGET_FIFO },
+	{ "modtimer", "/proc/modtimer", TARGET_TIMER },
+};
+
+typedef enum { DIST_UNIFORM, DIST_SEQ, DIST_ZIPF } dist_t;
+
+/* Configuration */
+static const target_t* target = &targets[0];
+static const char* path = NULL;
+static int nr_threads = 4;
+static int read_pct = 50;
+static int seconds = 5;
+static long ops_per_thread = 0; /* 0: run for "seconds" */
+static dist_t dist = DIST_UNIFORM;
+static int value_range = 1000;
+static double zipf_s = 1.0;
+static int msg_size = 32;
+static int batch = 1;
+static int json = 0;
+
+static volatile int stop = 0;
+static double* zipf_cdf = NULL;
+
+/************************************\
+|   Latency histogram                |
+\************************************/
+
+/* Log-linear buckets: 2^HIST_SUB_BITS sub-buckets per power of two of ns */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct {
+	unsigned long counts[HIST_BUCKETS];
+	unsigned long n;
+	unsigned long long sum_ns;
+	unsigned long long max_ns;
+} hist_t;
+
+static int hist_index(unsigned long long ns) {
+	int msb;
+
+	if(ns < HIST_SUB)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Upper bound (in ns) of the values that fall in bucket "idx" */
+static unsigned long long hist_value(int idx) {
+	int major = idx / HIST_SUB;
+	int sub = idx % HIST_SUB;
+
+	if(major == 0)
+		return sub;
+	return ((unsigned long long) (HIST_SUB + sub + 1) << (major - 1)) - 1;
+}
+
+static void hist_add(hist_t* h, unsigned long long ns) {
+	h->counts[hist_index(ns)]++;
+	h->n++;
+	h->sum_ns += ns;
+	if(ns > h->max_ns)
+		h->max_ns = ns;
+}
+
+static void hist_merge(hist_t* dst, const hist_t* src) {
+	int i;
+
+	for(i = 0; i < HIST_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+	dst->n += src->n;
+	dst->sum_ns += src->sum_ns;
+	if(src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+}
+
+static unsigned long long hist_percentile(const hist_t* h, double pct) {
+	unsigned long target_n = (unsigned long) ceil(h->n * pct / 100.0);
+	unsigned long seen = 0;
+	int i;
+
+	if(h->n == 0)
+		return 0;
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if(seen >= target_n)
+			return hist_value(i) < h->max_ns ? hist_value(i) : h->max_ns;
+	}
+	return h->max_ns;
+}
+
+/************************************\
+|   Values                           |
+\************************************/
+
+static void zipf_init(void) {
+	double sum = 0;
+	int i;
+
+	zipf_cdf = malloc(value_range * sizeof(double));
+	for(i = 0; i < value_range; i++) {
+		sum += 1.0 / pow(i + 1, zipf_s);
+		zipf_cdf[i] = sum;
+	}
+	for(i = 0; i < value_range; i++)
+		zipf_cdf[i] /= sum;
+}
+
+static int next_value(unsigned int* seed, long* seq) {
+	double u;
+	int lo, hi, mid;
+
+	switch(dist) {
+	case DIST_SEQ:
+		return (*seq)++ % value_range;
+	case DIST_ZIPF:
+		u = (double) rand_r(seed) / RAND_MAX;
+		lo = 0;
+		hi = value_range - 1;
+		while(lo < hi) {
+			mid = (lo + hi) / 2;
+			if(zipf_cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	default:
+		return rand_r(seed) % value_range;
+	}
+}
+
+/************************************\
+|   Threads                          |
+\************************************/
+
+typedef struct {
+	pthread_t tid;
+	int id;
+	int role;         /* FIFO targets: 0 consumer, 1 producer */
+	unsigned int seed;
+	hist_t rd, wr;
+	unsigned long long bytes;
+	int err;
+	volatile int finished;
+} worker_t;
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int done(long ops) {
+	if(ops_per_thread > 0)
+		return ops >= ops_per_thread;
+	return stop;
+}
+
+static void* mymod_worker(void* arg) {
+	worker_t* w = arg;
+	char* buf = malloc(64 * 1024);
+	char* cmd = malloc(batch * 16);
+	long seq = w->id * 1000003L;
+	long ops;
+	unsigned long long t0;
+	ssize_t n;
+	int len, i;
+	int fd = open(path, O_RDWR);
+
+	if(fd < 0 || buf == NULL || cmd == NULL) {
+		w->err = errno;
+		goto out;
+	}
+
+	for(ops = 0; !done(ops); ops++) {
+		if(rand_r(&w->seed) % 100 < read_pct) {
+			t0 = now_ns();
+			lseek(fd, 0, SEEK_SET);
+			while((n = read(fd, buf, 64 * 1024)) > 0)
+				w->bytes += n;
+			hist_add(&w->rd, now_ns() - t0);
+		} else {
+			len = 0;
+			for(i = 0; i < batch; i++)
+				len += sprintf(cmd + len, "add %d\n", next_value(&w->seed, &seq));
+			t0 = now_ns();
+			if(write(fd, cmd, len) < 0) {
+				w->err = errno;
+				break;
+			}
+			hist_add(&w->wr, now_ns() - t0);
+			w->bytes += len;
+		}
+	}
+
+	close(fd);
+out:
+	free(buf);
+	free(cmd);
+	return NULL;
+}
+
+static void* fifo_worker(void* arg) {
+	worker_t* w = arg;
+	char* buf = malloc(msg_size);
+	long ops;
+	unsigned long long t0;
+	ssize_t n;
+	int fd = open(path, w->role ? O_WRONLY : O_RDONLY);
+
+	if(fd < 0 || buf == NULL) {
+		w->err = errno;
+		free(buf);
+		return NULL;
+	}
+	memset(buf, 'a' + w->id % 26, msg_size);
+
+	for(ops = 0; ; ops++) {
+		/* Consumers run until the producers are gone, so nobody blocks forever */
+		if(w->role && done(ops))
+			break;
+
+		t0 = now_ns();
+		n = w->role ? write(fd, buf, msg_size) : read(fd, buf, msg_size);
+		if(n <= 0) {
+			if(n < 0 && errno != EPIPE)
+				w->err = errno;
+			break;
+		}
+		hist_add(w->role ? &w->wr : &w->rd, now_ns() - t0);
+		w->bytes += n;
+	}
+
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static void* timer_worker(void* arg) {
+	worker_t* w = arg;
+	char buf[4096];
+	long ops;
+	unsigned long long t0;
+	ssize_t n;
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0) {
+		w->err = errno;
+		return NULL;
+	}
+
+	for(ops = 0; !done(ops); ops++) {
+		t0 = now_ns();
+		n = read(fd, buf, sizeof(buf));
+		if(n <= 0) {
+			/* EINTR is main() waking us up at the end of the run */
+			if(n < 0 && !(errno == EINTR && stop))
+				w->err = errno;
+			break;
+		}
+		hist_add(&w->rd, now_ns() - t0);
+		w->bytes += n;
+	}
+
+	close(fd);
+	w->finished = 1;
+	return NULL;
+}
+
+/* No SA_RESTART, so that the signal makes a blocked read() return EINTR */
+static void wake_handler(int sig) {
+	(void) sig;
+}
+
+/************************************\
+|   Report                           |
+\************************************/
+
+static void print_hist(const char* name, const hist_t* h, double secs, int last) {
+	if(json) {
+		printf("\"%s\":{\"ops\":%lu,\"ops_per_sec\":%.1f,\"mean_ns\":%.0f,"
+				"\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}%s",
+				name, h->n, h->n / secs, h->n ? (double) h->sum_ns / h->n : 0.0,
+				hist_percentile(h, 50), hist_percentile(h, 99), hist_percentile(h, 99.9),
+				h->max_ns, last ? "" : ",");
+	} else {
+		printf("%-6s ops=%lu ops/s=%.1f mean=%.0fns p50=%lluns p99=%lluns p999=%lluns max=%lluns\n",
+				name, h->n, h->n / secs, h->n ? (double) h->sum_ns / h->n : 0.0,
+				hist_percentile(h, 50), hist_percentile(h, 99), hist_percentile(h, 99.9),
+				h->max_ns);
+	}
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  -t target    mymod|prodcons|devprodcons|modtimer (default mymod)\n"
+			"  -p path      override the path of the target\n"
+			"  -n threads   number of threads (default 4; always 1 for modtimer,\n"
+			"               which admits a single opener)\n"
+			"  -r percent   reads (mymod) or consumers (FIFOs) in %% (default 50)\n"
+			"  -d seconds   run for this long (default 5)\n"
+			"  -o ops       run this many operations per thread instead\n"
+			"  -D dist      values: uniform|seq|zipf (default uniform)\n"
+			"  -R range     values are in [0, range) (default 1000)\n"
+			"  -z s         zipf exponent (default 1.0)\n"
+			"  -s bytes     FIFO message size (default 32)\n"
+			"  -b batch     mymod commands per write (default 1)\n"
+			"  -j           print the results as JSON\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+	worker_t* workers;
+	hist_t rd, wr;
+	unsigned long long t0, bytes = 0;
+	double secs;
+	int nr_producers = 0;
+	int opt, i, ok;
+
+	while((opt = getopt(argc, argv, "t:p:n:r:d:o:D:R:z:s:b:j")) != -1) {
+		switch(opt) {
+		case 't':
+			for(ok = 0, i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+				if(strcmp(optarg, targets[i].name) == 0) {
+					target = &targets[i];
+					ok = 1;
+				}
+			}
+			if(!ok) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p': path = optarg; break;
+		case 'n': nr_threads = atoi(optarg); break;
+		case 'r': read_pct = atoi(optarg); break;
+		case 'd': seconds = atoi(optarg); break;
+		case 'o': ops_per_thread = atol(optarg); break;
+		case 'D':
+			if(strcmp(optarg, "seq") == 0)
+				dist = DIST_SEQ;
+			else if(strcmp(optarg, "zipf") == 0)
+				dist = DIST_ZIPF;
+			else
+				dist = DIST_UNIFORM;
+			break;
+		case 'R': value_range = atoi(optarg); break;
+		case 'z': zipf_s = atof(optarg); break;
+		case 's': msg_size = atoi(optarg); break;
+		case 'b': batch = atoi(optarg); break;
+		case 'j': json = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(nr_threads < 1 || value_range < 1 || msg_size < 1 || batch < 1 ||
+			read_pct < 0 || read_pct > 100) {
+		usage(argv[0]);
+		return 1;
+	}
+	if(path == NULL)
+		path = target->path;
+	if(dist == DIST_ZIPF)
+		zipf_init();
+
+	if(target->kind == TARGET_TIMER) {
+		struct sigaction sa;
+
+		nr_threads = 1;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = wake_handler;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+	if(target->kind == TARGET_FIFO) {
+		if(nr_threads < 2)
+			nr_threads = 2;
+		nr_producers = nr_threads - nr_threads * read_pct / 100;
+		if(nr_producers < 1)
+			nr_producers = 1;
+		if(nr_producers > nr_threads - 1)
+			nr_producers = nr_threads - 1;
+	}
+
+	workers = calloc(nr_threads, sizeof(worker_t));
+	t0 = now_ns();
+	for(i = 0; i < nr_threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = i * 7919 + 1;
+		workers[i].role = (i < nr_producers);
+		pthread_create(&workers[i].tid, NULL,
+				target->kind == TARGET_MYMOD ? mymod_worker :
+				target->kind == TARGET_FIFO ? fifo_worker : timer_worker,
+				&workers[i]);
+	}
+
+	if(ops_per_thread == 0) {
+		sleep(seconds);
+		stop = 1;
+		/* The reader may be asleep until the next flush: interrupt it (again, if it was between reads) */
+		if(target->kind == TARGET_TIMER) {
+			while(!workers[0].finished) {
+				pthread_kill(workers[0].tid, SIGUSR1);
+				usleep(1000);
+			}
+		}
+	}
+
+	memset(&rd, 0, sizeof(rd));
+	memset(&wr, 0, sizeof(wr));
+	for(i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		hist_merge(&rd, &workers[i].rd);
+		hist_merge(&wr, &workers[i].wr);
+		bytes += workers[i].bytes;
+		if(workers[i].err)
+			fprintf(stderr, "thread %d: %s\n", i, strerror(workers[i].err));
+	}
+	secs = (now_ns() - t0) / 1e9;
+
+	if(json) {
+		printf("{\"target\":\"%s\",\"path\":\"%s\",\"threads\":%d,\"read_pct\":%d,"
+				"\"seconds\":%.3f,\"bytes\":%llu,\"mb_per_sec\":%.3f,",
+				target->name, path, nr_threads, read_pct, secs, bytes, bytes / secs / 1e6);
+		print_hist("read", &rd, secs, 0);
+		print_hist("write", &wr, secs, 1);
+		printf("}\n");
+	} else {
+		printf("target=%s path=%s threads=%d read_pct=%d seconds=%.3f MB/s=%.3f\n",
+				target->name, path, nr_threads, read_pct, secs, bytes / secs / 1e6);
+		print_hist("read", &rd, secs, 0);
+		print_hist("write", &wr, secs, 1);
+	}
+
+	free(workers);
+	free(zipf_cdf);
+	return 0;
+}
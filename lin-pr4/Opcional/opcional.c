@@ -5,193 +5,682 @@
 #include <linux/kfifo.h>
 #include <linux/semaphore.h>
 #include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/highmem.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include "prodcons_ioctl.h"
+#include "prodcons_spin.h"
+#include "prodcons_stats.h"
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Module pr4");
 MODULE_AUTHOR("Germán Franco Dorca - Álvaro Velasco García");
 
-#define MAX_CBUFFER_LEN 64
-#define MAX_KBUF 200
+#define MIN_RING_SIZE 64
+#define MAX_RING_SIZE (256 << 20)
 #define DEVICE_NAME "prodcons"
+#define NR_CHANNELS 256 /* Menores que reserva register_chrdev() */
+
+static unsigned int ring_size = 65536;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Bytes in the ring of each channel (64 B - 256 MiB, rounded up to a power of two)");
+
+static unsigned int spin_us = 0;
+module_param(spin_us, uint, 0644);
+MODULE_PARM_DESC(spin_us, "Microseconds to spin waiting for the other end before sleeping (0 = always sleep)");
+
+/*
+ * Cada menor es un canal independiente, con su propio anillo, cerrojos y
+ * colas de espera, así que parejas productor/consumidor en menores distintos
+ * no comparten nada. El canal se crea en el primer open() de su menor y se
+ * libera en el último close(), cuando ya no queda nadie que pueda leer lo que
+ * hubiera en el anillo.
+ */
+typedef struct {
+	struct kfifo cbuffer;
+	/*
+	 * Página de control seguida de la memoria de cbuffer, todo de
+	 * vmalloc_user() para poder ofrecerla con mmap(). La página de control
+	 * solo se usa en modo mmap, cuando los índices los llevan los procesos.
+	 */
+	void *area;
+	struct prodcons_ring_ctl *ctl;
+	int mmap_mode;
+	unsigned int minor;
+	unsigned int users; /* Ficheros abiertos sobre el canal; protegido por channels_lock */
+	prodcons_stats_t __percpu *stats;
+	unsigned int ring_hwm; /* Máxima ocupación del anillo; solo la sube un productor con wr_lock */
+	struct semaphore mtx; /* Para garantizar exclusión mutua en open/release */
+	int prod_count; /* Número de procesos que abrieron el canal para escritura (productores) */
+	int cons_count; /* Número de procesos que abrieron el canal para lectura (consumidores) */
+
+	/* Igual que en fifoproc: cada extremo se serializa solo consigo mismo */
+	struct mutex wr_lock ____cacheline_aligned_in_smp;
+	wait_queue_head_t wq_prod; /* Cola de espera para productor(es) */
+	unsigned int prod_spin_ns; /* Presupuesto de espera activa; protegido por wr_lock */
+	struct mutex rd_lock ____cacheline_aligned_in_smp;
+	wait_queue_head_t wq_cons; /* Cola de espera para consumidor(es) */
+	unsigned int cons_spin_ns; /* Presupuesto de espera activa; protegido por rd_lock */
+} prodcons_chan_t;
+
+static prodcons_chan_t *channels[NR_CHANNELS];
+static DEFINE_MUTEX(channels_lock); /* Protege channels[] y los campos users */
 
-static struct kfifo cbuffer;
-static struct semaphore mtx; /* Para garantizar exclusión mutua */
-static struct semaphore sem_prod; /* Cola de espera para productor(es) */
-static struct semaphore sem_cons; /* Cola de espera para consumidor(es) */
+static int major;
+static struct proc_dir_entry *stats_proc_entry;
+
+static prodcons_chan_t* get_channel(unsigned int minor) {
+	prodcons_chan_t* chan;
+
+	mutex_lock(&channels_lock);
+	chan = channels[minor];
+	if (chan == NULL) {
+		chan = kzalloc(sizeof(prodcons_chan_t), GFP_KERNEL);
+		if (chan == NULL)
+			goto out;
+		chan->area = vmalloc_user(PAGE_SIZE + ring_size);
+		chan->stats = alloc_percpu(prodcons_stats_t);
+		if (chan->area == NULL || chan->stats == NULL) {
+			vfree(chan->area);
+			free_percpu(chan->stats);
+			kfree(chan);
+			chan = NULL;
+			goto out;
+		}
+		kfifo_init(&chan->cbuffer, chan->area + PAGE_SIZE, ring_size);
+		chan->ctl = chan->area;
+		chan->ctl->size = ring_size;
+		chan->ctl->data_offset = PAGE_SIZE;
+		chan->minor = minor;
+		sema_init(&chan->mtx, 1);
+		mutex_init(&chan->wr_lock);
+		mutex_init(&chan->rd_lock);
+		init_waitqueue_head(&chan->wq_prod);
+		init_waitqueue_head(&chan->wq_cons);
+		channels[minor] = chan;
+	}
+	chan->users++;
+out:
+	mutex_unlock(&channels_lock);
+	return chan;
+}
 
-static volatile int prod_count = 0; /* Número de procesos que abrieron la entrada /proc para escritura (productores) */
-static volatile int cons_count = 0; /* Número de procesos que abrieron la entrada /proc para lectura (consumidores) */
-static volatile int nr_prod_waiting = 0; /* Número de procesos productores esperando */
-static volatile int nr_cons_waiting = 0; /* Número de procesos consumidores esperando */
+static void put_channel(prodcons_chan_t* chan) {
+	mutex_lock(&channels_lock);
+	if (--chan->users == 0) {
+		channels[chan->minor] = NULL;
+		vfree(chan->area);
+		free_percpu(chan->stats);
+		kfree(chan);
+	}
+	mutex_unlock(&channels_lock);
+}
 
-static int major;
+/* Despierta a los productores o consumidores del canal sin tocar el cerrojo de la cola si no hay nadie */
+static void wake_waiters(prodcons_chan_t* chan, int side) {
+	wait_queue_head_t *wq = side == PROD ? &chan->wq_prod : &chan->wq_cons;
+
+	smp_mb();
+	if (waitqueue_active(wq)) {
+		wake_up_interruptible(wq);
+		this_cpu_inc(chan->stats->wakeups[side]);
+	}
+}
+
+/* Anota los bytes que ha movido una llamada de "side" */
+static void account_bytes(prodcons_chan_t* chan, int side, size_t bytes) {
+	if (bytes > 0) {
+		this_cpu_add(chan->stats->bytes[side], bytes);
+		this_cpu_inc(chan->stats->ops[side]);
+	}
+}
+
+/* Con wr_lock tomado, tras meter datos en el anillo */
+static void update_hwm(prodcons_chan_t* chan) {
+	if (kfifo_len(&chan->cbuffer) > chan->ring_hwm)
+		WRITE_ONCE(chan->ring_hwm, kfifo_len(&chan->cbuffer));
+}
+
+/* Al empezar y acabar cada espera de spin_then_wait(): solo estadísticas */
+static void wait_start(prodcons_stats_t __percpu *s, int side) {
+}
+
+static void wait_end(prodcons_stats_t __percpu *s, int side, u64 ns, int ret) {
+	account_blocked(s, side, ns);
+}
+
+/* Estado del anillo, con los índices de la página de control en modo mmap */
+static bool chan_readable(prodcons_chan_t* chan) {
+	if (READ_ONCE(chan->mmap_mode))
+		return READ_ONCE(chan->ctl->head) != READ_ONCE(chan->ctl->tail);
+	return !kfifo_is_empty(&chan->cbuffer);
+}
+
+static bool chan_writable(prodcons_chan_t* chan) {
+	if (READ_ONCE(chan->mmap_mode))
+		return READ_ONCE(chan->ctl->head) - READ_ONCE(chan->ctl->tail) < ring_size;
+	return !kfifo_is_full(&chan->cbuffer);
+}
+
+static int fifodev_release(struct inode * inode, struct file * file);
 
 /* Se invoca al hacer open() de entrada /dev */
 static int fifodev_open(struct inode * inode, struct file * file) {
-	if(down_interruptible(&mtx))
-			return -EINTR;
+	prodcons_chan_t* chan = get_channel(iminor(inode));
+	int ret = 0;
 
-		cons_count++;
-		while(nr_prod_waiting > 0) {   // cond_signal(prod);
-			nr_prod_waiting--;
-			up(&sem_prod);
-		}
-		while(prod_count < 1) {
-			nr_cons_waiting++; // cond_wait(cons,mtx);
-			up(&mtx);
-			if(down_interruptible(&sem_cons))
-				return -EINTR;
-			if(down_interruptible(&mtx))
-					return -EINTR;
-		}
+	if (chan == NULL)
+		return -ENOMEM;
+	file->private_data = chan;
+
+	if(down_interruptible(&chan->mtx)) {
+		put_channel(chan);
+		return -EINTR;
+	}
+
+	if (file->f_mode & FMODE_READ) {    // Consumidores
+		WRITE_ONCE(chan->cons_count, chan->cons_count + 1);
+		up(&chan->mtx);
+		wake_waiters(chan, PROD);
+		/* Esperar hasta que entre un productor */
+		if (file->f_flags & O_NONBLOCK)
+			ret = READ_ONCE(chan->prod_count) > 0 ? 0 : -EAGAIN;
+		else if (wait_event_interruptible(chan->wq_cons, READ_ONCE(chan->prod_count) > 0))
+			ret = -EINTR;
 	} else {    // Productores
-		prod_count++;
-		while(nr_cons_waiting > 0) {   // cond_signal(cons);
-			nr_cons_waiting--;
-			up(&sem_cons);
-		}
-		while(cons_count < 1) {
-			nr_prod_waiting++; // cond_wait(cons,mtx);
-			up(&mtx);
-			if(down_interruptible(&sem_prod))
-				return -EINTR;
-			if(down_interruptible(&mtx))
-					return -EINTR;
-		}
+		WRITE_ONCE(chan->prod_count, chan->prod_count + 1);
+		up(&chan->mtx);
+		wake_waiters(chan, CONS);
+		/* Esperar hasta que entre un consumidor */
+		if (file->f_flags & O_NONBLOCK)
+			ret = READ_ONCE(chan->cons_count) > 0 ? 0 : -EAGAIN;
+		else if (wait_event_interruptible(chan->wq_prod, READ_ONCE(chan->cons_count) > 0))
+			ret = -EINTR;
 	}
 
-	up(&mtx);
-	return 0;
+	if (ret)
+		fifodev_release(inode, file);
+	return ret;
 }
 
 /* Se invoca al hacer close() de entrada /dev */
 static int fifodev_release(struct inode * inode, struct file * file) {
-	if(down_interruptible(&mtx))
-			return -EINTR;
-	if(file->f_mode & FMODE_READ) { // Lectores (consumidores)
-		cons_count--;
-		while(nr_prod_waiting > 0) {
-			nr_prod_waiting--;
-			up(&sem_prod);
-		}
-	} else { // Escritores (productores)
-		prod_count--;
-		while(nr_cons_waiting > 0) {
-			nr_cons_waiting--;
-			up(&sem_cons);
+	prodcons_chan_t* chan = file->private_data;
+
+	/* No interrumpible: los contadores tienen que quedar bien siempre */
+	down(&chan->mtx);
+	if(file->f_mode & FMODE_READ) // Lectores (consumidores)
+		WRITE_ONCE(chan->cons_count, chan->cons_count - 1);
+	else // Escritores (productores)
+		WRITE_ONCE(chan->prod_count, chan->prod_count - 1);
+
+	if(chan->prod_count == 0 && chan->cons_count == 0)
+		kfifo_reset(&chan->cbuffer);
+	up(&chan->mtx);
+
+	/* El otro extremo puede estar esperando datos o hueco que ya no llegarán */
+	wake_waiters(chan, file->f_mode & FMODE_READ ? PROD : CONS);
+
+	put_channel(chan);
+	return 0;
+}
+
+/*
+ * Toma rd_lock y espera a que haya datos o a que no queden productores.
+ * Devuelve 0 con el cerrojo tomado, o un error sin él. Común a read() y
+ * splice_read().
+ */
+static int consumer_lock_wait(prodcons_chan_t* chan, bool nonblock) {
+	if (nonblock) {
+		if (!mutex_trylock(&chan->rd_lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&chan->rd_lock)) {
+		return -EINTR;
+	}
+	if (chan->mmap_mode) {
+		mutex_unlock(&chan->rd_lock);
+		return -EBUSY;
+	}
+
+	if (nonblock) {
+		if (kfifo_is_empty(&chan->cbuffer) && READ_ONCE(chan->prod_count) > 0) {
+			mutex_unlock(&chan->rd_lock);
+			this_cpu_inc(chan->stats->stalls[CONS]);
+			return -EAGAIN;
 		}
+	} else if (spin_then_wait(chan->wq_cons, chan->cons_spin_ns, spin_us,
+			!kfifo_is_empty(&chan->cbuffer) || READ_ONCE(chan->prod_count) == 0,
+			wait_start, wait_end, chan->stats, CONS)) {
+		/* Esperar hasta que haya elementos para consumir (debe haber productores) */
+		mutex_unlock(&chan->rd_lock);
+		return -EINTR;
 	}
+	return 0;
+}
 
-	if(prod_count == 0 && cons_count == 0) 
-		kfifo_reset(&cbuffer);
+/* Toma wr_lock; devuelve 0 con el cerrojo tomado, o un error sin él */
+static int producer_lock(prodcons_chan_t* chan, bool nonblock) {
+	if (nonblock) {
+		if (!mutex_trylock(&chan->wr_lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&chan->wr_lock)) {
+		return -EINTR;
+	}
+	if (chan->mmap_mode) {
+		mutex_unlock(&chan->wr_lock);
+		return -EBUSY;
+	}
+	return 0;
+}
 
-	up(&mtx);
+/* Con wr_lock tomado, espera hueco en el anillo. Común a write() y splice_write() */
+static int producer_wait_room(prodcons_chan_t* chan, bool nonblock) {
+	/* Sin bloqueo se escribe lo que quepa */
+	if (nonblock && kfifo_is_full(&chan->cbuffer) && READ_ONCE(chan->cons_count) > 0) {
+		this_cpu_inc(chan->stats->stalls[PROD]);
+		return -EAGAIN;
+	}
+
+	/* Esperar hasta que haya hueco para insertar (debe haber consumidores) */
+	if (spin_then_wait(chan->wq_prod, chan->prod_spin_ns, spin_us,
+			!kfifo_is_full(&chan->cbuffer) || READ_ONCE(chan->cons_count) == 0,
+			wait_start, wait_end, chan->stats, PROD))
+		return -EINTR;
+
+	/* Detectar fin de comunicación por error (consumidor cierra FIFO antes) */
+	if (READ_ONCE(chan->cons_count) == 0)
+		return -EPIPE;
 	return 0;
 }
 
-/* Se invoca al hacer read() de entrada /dev */
+/* Se invoca al hacer read() de entrada /dev: como en un pipe, devuelve lo que haya (hasta len) */
 static ssize_t fifodev_read(struct file * file, char *buff, size_t len, loff_t * offset) {
-	char kbuffer[MAX_KBUF];
-	if (len > MAX_CBUFFER_LEN || len > MAX_KBUF)
-		return -ENOMEM;
+	prodcons_chan_t* chan = file->private_data;
+	unsigned int copied;
+	int ret;
 
-	if(down_interruptible(&mtx))
-		return -EINTR;
+	if (len == 0)
+		return 0;
+
+	ret = consumer_lock_wait(chan, file->f_flags & O_NONBLOCK);
+	if (ret)
+		return ret;
 
-	/* Esperar hasta que haya elementos para consumir (debe haber productores) */
-	while (kfifo_len(&cbuffer)<len && prod_count>0) {
-		nr_cons_waiting++; // cond_wait(cons,mtx);
-		up(&mtx);
-		if(down_interruptible(&sem_cons))
-			return -EINTR;
+	/* Vacía y sin productores es fin de comunicación: copied queda a 0 */
+	ret = kfifo_to_user(&chan->cbuffer, buff, len, &copied);
+	mutex_unlock(&chan->rd_lock);
 
+	/* Despertar a posible productor bloqueado */
+	if (copied > 0)
+		wake_waiters(chan, PROD);
+	account_bytes(chan, CONS, copied);
+
+	/* Un -EFAULT a mitad deja lo ya copiado fuera del anillo: se devuelve eso */
+	return copied > 0 ? copied : ret;
+}
+
+/* Se invoca al hacer write() de entrada /dev: escribe los len bytes en trozos, esperando hueco */
+static ssize_t fifodev_write(struct file * file, const char *buff, size_t len, loff_t * offset) {
+	prodcons_chan_t* chan = file->private_data;
+	bool nonblock = file->f_flags & O_NONBLOCK;
+	size_t written = 0;
+	unsigned int copied;
+	int ret;
+
+	ret = producer_lock(chan, nonblock);
+	if (ret)
+		return ret;
+
+	while (written < len) {
+		ret = producer_wait_room(chan, nonblock);
+		if (ret)
+			break;
+
+		ret = kfifo_from_user(&chan->cbuffer, buff + written, len - written, &copied);
+		/* Un -EFAULT a mitad deja lo ya copiado en el anillo: también cuenta */
+		written += copied;
+		if (copied > 0) {
+			update_hwm(chan);
+
+			/* Despertar a posible consumidor bloqueado */
+			wake_waiters(chan, CONS);
+		}
+		if (ret)
+			break;
 	}
+	mutex_unlock(&chan->wr_lock);
 
-	/* Detectar fin de comunicación por error (consumidor cierra FIFO antes) */
-	if (prod_count==0 && kfifo_is_empty(&cbuffer)) {
-		up(&mtx);
+	account_bytes(chan, PROD, written);
+	return written > 0 ? written : ret;
+}
+
+/* Libera las páginas que splice_to_pipe() no llegó a meter en el pipe */
+static void fifodev_spd_release(struct splice_pipe_desc *spd, unsigned int i) {
+	put_page(spd->pages[i]);
+}
+
+static const struct pipe_buf_operations fifodev_pipe_buf_ops = {
+	.can_merge = 0,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+/*
+ * Se invoca al hacer splice()/sendfile() desde entrada /dev hacia un pipe. Los
+ * datos se copian una sola vez, del anillo a páginas nuevas que pasan al pipe
+ * tal cual. Cada página se llena con kfifo_out_peek() y solo se saca del
+ * anillo lo que splice_to_pipe() aceptó, sin soltar rd_lock: si el lector
+ * del pipe se ha ido (-EPIPE) los datos siguen en el anillo. El llamador
+ * tiene el pipe bloqueado, así que no se pasa de sus huecos libres.
+ */
+static ssize_t fifodev_splice_read(struct file *file, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+	prodcons_chan_t* chan = file->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &fifodev_pipe_buf_ops,
+		.spd_release = fifodev_spd_release,
+	};
+	unsigned int slots, used, n;
+	ssize_t spliced = 0;
+	struct page *page;
+	ssize_t ret;
+
+	if (len == 0)
 		return 0;
+
+	ret = consumer_lock_wait(chan, (file->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK));
+	if (ret)
+		return ret;
+
+	slots = min_t(unsigned int, pipe->buffers - pipe->nrbufs, PIPE_DEF_BUFFERS);
+	for (used = 0; used < slots && len > 0 && !kfifo_is_empty(&chan->cbuffer); used++) {
+		page = alloc_page(GFP_KERNEL);
+		if (page == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+		n = kfifo_out_peek(&chan->cbuffer, page_address(page), min_t(size_t, len, PAGE_SIZE));
+		pages[0] = page;
+		partial[0].offset = 0;
+		partial[0].len = n;
+		spd.nr_pages = 1;
+		ret = splice_to_pipe(pipe, &spd);
+		if (ret <= 0)
+			break;
+		/* kfifo_skip() solo salta un elemento; esto avanza la salida "ret" bytes */
+		kfifo_dma_out_finish(&chan->cbuffer, ret);
+		spliced += ret;
+		len -= ret;
+		if (ret < n)
+			break;
+	}
+	mutex_unlock(&chan->rd_lock);
+
+	if (spliced == 0) {
+		if (ret < 0)
+			return ret;
+		/* Vacía y sin productores es fin de comunicación */
+		if (kfifo_is_empty(&chan->cbuffer))
+			return 0;
+		return -EAGAIN;
 	}
-	kfifo_out(&cbuffer,kbuffer,len);
 
 	/* Despertar a posible productor bloqueado */
-	if(nr_prod_waiting > 0) {   // cond_signal(prod);
-		nr_prod_waiting--;
-		up(&sem_prod);
-	}
-	up(&mtx);
+	wake_waiters(chan, PROD);
+	account_bytes(chan, CONS, spliced);
+	return spliced;
+}
 
-	if (copy_to_user(buff,kbuffer,len))
-		return -EFAULT;
+/* Copia un buffer del pipe al anillo, esperando hueco como write() */
+static int fifodev_pipe_to_ring(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+		struct splice_desc *sd) {
+	prodcons_chan_t* chan = sd->u.file->private_data;
+	bool nonblock = (sd->u.file->f_flags & O_NONBLOCK) || (sd->flags & SPLICE_F_NONBLOCK);
+	unsigned int n;
+	void *src;
+	int ret;
+
+	ret = producer_wait_room(chan, nonblock);
+	if (ret)
+		return ret;
+
+	src = kmap(buf->page);
+	n = kfifo_in(&chan->cbuffer, src + buf->offset, sd->len);
+	kunmap(buf->page);
+	update_hwm(chan);
 
-	return len;
+	/* Despertar a posible consumidor bloqueado */
+	wake_waiters(chan, CONS);
+	return n;
 }
 
-/* Se invoca al hacer write() de entrada /dev */
-static ssize_t fifodev_write(struct file * file, const char *buff, size_t len, loff_t * offset) {
-	char kbuffer[MAX_KBUF];
+/*
+ * Se invoca al hacer splice()/sendfile() desde un pipe o un fichero hacia
+ * entrada /dev: las páginas del pipe se copian directamente al anillo, sin
+ * pasar por un buffer de usuario.
+ */
+static ssize_t fifodev_splice_write(struct pipe_inode_info *pipe, struct file *out,
+		loff_t *ppos, size_t len, unsigned int flags) {
+	prodcons_chan_t* chan = out->private_data;
+	struct splice_desc sd = {
+		.total_len = len,
+		.flags = flags,
+		.pos = *ppos,
+		.u.file = out,
+	};
+	ssize_t ret;
+
+	ret = producer_lock(chan, (out->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK));
+	if (ret)
+		return ret;
 
-	if (len > MAX_CBUFFER_LEN || len> MAX_KBUF)
-		return -ENOMEM;
+	pipe_lock(pipe);
+	ret = __splice_from_pipe(pipe, &sd, fifodev_pipe_to_ring);
+	pipe_unlock(pipe);
+	mutex_unlock(&chan->wr_lock);
+
+	if (ret > 0)
+		account_bytes(chan, PROD, ret);
+	return ret;
+}
+
+/*
+ * Se invoca al hacer poll()/select()/epoll de entrada /dev. Los consumidores
+ * son legibles con datos en el anillo y ven POLLHUP cuando no quedan
+ * productores; los productores son escribibles con hueco y ven POLLERR
+ * cuando no quedan consumidores, como en un pipe.
+ */
+static unsigned int fifodev_poll(struct file *file, poll_table *wait) {
+	prodcons_chan_t* chan = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &chan->wq_cons, wait);
+	poll_wait(file, &chan->wq_prod, wait);
+	/* Empareja con la barrera de wake_waiters(): o nos ven en la cola o vemos su cambio */
+	smp_mb();
+
+	if (file->f_mode & FMODE_READ) {
+		if (chan_readable(chan))
+			mask |= POLLIN | POLLRDNORM;
+		if (READ_ONCE(chan->prod_count) == 0)
+			mask |= POLLHUP;
+	} else {
+		if (chan_writable(chan))
+			mask |= POLLOUT | POLLWRNORM;
+		if (READ_ONCE(chan->cons_count) == 0)
+			mask |= POLLERR;
+	}
+	return mask;
+}
 
-	if (copy_from_user(kbuffer,buff,len))
-		return -EFAULT;
+/*
+ * Se invoca al hacer mmap() de entrada /dev: pasa el canal a modo mmap (ver
+ * prodcons_ioctl.h). Se toman los cerrojos de ambos extremos para que no
+ * haya ningún read()/write() a medias y se exige el anillo vacío, porque los
+ * índices de la página de control empiezan en 0.
+ */
+static int fifodev_mmap(struct file *file, struct vm_area_struct *vma) {
+	prodcons_chan_t* chan = file->private_data;
+	int ret;
 
-	if(down_interruptible(&mtx))
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&chan->wr_lock))
+		return -EINTR;
+	if (mutex_lock_interruptible(&chan->rd_lock)) {
+		mutex_unlock(&chan->wr_lock);
 		return -EINTR;
-	/* Esperar hasta que haya hueco para insertar (debe haber consumidores) */
-	while (kfifo_avail(&cbuffer) < len && cons_count > 0) {
-		nr_prod_waiting++;
-		up(&mtx);
-		if(down_interruptible(&sem_prod))
-			return -EINTR;
 	}
-	/* Detectar fin de comunicación por error (consumidor cierra FIFO antes) */
-	if (cons_count==0) { up(&mtx); return -EPIPE; }
-	kfifo_in(&cbuffer,kbuffer,len);
-	/* Despertar a posible consumidor bloqueado */
 
-	if(nr_cons_waiting > 0) {   // cond_signal(cons);
-		nr_cons_waiting--;
-		up(&sem_cons);
+	if (!chan->mmap_mode && !kfifo_is_empty(&chan->cbuffer)) {
+		ret = -EBUSY;
+	} else {
+		ret = remap_vmalloc_range(vma, chan->area, vma->vm_pgoff);
+		if (ret == 0)
+			WRITE_ONCE(chan->mmap_mode, 1);
+	}
+
+	mutex_unlock(&chan->rd_lock);
+	mutex_unlock(&chan->wr_lock);
+	return ret;
+}
+
+/* Se invoca al hacer ioctl() de entrada /dev: dormir y despertar en modo mmap */
+static long fifodev_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+	prodcons_chan_t* chan = file->private_data;
+	u64 start;
+	int ret;
+
+	switch (cmd) {
+	case PRODCONS_IOC_RING_SIZE:
+		return ring_size;
+	case PRODCONS_IOC_WAIT:
+		if (!READ_ONCE(chan->mmap_mode))
+			return -EINVAL;
+		start = local_clock();
+		if (file->f_mode & FMODE_READ) {
+			ret = wait_event_interruptible(chan->wq_cons,
+					chan_readable(chan) || READ_ONCE(chan->prod_count) == 0);
+			account_blocked(chan->stats, CONS, local_clock() - start);
+			if (ret)
+				return -EINTR;
+			/* Lo que quede en el anillo aún se puede leer */
+			return chan_readable(chan) ? 0 : -EPIPE;
+		} else {
+			ret = wait_event_interruptible(chan->wq_prod,
+					chan_writable(chan) || READ_ONCE(chan->cons_count) == 0);
+			account_blocked(chan->stats, PROD, local_clock() - start);
+			if (ret)
+				return -EINTR;
+			return READ_ONCE(chan->cons_count) > 0 ? 0 : -EPIPE;
+		}
+	case PRODCONS_IOC_WAKE:
+		wake_waiters(chan, file->f_mode & FMODE_READ ? PROD : CONS);
+		return 0;
+	default:
+		return -ENOTTY;
 	}
-	up(&mtx);
-	return len;
 }
 
 struct file_operations dev_entry_fops = {
 	.owner = THIS_MODULE,
 	.read = fifodev_read,
 	.write = fifodev_write,
+	.poll = fifodev_poll,
+	.splice_read = fifodev_splice_read,
+	.splice_write = fifodev_splice_write,
+	.mmap = fifodev_mmap,
+	.unlocked_ioctl = fifodev_ioctl,
+	.compat_ioctl = fifodev_ioctl,
 	.open = fifodev_open,
 	.release = fifodev_release
 };
 
+/*
+ * Se invoca al leer /proc/prodcons_dev_stats: un bloque por canal vivo, con el
+ * mismo formato que el fichero de fifoproc precedido de "minor=N". En modo
+ * mmap los datos no pasan por el módulo: solo cuentan las esperas de
+ * PRODCONS_IOC_WAIT y los despertares de PRODCONS_IOC_WAKE.
+ */
+static int stats_show(struct seq_file *m, void *v) {
+	prodcons_chan_t *chan;
+	unsigned int minor;
+
+	/* channels_lock mantiene vivos los canales mientras se recorren */
+	mutex_lock(&channels_lock);
+	for (minor = 0; minor < NR_CHANNELS; minor++) {
+		chan = channels[minor];
+		if (chan == NULL)
+			continue;
+
+		seq_printf(m, "minor=%u\n", minor);
+		prodcons_stats_show(m, chan->stats, ring_size, kfifo_len(&chan->cbuffer),
+				READ_ONCE(chan->ring_hwm), READ_ONCE(chan->prod_count),
+				READ_ONCE(chan->cons_count));
+	}
+	mutex_unlock(&channels_lock);
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file) {
+	return single_open(file, stats_show, NULL);
+}
+
+static const struct file_operations stats_proc_entry_fops = {
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 int init_module( void ) {
-	int ret = 0;
-	major = register_chrdev(0, DEVICE_NAME, &dev_entry_fops);
+	if (ring_size < MIN_RING_SIZE || ring_size > MAX_RING_SIZE) {
+		printk(KERN_INFO "prodcons: ring_size must be between %d and %d\n", MIN_RING_SIZE, MAX_RING_SIZE);
+		return -EINVAL;
+	}
+	ring_size = roundup_pow_of_two(ring_size);
 
+	major = register_chrdev(0, DEVICE_NAME, &dev_entry_fops);
 	if(major < 0) {
-		ret = -ENOMEM;
 		printk(KERN_INFO "prodcons: Can't create /dev entry\n");
-		return ret;
+		return -ENOMEM;
 	}
-	if(kfifo_alloc(&cbuffer, MAX_CBUFFER_LEN, GFP_KERNEL)) {
+
+	stats_proc_entry = proc_create("prodcons_dev_stats", 0444, NULL, &stats_proc_entry_fops);
+	if (stats_proc_entry == NULL) {
+		unregister_chrdev(major, DEVICE_NAME);
+		printk(KERN_INFO "prodcons: Can't create /proc entry\n");
 		return -ENOMEM;
 	}
-	sema_init(&mtx, 1);
-	sema_init(&sem_prod,0);
-	sema_init(&sem_cons,0);
 
-	return ret;
+	return 0;
 }
 
 
 void cleanup_module( void ) {
-	kfifo_free(&cbuffer);
-	/* liberamos el dispositivo */
+	/* liberamos el dispositivo; no puede quedar ningún canal, cada fichero abierto retiene el módulo */
+	remove_proc_entry("prodcons_dev_stats", NULL);
 	unregister_chrdev(major, DEVICE_NAME);
 }
-
-
-
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/wait.h>
+
+/*
+ * Request/response latency benchmark for /dev/prodcons against pipe(2).
+ *
+ * Two processes bounce a message of "-s" bytes back and forth "-n" times:
+ * "ping" writes it on one channel and waits for "pong" to send it back on
+ * another. Every round trip is timed and the report has the average and the
+ * p50/p99/p99.9 in microseconds. With -P the channels are two pipes, as a
+ * reference; otherwise they are two minors of the device (-p and -q, which
+ * have to exist, e.g. "mknod /dev/prodcons1 c <major> 1").
+ *
+ * Reloading the module with spin_us=N (or writing N to
+ * /sys/module/opcional/parameters/spin_us) makes each side spin up to N µs
+ * before sleeping; with -c the two processes are pinned to CPUs 0 and 1 so
+ * that the peer really is running on another CPU while one of them waits.
+ */
+
+#define PING_PATH "/dev/prodcons"
+#define PONG_PATH "/dev/prodcons1"
+
+static const char* ping_path = PING_PATH;
+static const char* pong_path = PONG_PATH;
+static size_t msg_size = 64;
+static int iters = 100000;
+static int use_pipes = 0;
+static int pin = 0;
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin_to(int cpu) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(sched_setaffinity(0, sizeof(set), &set) < 0)
+		perror("sched_setaffinity");
+}
+
+/* Reads exactly len bytes: both the pipe and the device may return less */
+static int read_full(int fd, char* buf, size_t len) {
+	ssize_t n;
+	size_t done = 0;
+
+	while(done < len) {
+		n = read(fd, buf + done, len - done);
+		if(n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static int cmp_ull(const void* a, const void* b) {
+	unsigned long long x = *(const unsigned long long*) a, y = *(const unsigned long long*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sends every message back until the other end closes */
+static void pong(int in, int out) {
+	char* buf = malloc(msg_size);
+
+	while(read_full(in, buf, msg_size) == 0)
+		if(write(out, buf, msg_size) != (ssize_t) msg_size)
+			break;
+	free(buf);
+}
+
+static void ping(int in, int out) {
+	unsigned long long* rtt = malloc(iters * sizeof(*rtt));
+	unsigned long long t, sum = 0;
+	char* buf = calloc(1, msg_size);
+	int i;
+
+	for(i = 0; i < iters; i++) {
+		t = now_ns();
+		if(write(out, buf, msg_size) != (ssize_t) msg_size || read_full(in, buf, msg_size) < 0) {
+			perror("ping");
+			break;
+		}
+		rtt[i] = now_ns() - t;
+		sum += rtt[i];
+	}
+
+	if(i > 0) {
+		qsort(rtt, i, sizeof(*rtt), cmp_ull);
+		printf("mode=%s msg_size=%zu round_trips=%d avg_us=%.2f p50_us=%.2f p99_us=%.2f p999_us=%.2f\n",
+				use_pipes ? "pipe" : "prodcons", msg_size, i, sum / 1000.0 / i,
+				rtt[i / 2] / 1000.0, rtt[(int) (i * 0.99)] / 1000.0, rtt[(int) (i * 0.999)] / 1000.0);
+	}
+	free(buf);
+	free(rtt);
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "Usage: %s [-P] [-p ping_path] [-q pong_path] [-s msg_size] [-n round_trips] [-c]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+	int to_pong[2], to_ping[2];
+	int opt;
+	pid_t pid;
+
+	while((opt = getopt(argc, argv, "Pp:q:s:n:c")) != -1) {
+		switch(opt) {
+		case 'P': use_pipes = 1; break;
+		case 'p': ping_path = optarg; break;
+		case 'q': pong_path = optarg; break;
+		case 's': msg_size = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+		case 'n': iters = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+		case 'c': pin = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(use_pipes && (pipe(to_pong) < 0 || pipe(to_ping) < 0)) {
+		perror("pipe");
+		return 1;
+	}
+
+	pid = fork();
+	if(pid < 0) {
+		perror("fork");
+		return 1;
+	}
+
+	if(pid == 0) {
+		if(pin)
+			pin_to(1);
+		if(!use_pipes) {
+			/* Same order as the parent, so that each open finds its peer */
+			to_pong[0] = open(ping_path, O_RDONLY);
+			to_ping[1] = open(pong_path, O_WRONLY);
+			if(to_pong[0] < 0 || to_ping[1] < 0) {
+				perror("pong");
+				return 1;
+			}
+		} else {
+			close(to_pong[1]);
+			close(to_ping[0]);
+		}
+		pong(to_pong[0], to_ping[1]);
+		return 0;
+	}
+
+	if(pin)
+		pin_to(0);
+	if(!use_pipes) {
+		to_pong[1] = open(ping_path, O_WRONLY);
+		to_ping[0] = open(pong_path, O_RDONLY);
+		if(to_pong[1] < 0 || to_ping[0] < 0) {
+			perror("ping");
+			return 1;
+		}
+	} else {
+		close(to_pong[0]);
+		close(to_ping[1]);
+	}
+	ping(to_ping[0], to_pong[1]);
+
+	/* Closing our write end ends pong's loop */
+	close(to_pong[1]);
+	close(to_ping[0]);
+	waitpid(pid, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef PRODCONS_IOCTL_H
+#define PRODCONS_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Shared-memory mode of /dev/prodcons, shared by the module and user programs.
+ *
+ * Producer and consumer mmap() the same channel with MAP_SHARED: the first
+ * page is a struct prodcons_ring_ctl and the ring data starts right after it
+ * (ctl->data_offset), ctl->size bytes long. The channel has to be empty when
+ * it's first mapped; from then on until it's freed (last close) read() and
+ * write() fail with -EBUSY.
+ *
+ * head and tail are free-running byte counters: the producer copies data at
+ * head & (size - 1) and then publishes head with a release store; the
+ * consumer reads at tail & (size - 1) and publishes tail the same way. No
+ * syscall is needed while there is data or room. To sleep, a side sets its
+ * *_waiting flag, issues a full barrier, checks the ring again and only then
+ * calls PRODCONS_IOC_WAIT. After publishing, a side issues a full barrier and
+ * calls PRODCONS_IOC_WAKE only if the other side's flag is set.
+ *
+ * A mapping holds a reference to the file, so a side only counts as gone
+ * (and the other side's PRODCONS_IOC_WAIT returns -EPIPE) once it has both
+ * munmap()ed the ring and closed the descriptor. A producer that closes but
+ * stays mapped leaves the consumer waiting for data forever.
+ */
+struct prodcons_ring_ctl {
+	__u32 head;		/* Bytes produced. Written only by the producer */
+	__u32 __pad0[15];
+	__u32 tail;		/* Bytes consumed. Written only by the consumer */
+	__u32 __pad1[15];
+	__u32 size;		/* Bytes in the ring, a power of two */
+	__u32 data_offset;	/* Offset of the ring data in the mapping */
+	__u32 prod_waiting;	/* Producer is (about to be) asleep in PRODCONS_IOC_WAIT */
+	__u32 cons_waiting;	/* Consumer is (about to be) asleep in PRODCONS_IOC_WAIT */
+};
+
+#define PRODCONS_IOC_MAGIC 'p'
+
+/* Returns the size of the ring; the mapping is data_offset + size bytes */
+#define PRODCONS_IOC_RING_SIZE	_IO(PRODCONS_IOC_MAGIC, 1)
+/* Sleeps until there is data (consumer) or room (producer). -EPIPE if the other end is gone */
+#define PRODCONS_IOC_WAIT	_IO(PRODCONS_IOC_MAGIC, 2)
+/* Wakes the other end after head (producer) or tail (consumer) moved */
+#define PRODCONS_IOC_WAKE	_IO(PRODCONS_IOC_MAGIC, 3)
+
+#endif
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include "prodcons_ioctl.h"
+
+/*
+ * Throughput benchmark for /dev/prodcons.
+ *
+ * A producer and a consumer thread move data through one channel for a fixed
+ * number of seconds, "-s" bytes at a time. By default they use write() and
+ * read(); with -m both map the channel and copy straight into and out of the
+ * shared ring, entering the kernel only to sleep (PRODCONS_IOC_WAIT) or to
+ * wake the other side (PRODCONS_IOC_WAKE). The report has MB/s and how many
+ * of those syscalls were needed, which is what -m saves: with both threads
+ * busy the ring rarely fills or empties and almost no call is made.
+ *
+ * With -f the producer streams that file (over and over) instead of a buffer
+ * in memory: by default with read() + write(), with -S with sendfile(), which
+ * moves the file's pages into the ring without the userspace copy. -S also
+ * makes the consumer splice() the channel into a pipe drained to /dev/null.
+ * "-f big.log" against "-f big.log -S" shows what the double copy costs.
+ *
+ * The node has to exist, e.g. "mknod /dev/prodcons c <major> 0"; -p picks
+ * another minor (another channel).
+ */
+
+#define DEV_PATH "/dev/prodcons"
+
+static volatile int stop = 0;
+static const char* path = DEV_PATH;
+static size_t msg_size = 4096;
+static int use_mmap = 0;
+static int use_splice = 0;
+static const char* src_path = NULL;
+
+typedef struct {
+	int fd;
+	int writer;
+	unsigned long bytes;
+	unsigned long syscalls;
+} bench_thread_t;
+
+static struct prodcons_ring_ctl* map_ring(int fd) {
+	long size = ioctl(fd, PRODCONS_IOC_RING_SIZE);
+	void* addr;
+
+	if(size < 0)
+		return NULL;
+	addr = mmap(NULL, sysconf(_SC_PAGESIZE) + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+/* Sleeps until the ring changes: "mine" is this side's flag, "ready" rechecks the ring */
+static int ring_wait(bench_thread_t* t, __u32* mine, int (*ready)(struct prodcons_ring_ctl*),
+		struct prodcons_ring_ctl* ctl) {
+	int ret = 0;
+
+	__atomic_store_n(mine, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(!ready(ctl)) {
+		ret = ioctl(t->fd, PRODCONS_IOC_WAIT);
+		t->syscalls++;
+	}
+	__atomic_store_n(mine, 0, __ATOMIC_RELAXED);
+	return ret;
+}
+
+/* Publishes a new head or tail and wakes the other side if it's asleep */
+static void ring_publish(bench_thread_t* t, __u32* index, __u32 val, __u32* other) {
+	__atomic_store_n(index, val, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(other, __ATOMIC_RELAXED)) {
+		ioctl(t->fd, PRODCONS_IOC_WAKE);
+		t->syscalls++;
+	}
+}
+
+static int has_room(struct prodcons_ring_ctl* ctl) {
+	return ctl->head - __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE) < ctl->size;
+}
+
+static int has_data(struct prodcons_ring_ctl* ctl) {
+	return __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE) != ctl->tail;
+}
+
+/* Copies len bytes between buf and the ring at offset pos, wrapping around */
+static void ring_copy(struct prodcons_ring_ctl* ctl, __u32 pos, char* buf, size_t len, int to_ring) {
+	char* data = (char*) ctl + ctl->data_offset;
+	size_t off = pos & (ctl->size - 1);
+	size_t first = len < ctl->size - off ? len : ctl->size - off;
+
+	if(to_ring) {
+		memcpy(data + off, buf, first);
+		memcpy(data, buf + first, len - first);
+	} else {
+		memcpy(buf, data + off, first);
+		memcpy(buf + first, data, len - first);
+	}
+}
+
+static void mmap_producer(bench_thread_t* t, struct prodcons_ring_ctl* ctl, char* buf) {
+	__u32 head = ctl->head, room;
+	size_t n;
+
+	while(!stop) {
+		room = ctl->size - (head - __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE));
+		if(room == 0) {
+			if(ring_wait(t, &ctl->prod_waiting, has_room, ctl) < 0)
+				break;
+			continue;
+		}
+		n = room < msg_size ? room : msg_size;
+		ring_copy(ctl, head, buf, n, 1);
+		head += n;
+		ring_publish(t, &ctl->head, head, &ctl->cons_waiting);
+		t->bytes += n;
+	}
+}
+
+static void mmap_consumer(bench_thread_t* t, struct prodcons_ring_ctl* ctl, char* buf) {
+	__u32 tail = ctl->tail, avail;
+	size_t n;
+
+	for(;;) {
+		avail = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE) - tail;
+		if(avail == 0) {
+			/* -EPIPE: the producer is gone and the ring is empty */
+			if(ring_wait(t, &ctl->cons_waiting, has_data, ctl) < 0)
+				break;
+			continue;
+		}
+		n = avail < msg_size ? avail : msg_size;
+		ring_copy(ctl, tail, buf, n, 0);
+		tail += n;
+		ring_publish(t, &ctl->tail, tail, &ctl->prod_waiting);
+		t->bytes += n;
+	}
+}
+
+/* Producer fed from src_path: pread() + write(), or sendfile() with -S */
+static void file_producer(bench_thread_t* t, char* buf) {
+	int src = open(src_path, O_RDONLY);
+	off_t off = 0;
+	ssize_t n;
+
+	if(src < 0) {
+		perror(src_path);
+		return;
+	}
+	while(!stop) {
+		if(use_splice) {
+			n = sendfile(t->fd, src, &off, msg_size);
+		} else {
+			n = pread(src, buf, msg_size, off);
+			if(n > 0) {
+				n = write(t->fd, buf, n);
+				t->syscalls++;
+				off += n > 0 ? n : 0;
+			}
+		}
+		t->syscalls++;
+		if(n == 0) {
+			off = 0; /* Back to the start of the file */
+			continue;
+		}
+		if(n < 0)
+			break;
+		t->bytes += n;
+	}
+	close(src);
+}
+
+/* Consumer that splices the channel into a pipe and the pipe into /dev/null */
+static void splice_consumer(bench_thread_t* t) {
+	int null = open("/dev/null", O_WRONLY);
+	int pfd[2];
+	ssize_t n, m;
+
+	if(null < 0 || pipe(pfd) < 0) {
+		perror("splice_consumer");
+		return;
+	}
+	while((n = splice(t->fd, NULL, pfd[1], NULL, msg_size, SPLICE_F_MOVE)) > 0) {
+		t->syscalls++;
+		t->bytes += n;
+		while(n > 0 && (m = splice(pfd[0], NULL, null, NULL, n, SPLICE_F_MOVE)) > 0) {
+			t->syscalls++;
+			n -= m;
+		}
+	}
+	close(pfd[0]);
+	close(pfd[1]);
+	close(null);
+}
+
+static void* bench_thread(void* arg) {
+	bench_thread_t* t = arg;
+	struct prodcons_ring_ctl* ctl = NULL;
+	char* buf = calloc(1, msg_size);
+	ssize_t n;
+
+	if(buf == NULL)
+		return NULL;
+
+	if(use_mmap) {
+		ctl = map_ring(t->fd);
+		if(ctl == NULL) {
+			perror(path);
+			free(buf);
+			close(t->fd);
+			return NULL;
+		}
+		if(t->writer)
+			mmap_producer(t, ctl, buf);
+		else
+			mmap_consumer(t, ctl, buf);
+		/* The mapping holds the file open: without this, close() wouldn't end the stream */
+		munmap(ctl, ctl->data_offset + ctl->size);
+	} else if(t->writer && src_path != NULL) {
+		file_producer(t, buf);
+	} else if(!t->writer && use_splice) {
+		splice_consumer(t);
+	} else if(t->writer) {
+		while(!stop && (n = write(t->fd, buf, msg_size)) > 0) {
+			t->bytes += n;
+			t->syscalls++;
+		}
+	} else {
+		while((n = read(t->fd, buf, msg_size)) > 0) {
+			t->bytes += n;
+			t->syscalls++;
+		}
+	}
+
+	/* The producer closes (and unmaps) first so the consumer sees the end of the stream */
+	close(t->fd);
+	free(buf);
+	return NULL;
+}
+
+static void* open_consumer(void* arg) {
+	bench_thread_t* t = arg;
+
+	t->fd = open(path, O_RDONLY);
+	return NULL;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "Usage: %s [-p path] [-s msg_size] [-d seconds] [-m] [-f file] [-S]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+	bench_thread_t prod = { .writer = 1 }, cons = { .writer = 0 };
+	pthread_t tids[2];
+	int seconds = 5, opt;
+	double mb;
+
+	while((opt = getopt(argc, argv, "p:s:d:mf:S")) != -1) {
+		switch(opt) {
+		case 'p': path = optarg; break;
+		case 's': msg_size = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+		case 'd': seconds = atoi(optarg); break;
+		case 'm': use_mmap = 1; break;
+		case 'f': src_path = optarg; break;
+		case 'S': use_splice = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	/* Each open blocks until the other end shows up */
+	pthread_create(&tids[0], NULL, open_consumer, &cons);
+	prod.fd = open(path, O_WRONLY);
+	pthread_join(tids[0], NULL);
+	if(prod.fd < 0 || cons.fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	pthread_create(&tids[0], NULL, bench_thread, &cons);
+	pthread_create(&tids[1], NULL, bench_thread, &prod);
+	sleep(seconds);
+	stop = 1;
+	pthread_join(tids[1], NULL);
+	pthread_join(tids[0], NULL);
+
+	mb = cons.bytes / (1024.0 * 1024.0);
+	printf("mode=%s msg_size=%zu MB/s=%.1f syscalls/MB=%.1f\n", use_mmap ? "mmap" : use_splice ? "splice" : "rw",
+			msg_size, mb / seconds, (prod.syscalls + cons.syscalls) / (mb > 0 ? mb : 1));
+	return 0;
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "my_mod_ioctl.h"
+
+/*
+ * Reader/writer throughput benchmark for /proc/my_mod.
+ *
+ * Runs "readers" threads doing full reads of the list and "writers" threads
+ * doing "add N" for a fixed number of seconds. With -b every write() carries
+ * a batch of that many commands (writes/s then counts commands, not calls).
+ * With -i the batches go through the MY_MOD_IOC_ADD ioctl instead of text.
+ * With -s the number of threads is swept from 1 up to the number of online
+ * CPUs, which shows how reads and writes scale with the core count; e.g.
+ * "-r 0 -w 1 -s" measures insert scaling (load my_mod with nr_shards=N to
+ * give each writer its own lock most of the time).
+ *
+ * With -l the list is first loaded with that many values through the ioctl,
+ * and /proc/my_mod_stats is printed at the end. Comparing e.g.
+ * "-l 1000000 -r 1 -w 0" with my_mod loaded with backend=list and with
+ * backend=chunks gives the full-scan rate (reads/s) and the memory per
+ * element (bytes_per_elem) of each backend.
+ */
+
+#define PROC_PATH "/proc/my_mod"
+#define STATS_PATH "/proc/my_mod_stats"
+#define READ_CHUNK (64 * 1024)
+
+static volatile int stop = 0;
+static int batch = 1;
+static int use_ioctl = 0;
+
+typedef struct {
+	int writer;
+	unsigned int seed;
+	unsigned long ops;
+} bench_thread_t;
+
+static void* reader_thread(void* arg) {
+	bench_thread_t* t = arg;
+	char* buf = malloc(READ_CHUNK);
+	int fd = open(PROC_PATH, O_RDONLY);
+
+	if(fd < 0 || buf == NULL) {
+		perror(PROC_PATH);
+		free(buf);
+		return NULL;
+	}
+
+	while(!stop) {
+		lseek(fd, 0, SEEK_SET);
+		while(read(fd, buf, READ_CHUNK) > 0)
+			;
+		t->ops++;
+	}
+
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static void* writer_thread(void* arg) {
+	bench_thread_t* t = arg;
+	char* cmd = malloc(batch * 16);
+	int len, i;
+	int fd = open(PROC_PATH, O_WRONLY);
+
+	if(fd < 0 || cmd == NULL) {
+		perror(PROC_PATH);
+		free(cmd);
+		return NULL;
+	}
+
+	while(!stop && use_ioctl) {
+		int* vals = (int*) cmd;
+		struct my_mod_ints req = { .data = (unsigned long) vals, .count = batch };
+
+		for(i = 0; i < batch; i++)
+			vals[i] = rand_r(&t->seed) % 1000;
+		if(ioctl(fd, MY_MOD_IOC_ADD, &req) < 0) {
+			perror(PROC_PATH);
+			break;
+		}
+		t->ops += batch;
+	}
+
+	while(!stop && !use_ioctl) {
+		len = 0;
+		for(i = 0; i < batch; i++)
+			len += sprintf(cmd + len, "add %d\n", rand_r(&t->seed) % 1000);
+		if(write(fd, cmd, len) < 0) {
+			perror(PROC_PATH);
+			break;
+		}
+		t->ops += batch;
+	}
+
+	close(fd);
+	free(cmd);
+	return NULL;
+}
+
+/* Runs one round and prints reads/s and writes/s */
+static void run(int readers, int writers, int seconds) {
+	int i;
+	int n = readers + writers;
+	pthread_t* tids = malloc(n * sizeof(pthread_t));
+	bench_thread_t* ts = calloc(n, sizeof(bench_thread_t));
+	unsigned long reads = 0, writes = 0;
+
+	stop = 0;
+	for(i = 0; i < n; i++) {
+		ts[i].writer = (i >= readers);
+		ts[i].seed = i + 1;
+		pthread_create(&tids[i], NULL, ts[i].writer ? writer_thread : reader_thread, &ts[i]);
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for(i = 0; i < n; i++) {
+		pthread_join(tids[i], NULL);
+		if(ts[i].writer)
+			writes += ts[i].ops;
+		else
+			reads += ts[i].ops;
+	}
+
+	printf("readers=%d writers=%d reads/s=%.1f writes/s=%.1f\n",
+			readers, writers, (double) reads / seconds, (double) writes / seconds);
+
+	free(tids);
+	free(ts);
+}
+
+/* Inserts "count" values through MY_MOD_IOC_ADD */
+static int preload(int count) {
+	int* vals = malloc(count * sizeof(int));
+	struct my_mod_ints req = { .data = (unsigned long) vals, .count = count };
+	int fd = open(PROC_PATH, O_WRONLY);
+	int i, ret = 0;
+
+	if(fd < 0 || vals == NULL) {
+		perror(PROC_PATH);
+		free(vals);
+		return -1;
+	}
+
+	srand(time(NULL));
+	for(i = 0; i < count; i++)
+		vals[i] = rand();
+	if(ioctl(fd, MY_MOD_IOC_ADD, &req) != count) {
+		perror(PROC_PATH);
+		ret = -1;
+	}
+
+	close(fd);
+	free(vals);
+	return ret;
+}
+
+static void print_stats(void) {
+	char buf[512];
+	ssize_t n;
+	int fd = open(STATS_PATH, O_RDONLY);
+
+	if(fd < 0) {
+		perror(STATS_PATH);
+		return;
+	}
+	while((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stdout);
+	close(fd);
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "Usage: %s [-r readers] [-w writers] [-d seconds] [-b batch] [-i] [-l preload] [-s]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+	int readers = 1, writers = 1, seconds = 5, sweep = 0, load = 0;
+	int opt, i, ncpus;
+
+	while((opt = getopt(argc, argv, "r:w:d:b:il:s")) != -1) {
+		switch(opt) {
+		case 'r': readers = atoi(optarg); break;
+		case 'w': writers = atoi(optarg); break;
+		case 'd': seconds = atoi(optarg); break;
+		case 'b': batch = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+		case 'i': use_ioctl = 1; break;
+		case 'l': load = atoi(optarg); break;
+		case 's': sweep = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(load > 0 && preload(load) != 0)
+		return 1;
+
+	if(!sweep) {
+		run(readers, writers, seconds);
+	} else {
+		/* Scale readers and writers together, one of each per step */
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		for(i = 1; i <= ncpus; i++)
+			run(readers ? i : 0, writers ? i : 0, seconds);
+	}
+
+	if(load > 0)
+		print_stats();
+	return 0;
+}
@@ -3,188 +3,1336 @@
 #include <linux/kernel.h>
 #include <linux/proc_fs.h>
 #include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/seq_file.h>
+#include <linux/rculist.h>
+#include <linux/hash.h>
+#include <linux/moduleparam.h>
+#include <linux/string.h>
 #include <asm-generic/uaccess.h>
 #include <linux/ftrace.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include "my_mod_ioctl.h"
 
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Module pr1");
 MODULE_AUTHOR("Germán Franco Dorca - Álvaro Velasco García");
 
-struct list_head mylist;
 static struct proc_dir_entry *proc_entry;
-/* Number of elements in the list */
-static int length;
-static int t_chars;
+static struct proc_dir_entry *stats_proc_entry;
+static struct proc_dir_entry *query_proc_entry;
+/* Bumped whenever values are removed, so that readers know their cursor is stale */
+static atomic_long_t list_gen = ATOMIC_LONG_INIT(0);
 
-DEFINE_RWLOCK(rw);
+/*
+ * Called after a node has been unlinked and before its call_rcu(): a reader
+ * whose snapshot of list_gen already includes this bump can't reach the node,
+ * and one whose snapshot predates it finds its cursor stale on the next read.
+ */
+static void bump_list_gen(void) {
+	smp_mb__before_atomic();
+	atomic_long_inc(&list_gen);
+}
+
+/*
+ * The list is split in nr_shards sub-lists; a value always lives in the same
+ * shard (picked by its hash), so writers of different values don't contend.
+ * Readers traverse the shards under RCU and never block; the writers of a
+ * shard are only serialized among themselves by its lock. With nr_shards=1
+ * (the default) this is a single list in insertion order; otherwise the
+ * order is only kept within each shard, and reads list the shards one after
+ * the other.
+ */
+typedef struct {
+	spinlock_t lock;
+	struct list_head list;   /* "list" backend: nodes, newest first */
+	struct list_head chunks; /* "chunks" backend: chunks, newest first */
+	int length;              /* Number of elements in the shard */
+} ____cacheline_aligned_in_smp list_shard_t;
+
+static unsigned int nr_shards = 1;
+module_param(nr_shards, uint, 0444);
+MODULE_PARM_DESC(nr_shards, "Number of independently locked sub-lists (1-1024)");
+
+static list_shard_t *shards;
+
+static char *backend = "list";
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Storage backend: \"list\" (a node per value) or \"chunks\" (4 KiB arrays of values)");
+
+static bool use_chunks;
 
 
 typedef struct {
 	int data;
-	struct list_head links;
+	struct list_head links;  /* Insertion order */
+	struct hlist_node hnode; /* Bucket of value_index */
+	struct rcu_head rcu;
 } list_item_t;
 
-/* Calculates number of digits of a number */
-static int intlen(int num) {
-	int i = 0;
-	if(num <= 0) {
-		i = 1;
-		num = -num;
-	}
-	while(num > 0) {
-		num = num / 10;
-		i++;
-	}
-	return i;
+/*
+ * Index of the nodes by value. Every node is also chained in the bucket of
+ * its value, so "remove N", "count N" and "contains N" only visit that
+ * bucket instead of the whole list. Updated under the shard locks, read under RCU.
+ */
+static unsigned int hash_bits = 16;
+module_param(hash_bits, uint, 0444);
+MODULE_PARM_DESC(hash_bits, "log2 of the number of buckets of the value index (1-24)");
+
+static struct hlist_head *value_index;
+
+static struct hlist_head* value_bucket(int num) {
+	return &value_index[hash_32((u32) num, hash_bits)];
+}
+
+/* Buckets are split among the shards, so a shard lock also covers its buckets */
+static list_shard_t* value_shard(int num) {
+	return &shards[hash_32((u32) num, hash_bits) % nr_shards];
+}
+
+/* Number of elements in the list (dirty read) */
+static int list_length(void) {
+	unsigned int i;
+	int length = 0;
+
+	for (i = 0; i < nr_shards; i++)
+		length += READ_ONCE(shards[i].length);
+	return length;
+}
+
+/* Dedicated cache for the list nodes (freed nodes are recycled by the slab) */
+static struct kmem_cache *item_cache;
+
+/* Allocation counters, exported through /proc/my_mod_stats */
+static atomic_t nr_allocs = ATOMIC_INIT(0);
+static atomic_t nr_frees = ATOMIC_INIT(0);
+static atomic_t nr_alloc_fails = ATOMIC_INIT(0);
+
+static list_item_t* alloc_item(void) {
+	list_item_t* item = kmem_cache_alloc(item_cache, GFP_KERNEL);
+	if(item)
+		atomic_inc(&nr_allocs);
+	else
+		atomic_inc(&nr_alloc_fails);
+	return item;
+}
+
+static void free_item(list_item_t* item) {
+	kmem_cache_free(item_cache, item);
+	atomic_inc(&nr_frees);
+}
+
+static void free_item_rcu(struct rcu_head* head) {
+	free_item(container_of(head, list_item_t, rcu));
 }
 
 /**
  * Remove all elements containing "num" from the list.
+ * Must be called with the lock of value_shard(num) held.
  */
-static void remove_from_list(int num) {
+static void __remove_from_list(list_shard_t* shard, int num) {
 	list_item_t* cur;
-	list_item_t* aux;
+	struct hlist_node* aux;
 
-	write_lock(&rw); // Lock
-	list_for_each_entry_safe(cur, aux, &mylist, links) {
+	hlist_for_each_entry_safe(cur, aux, value_bucket(num), hnode) {
 		if(cur->data == num){
-			list_del( &(cur->links) );
-			length--;
-			vfree(cur);
-			t_chars -= intlen(num);
+			hlist_del_rcu( &(cur->hnode) );
+			list_del_rcu( &(cur->links) );
+			shard->length--;
+			bump_list_gen();
+			call_rcu(&cur->rcu, free_item_rcu);
 		}
 	}
-	write_unlock(&rw); // Unlock
 }
 
 /**
- * Remove all elements from the list.
+ * Remove all the nodes of a shard.
+ * Must be called with the shard lock held.
+ */
+static void __clear_nodes(list_shard_t* shard) {
+	list_item_t* cur;
+	list_item_t* aux;
+
+	list_for_each_entry_safe(cur, aux, &shard->list, links) {
+		hlist_del_rcu( &(cur->hnode) );
+		list_del_rcu( &(cur->links) );
+		bump_list_gen();
+		call_rcu(&cur->rcu, free_item_rcu);
+	}
+	shard->length = 0;
+}
+
+/*
+ * "chunks" backend. Instead of a node per value, every shard keeps its
+ * values in CHUNK_SIZE blocks of ints, so a full scan streams through
+ * contiguous memory and a value costs about 4 bytes.
+ *
+ * The newest chunk is the first of the shard and is filled in place: a value
+ * is stored before "used" is published, so RCU readers only see complete
+ * slots. Readers go through each chunk backwards, which yields the same
+ * newest-first order as the "list" backend. Removal builds a compacted copy
+ * of every chunk it touches and swaps it in with list_replace_rcu(), so a
+ * reader never sees a chunk change under it. There is no value index here:
+ * "remove N" and "count N" scan the chunks of the shard of N.
+ */
+#define CHUNK_SIZE 4096
+
+typedef struct {
+	struct list_head links;
+	struct rcu_head rcu;
+	unsigned int used; /* Published with smp_store_release() */
+	int vals[];
+} list_chunk_t;
+
+#define CHUNK_VALS ((CHUNK_SIZE - sizeof(list_chunk_t)) / sizeof(int))
+
+static atomic_t nr_chunks = ATOMIC_INIT(0);
+
+static list_chunk_t* alloc_chunk(gfp_t flags) {
+	list_chunk_t* chunk = kmalloc(CHUNK_SIZE, flags);
+	if (chunk) {
+		chunk->used = 0;
+		atomic_inc(&nr_chunks);
+	} else {
+		atomic_inc(&nr_alloc_fails);
+	}
+	return chunk;
+}
+
+static void free_chunk_rcu(struct rcu_head* head) {
+	kfree(container_of(head, list_chunk_t, rcu));
+	atomic_dec(&nr_chunks);
+}
+
+/* Chunks for a batch are allocated up front, outside the shard locks */
+static int alloc_chunks(struct list_head* spare, unsigned int n) {
+	list_chunk_t* chunk;
+
+	for (; n > 0; n--) {
+		chunk = alloc_chunk(GFP_KERNEL);
+		if (chunk == NULL)
+			return -ENOMEM;
+		list_add(&chunk->links, spare);
+	}
+	return 0;
+}
+
+static void free_chunks(struct list_head* spare) {
+	list_chunk_t* chunk;
+	list_chunk_t* aux;
+
+	list_for_each_entry_safe(chunk, aux, spare, links) {
+		list_del(&chunk->links);
+		kfree(chunk);
+		atomic_dec(&nr_chunks);
+	}
+}
+
+/*
+ * Chunks a batch may need: new ones for its adds and compacted copies for
+ * its removals. They are counted before anything is applied and allocated
+ * with GFP_KERNEL, so applying the batch never allocates and can neither
+ * fail nor leave a chunk half compacted. The count looks at the chunks as
+ * they are, so chunk_batch_lock keeps other writers out of them from the
+ * count until the batch has been applied.
+ */
+static DEFINE_MUTEX(chunk_batch_lock);
+
+#define PLAN_BITS 10
+
+typedef struct {
+	unsigned int adds;   /* Adds since the batch last removed from the shard */
+	unsigned int filled; /* Chunks the batch may have added values to */
+} chunk_shard_plan_t;
+
+typedef struct {
+	chunk_shard_plan_t* shards;
+	DECLARE_BITMAP(added, 1 << PLAN_BITS); /* Hashes of the values added */
+	bool cleared;                          /* The chunks found by the count are gone */
+	unsigned int nr_chunks;
+} chunk_plan_t;
+
+static void chunk_plan_reset(chunk_plan_t* plan) {
+	memset(plan->shards, 0, nr_shards * sizeof(chunk_shard_plan_t));
+	bitmap_zero(plan->added, 1 << PLAN_BITS);
+	plan->cleared = false;
+	plan->nr_chunks = 0;
+}
+
+static int chunk_plan_init(chunk_plan_t* plan) {
+	plan->shards = kcalloc(nr_shards, sizeof(chunk_shard_plan_t), GFP_KERNEL);
+	if (plan->shards == NULL)
+		return -ENOMEM;
+	chunk_plan_reset(plan);
+	return 0;
+}
+
+/*
+ * An add may need a new chunk on the first add of a run (adds to a shard
+ * with no removal in between) and every CHUNK_VALS-th after it. That holds
+ * whatever the room left in the newest chunk, since a removal in between
+ * may have dropped it. A run may also add to the chunk that was the newest.
+ */
+static void chunk_plan_add(chunk_plan_t* plan, int num) {
+	chunk_shard_plan_t* sp = &plan->shards[value_shard(num) - shards];
+
+	if (sp->adds == 0)
+		sp->filled++;
+	if (sp->adds++ % CHUNK_VALS == 0) {
+		plan->nr_chunks++;
+		sp->filled++;
+	}
+	__set_bit(hash_32((u32) num, PLAN_BITS), plan->added);
+}
+
+/*
+ * A removal copies every chunk holding "num" but not only "num": at most
+ * those holding it now and, if the batch may have added it, the chunks the
+ * batch filled. Copies keep the values of the chunk they replace.
+ */
+static void chunk_plan_remove(chunk_plan_t* plan, int num) {
+	list_shard_t* shard = value_shard(num);
+	chunk_shard_plan_t* sp = &plan->shards[shard - shards];
+	list_chunk_t* chunk;
+	unsigned int i;
+
+	if (!plan->cleared) {
+		list_for_each_entry(chunk, &shard->chunks, links) {
+			for (i = 0; i < chunk->used; i++) {
+				if (chunk->vals[i] == num) {
+					plan->nr_chunks++;
+					break;
+				}
+			}
+		}
+	}
+	if (test_bit(hash_32((u32) num, PLAN_BITS), plan->added))
+		plan->nr_chunks += sp->filled;
+	sp->adds = 0;
+}
+
+static void chunk_plan_cleanup(chunk_plan_t* plan) {
+	memset(plan->shards, 0, nr_shards * sizeof(chunk_shard_plan_t));
+	bitmap_zero(plan->added, 1 << PLAN_BITS);
+	plan->cleared = true;
+}
+
+/* Takes one of the chunks allocated for the batch */
+static list_chunk_t* take_chunk(struct list_head* spare) {
+	list_chunk_t* chunk = list_first_entry_or_null(spare, list_chunk_t, links);
+
+	if (!WARN_ON_ONCE(chunk == NULL))
+		list_del(&chunk->links);
+	return chunk;
+}
+
+/**
+ * Append a value to the newest chunk of the shard, taking a new chunk from
+ * "spare" when it is full. Must be called with the shard lock held.
+ */
+static void __chunk_insert(list_shard_t* shard, int num, struct list_head* spare) {
+	list_chunk_t* head = list_first_entry_or_null(&shard->chunks, list_chunk_t, links);
+
+	if (head == NULL || head->used == CHUNK_VALS) {
+		head = take_chunk(spare);
+		if (head == NULL)
+			return;
+		list_add_rcu(&head->links, &shard->chunks);
+	}
+
+	head->vals[head->used] = num;
+	smp_store_release(&head->used, head->used + 1);
+	shard->length++;
+}
+
+/**
+ * Remove all elements containing "num" from the chunks of a shard, taking
+ * the compacted copies from "spare".
+ * Must be called with the lock of value_shard(num) held.
+ */
+static void __chunk_remove(list_shard_t* shard, int num, struct list_head* spare) {
+	list_chunk_t* chunk;
+	list_chunk_t* aux;
+	list_chunk_t* copy;
+	unsigned int i, kept, matches;
+
+	list_for_each_entry_safe(chunk, aux, &shard->chunks, links) {
+		matches = 0;
+		for (i = 0; i < chunk->used; i++)
+			matches += (chunk->vals[i] == num);
+		if (matches == 0)
+			continue;
+
+		if (matches == chunk->used) {
+			list_del_rcu(&chunk->links);
+		} else {
+			copy = take_chunk(spare);
+			if (copy == NULL)
+				continue;
+			kept = 0;
+			for (i = 0; i < chunk->used; i++) {
+				if (chunk->vals[i] != num)
+					copy->vals[kept++] = chunk->vals[i];
+			}
+			copy->used = kept;
+			list_replace_rcu(&chunk->links, &copy->links);
+		}
+		shard->length -= matches;
+		bump_list_gen();
+		call_rcu(&chunk->rcu, free_chunk_rcu);
+	}
+}
+
+/**
+ * Remove all the chunks of a shard.
+ * Must be called with the shard lock held.
+ */
+static void __chunk_clear(list_shard_t* shard) {
+	list_chunk_t* chunk;
+	list_chunk_t* aux;
+
+	list_for_each_entry_safe(chunk, aux, &shard->chunks, links) {
+		list_del_rcu(&chunk->links);
+		bump_list_gen();
+		call_rcu(&chunk->rcu, free_chunk_rcu);
+	}
+	shard->length = 0;
+}
+
+/* Backend dispatch. Must be called with the shard lock held; "spare" is only used by "chunks" */
+static void __remove_value(list_shard_t* shard, int num, struct list_head* spare) {
+	if (use_chunks)
+		__chunk_remove(shard, num, spare);
+	else
+		__remove_from_list(shard, num);
+}
+
+static void __clear_shard(list_shard_t* shard) {
+	if (use_chunks)
+		__chunk_clear(shard);
+	else
+		__clear_nodes(shard);
+}
+
+/**
+ * Remove all elements from the list, one shard at a time.
  */
 static void clear_list(void) {
+	unsigned int i;
+
+	for (i = 0; i < nr_shards; i++) {
+		spin_lock(&shards[i].lock); // Lock
+		__clear_shard(&shards[i]);
+		spin_unlock(&shards[i].lock); // Unlock
+	}
+}
+
+/**
+ * Insert an already allocated node in the list.
+ * Must be called with the lock of value_shard(new_node->data) held.
+ */
+static void __insert_node(list_shard_t* shard, list_item_t* new_node) {
+	list_add_rcu(&new_node->links, &shard->list);
+	hlist_add_head_rcu(&new_node->hnode, value_bucket(new_node->data));
+	shard->length++;
+}
+
+/**
+ * Used by the batched paths to keep a shard locked while consecutive
+ * operations target it. Releases "locked" (if any) and locks "shard",
+ * unless it is the same one. Returns the shard now locked.
+ */
+static list_shard_t* switch_shard(list_shard_t* locked, list_shard_t* shard) {
+	if (locked == shard)
+		return shard;
+	if (locked)
+		spin_unlock(&locked->lock); // Unlock
+	if (shard)
+		spin_lock(&shard->lock); // Lock
+	return shard;
+}
+
+/**
+ * Number of elements equal to "num". Lockless, only visits one bucket
+ * (or, with the "chunks" backend, the chunks of one shard).
+ */
+static int count_value(int num) {
+	list_item_t* cur;
+	list_chunk_t* chunk;
+	unsigned int i, used;
+	int count = 0;
+
+	rcu_read_lock();
+	if (use_chunks) {
+		list_for_each_entry_rcu(chunk, &value_shard(num)->chunks, links) {
+			used = smp_load_acquire(&chunk->used);
+			for (i = 0; i < used; i++)
+				count += (chunk->vals[i] == num);
+		}
+	} else {
+		hlist_for_each_entry_rcu(cur, value_bucket(num), hnode) {
+			if(cur->data == num)
+				count++;
+		}
+	}
+	rcu_read_unlock();
+	return count;
+}
+
+enum { CMD_NONE, CMD_ADD, CMD_REMOVE, CMD_CLEANUP };
+
+/* Longest line a write() may leave unterminated for the next one */
+#define MAX_CMD_LEN 64
+
+/*
+ * Parses a single command line. Returns one of CMD_* or -EINVAL. "%n" gives
+ * where the command ended, so trailing garbage ("add 5x", "cleanupXYZ")
+ * makes the whole line invalid; trailing whitespace is allowed.
+ */
+static int parse_cmd(const char* line, int* num) {
+	int end;
+
+	if(*line == '\0')
+		return CMD_NONE; /* Blank lines are ignored */
+	end = -1;
+	if(sscanf(line, "add %d %n", num, &end) == 1 && end >= 0 && line[end] == '\0')
+		return CMD_ADD;
+	end = -1;
+	if(sscanf(line, "remove %d %n", num, &end) == 1 && end >= 0 && line[end] == '\0')
+		return CMD_REMOVE;
+	end = -1;
+	if(sscanf(line, "cleanup %n", &end) == 0 && end >= 0 && line[end] == '\0')
+		return CMD_CLEANUP;
+	return -EINVAL;
+}
+
+static void free_nodes(struct list_head* nodes) {
 	list_item_t* cur;
 	list_item_t* aux;
 
-	write_lock(&rw); // Lock
-	list_for_each_entry_safe(cur, aux, &mylist, links) {
+	list_for_each_entry_safe(cur, aux, nodes, links) {
 		list_del( &(cur->links) );
-		vfree(cur);
+		free_item(cur);
 	}
-	length = 0;
-	t_chars = 0;
-	write_unlock(&rw); // Unlock
 }
 
-/**
- * Insert a new element in the list.
+/*
+ * Read side of /proc/my_mod, built on seq_file.
+ *
+ * seq_file renders at most one page per read() call and calls start()/stop()
+ * around each chunk, so a chunk is rendered inside a single RCU read-side
+ * critical section. To avoid walking the list from the head on every chunk,
+ * the last node handed out is remembered together with its shard and its
+ * position; it can be reused as long as no node has been removed since
+ * (list_gen unchanged).
+ * list_gen is sampled once, right after rcu_read_lock(), and that snapshot
+ * is what the cursor keeps. Removers bump it between unlinking a node and
+ * queueing its call_rcu(), so a node found after the snapshot was either
+ * still linked when it was taken or is freed only after a bump the next
+ * start() will see.
+ * The "chunks" backend works the same way, with a (chunk, index) cursor:
+ * chunks are only freed, replaced or compacted by removals, which bump
+ * list_gen the same way.
+ */
+typedef struct {
+	void* cur;             /* Node (or value, for "chunks") at position "pos" */
+	unsigned int shard;    /* Shard of "cur" */
+	list_chunk_t* chunk;   /* "chunks" only: chunk of "cur"... */
+	unsigned int idx;      /* ...and its index in it */
+	loff_t pos;
+	long gen;              /* list_gen when the critical section of "cur" started */
+	/* Write side: the unterminated last line of the previous write() */
+	struct mutex write_lock;
+	char partial[MAX_CMD_LEN + 1];
+	unsigned int partial_len;
+} list_cursor_t;
+
+/*
+ * Takes the list_gen snapshot of a new critical section. Returns whether
+ * the cursor is still valid, and leaves the snapshot in cursor->gen.
  */
-static void insert_new(int num) {
-	list_item_t* new_node = vmalloc(sizeof (list_item_t));
-	if(new_node) {
-		new_node->data = num;
-		write_lock(&rw); // Lock
-		list_add(&new_node->links, &mylist);
-		length++;
-		t_chars += intlen(num);
-		write_unlock(&rw); // Unlock
+static bool list_seq_snapshot(list_cursor_t* cursor) {
+	long gen = atomic_long_read(&list_gen);
+	bool valid = cursor->cur && cursor->gen == gen;
+
+	smp_rmb(); /* Nodes are looked up after the snapshot */
+	cursor->gen = gen;
+	return valid;
+}
+
+static void* list_seq_remember(struct seq_file *m, void* node, unsigned int shard, loff_t pos) {
+	list_cursor_t* cursor = m->private;
+
+	cursor->cur = node;
+	cursor->shard = shard;
+	cursor->pos = pos;
+	return node;
+}
+
+/* First node of shards[*idx], or of the next non-empty shard. NULL at the end */
+static struct list_head* shard_first_rcu(unsigned int* idx) {
+	struct list_head* lh;
+
+	for (; *idx < nr_shards; (*idx)++) {
+		lh = rcu_dereference(list_next_rcu(&shards[*idx].list));
+		if (lh != &shards[*idx].list)
+			return lh;
 	}
+	return NULL;
 }
 
+/* RCU flavours of seq_list_start()/seq_list_next(), chaining the shards */
+static struct list_head* list_start_rcu(loff_t pos, unsigned int* idx) {
+	list_item_t* item;
 
-static ssize_t list_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
-	char* args;
+	for (*idx = 0; *idx < nr_shards; (*idx)++) {
+		list_for_each_entry_rcu(item, &shards[*idx].list, links) {
+			if (pos-- == 0)
+				return &item->links;
+		}
+	}
+	return NULL;
+}
+
+static struct list_head* list_next_node_rcu(struct list_head* lh, unsigned int* idx) {
+	lh = rcu_dereference(list_next_rcu(lh));
+	if (lh != &shards[*idx].list)
+		return lh;
+
+	(*idx)++;
+	return shard_first_rcu(idx);
+}
+
+static void* list_seq_next(struct seq_file *m, void *v, loff_t *pos);
+
+static void* list_seq_start(struct seq_file *m, loff_t *pos) {
+	list_cursor_t* cursor = m->private;
+	struct list_head* lh;
+	unsigned int idx;
+
+	rcu_read_lock();
+	if (list_seq_snapshot(cursor)) {
+		if (cursor->pos == *pos)
+			return cursor->cur;
+		if (cursor->pos + 1 == *pos) /* The last record was split across reads */
+			return list_seq_next(m, cursor->cur, &cursor->pos);
+	}
+
+	lh = list_start_rcu(*pos, &idx);
+	return list_seq_remember(m, lh, idx, *pos);
+}
+
+static void* list_seq_next(struct seq_file *m, void *v, loff_t *pos) {
+	list_cursor_t* cursor = m->private;
+	unsigned int idx = cursor->shard;
+	struct list_head* lh;
+
+	++*pos;
+	lh = list_next_node_rcu(v, &idx);
+	return list_seq_remember(m, lh, idx, *pos);
+}
+
+static void list_seq_stop(struct seq_file *m, void *v) {
+	rcu_read_unlock();
+}
+
+static int list_seq_show(struct seq_file *m, void *v) {
+	list_item_t* item = list_entry(v, list_item_t, links);
+
+	seq_printf(m, "%d\n", item->data);
+	return 0;
+}
+
+static const struct seq_operations list_seq_ops = {
+	.start = list_seq_start,
+	.next = list_seq_next,
+	.stop = list_seq_stop,
+	.show = list_seq_show,
+};
+
+/*
+ * Newest value of the chunk after "lh" that isn't empty, moving on to the
+ * next shards when cursor->shard runs out. NULL at the end.
+ */
+static int* chunk_first_rcu(list_cursor_t* cursor, struct list_head* lh) {
+	list_chunk_t* chunk;
+	unsigned int used;
+
+	for (;;) {
+		for (lh = rcu_dereference(list_next_rcu(lh)); lh != &shards[cursor->shard].chunks;
+				lh = rcu_dereference(list_next_rcu(lh))) {
+			chunk = list_entry(lh, list_chunk_t, links);
+			used = smp_load_acquire(&chunk->used);
+			if (used > 0) {
+				cursor->chunk = chunk;
+				cursor->idx = used - 1;
+				return &chunk->vals[cursor->idx];
+			}
+		}
+		if (++cursor->shard >= nr_shards)
+			return NULL;
+		lh = &shards[cursor->shard].chunks;
+	}
+}
+
+static int* chunk_start_rcu(list_cursor_t* cursor, loff_t pos) {
+	list_chunk_t* chunk;
+	unsigned int used;
+
+	for (cursor->shard = 0; cursor->shard < nr_shards; cursor->shard++) {
+		list_for_each_entry_rcu(chunk, &shards[cursor->shard].chunks, links) {
+			used = smp_load_acquire(&chunk->used);
+			if (pos < used) {
+				cursor->chunk = chunk;
+				cursor->idx = used - 1 - pos;
+				return &chunk->vals[cursor->idx];
+			}
+			pos -= used;
+		}
+	}
+	return NULL;
+}
+
+static void* chunk_seq_next(struct seq_file *m, void *v, loff_t *pos);
+
+static void* chunk_seq_start(struct seq_file *m, loff_t *pos) {
+	list_cursor_t* cursor = m->private;
+	int* val;
+
+	rcu_read_lock();
+	if (list_seq_snapshot(cursor)) {
+		if (cursor->pos == *pos)
+			return cursor->cur;
+		if (cursor->pos + 1 == *pos) /* The last record was split across reads */
+			return chunk_seq_next(m, cursor->cur, &cursor->pos);
+	}
+
+	val = chunk_start_rcu(cursor, *pos);
+	return list_seq_remember(m, val, cursor->shard, *pos);
+}
+
+static void* chunk_seq_next(struct seq_file *m, void *v, loff_t *pos) {
+	list_cursor_t* cursor = m->private;
+	int* val;
+
+	++*pos;
+	if (cursor->idx > 0) {
+		cursor->idx--;
+		val = &cursor->chunk->vals[cursor->idx];
+	} else {
+		val = chunk_first_rcu(cursor, &cursor->chunk->links);
+	}
+	return list_seq_remember(m, val, cursor->shard, *pos);
+}
+
+static int chunk_seq_show(struct seq_file *m, void *v) {
+	seq_printf(m, "%d\n", *(int*) v);
+	return 0;
+}
+
+static const struct seq_operations chunk_seq_ops = {
+	.start = chunk_seq_start,
+	.next = chunk_seq_next,
+	.stop = list_seq_stop,
+	.show = chunk_seq_show,
+};
+
+typedef struct {
+	int op;
 	int num;
+} list_cmd_t;
 
-	if ((*off) > 0)  /* The application can write in this entry just once !! */
-		return 0;
+/*
+ * Applies a batch of newline-separated commands:
+ *	add 3
+ *	remove 7
+ *	cleanup
+ * Every line is parsed once into "cmds", and every node (or chunk) the batch
+ * may need is allocated, before anything is applied; then all the commands
+ * are applied in order. A shard lock is only released when the next command
+ * targets another shard, so with a single shard the batch is applied under
+ * one lock acquisition. If any line is malformed nothing is applied and the
+ * result is -EINVAL; if the allocation fails, -ENOMEM and nothing is applied
+ * either. "args" is split in place; its last line ends in a newline or a NUL.
+ */
+static int list_apply(char* args, size_t len) {
+	char* line;
+	char* end = args + len;
+	char* nl;
+	int num;
+	int op;
+	int nr_lines = 0;
+	int nr_adds = 0;
+	list_cmd_t* cmds;
+	unsigned int nr_cmds = 0;
+	unsigned int i;
+	list_item_t* node;
+	list_shard_t* locked = NULL;
+	LIST_HEAD(new_nodes);
+	LIST_HEAD(spare_chunks);
+	chunk_plan_t plan = { .shards = NULL };
+	int ret = 0;
 
-	args = vmalloc(len+1);
+	/* The shortest command, "add1", takes 5 bytes with its terminator */
+	cmds = vmalloc((len / 5 + 1) * sizeof(list_cmd_t));
+	if (cmds == NULL)
+		return -ENOMEM;
+	if (use_chunks) {
+		if (chunk_plan_init(&plan)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		mutex_lock(&chunk_batch_lock);
+	}
+
+	/* Single pass: split and parse the lines, and count the nodes (or chunks) needed */
+	for (line = args; line < end; line += strlen(line) + 1) {
+		nl = strchr(line, '\n');
+		if (nl)
+			*nl = '\0';
+		nr_lines++;
+
+		op = parse_cmd(line, &num);
+		if (op < 0) {
+			pr_info_ratelimited("my_mod: invalid command at line %d\n", nr_lines);
+			ret = op;
+			goto out;
+		}
+		if (op == CMD_NONE)
+			continue;
+		cmds[nr_cmds].op = op;
+		cmds[nr_cmds].num = num;
+		nr_cmds++;
 
+		if (!use_chunks) {
+			nr_adds += (op == CMD_ADD);
+		} else if (op == CMD_ADD) {
+			chunk_plan_add(&plan, num);
+		} else if (op == CMD_REMOVE) {
+			chunk_plan_remove(&plan, num);
+		} else if (op == CMD_CLEANUP) {
+			chunk_plan_cleanup(&plan);
+		}
+	}
+
+	/* Allocate the nodes and chunks outside the shard locks, since the allocation may sleep */
+	if (alloc_chunks(&spare_chunks, plan.nr_chunks)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (; nr_adds > 0; nr_adds--) {
+		node = alloc_item();
+		if (node == NULL) {
+			free_nodes(&new_nodes);
+			ret = -ENOMEM;
+			goto out;
+		}
+		list_add(&node->links, &new_nodes);
+	}
+
+	/* Apply the whole batch */
+	for (i = 0; i < nr_cmds; i++) {
+		num = cmds[i].num;
+		switch (cmds[i].op) {
+		case CMD_ADD:
+			locked = switch_shard(locked, value_shard(num));
+			if (use_chunks) {
+				__chunk_insert(locked, num, &spare_chunks);
+				break;
+			}
+			node = list_first_entry(&new_nodes, list_item_t, links);
+			list_del(&node->links);
+			node->data = num;
+			__insert_node(locked, node);
+			break;
+		case CMD_REMOVE:
+			locked = switch_shard(locked, value_shard(num));
+			__remove_value(locked, num, &spare_chunks);
+			break;
+		case CMD_CLEANUP:
+			locked = switch_shard(locked, NULL);
+			clear_list();
+			break;
+		}
+	}
+	switch_shard(locked, NULL);
+
+out:
+	if (plan.shards)
+		mutex_unlock(&chunk_batch_lock);
+	free_chunks(&spare_chunks); /* Left over when the count was an upper bound */
+	kfree(plan.shards);
+	vfree(cmds);
+	return ret;
+}
+
+/*
+ * A write() may end in the middle of a line (say, "cat big_file" cutting it
+ * at a page boundary): that unterminated line is kept in the cursor and
+ * completed by the next write(), or applied on its own at release. The
+ * complete lines of each write() are one batch for list_apply(); if it
+ * fails, the write() fails and the kept line is left as it was.
+ */
+static ssize_t list_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
+	list_cursor_t* cursor = ((struct seq_file*) filp->private_data)->private;
+	char* args;
+	size_t total;
+	size_t complete;
+	ssize_t ret = len;
+
+	mutex_lock(&cursor->write_lock);
+	total = cursor->partial_len + len;
+	args = vmalloc(total + 1);
+	if (args == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	memcpy(args, cursor->partial, cursor->partial_len);
     	/* Transfer data from user to kernel space */
-	if (copy_from_user(args, buf, len))
-		return -EFAULT;
+	if (copy_from_user(args + cursor->partial_len, buf, len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	args[total] = '\0';
 
-	/* Parse input.
-	   Format --> op param(int)
-	*/
-	if(sscanf(args, "add %d", &num) == 1) {
-		insert_new(num);
-	} else if(sscanf(args, "remove %d", &num) == 1){
-		remove_from_list(num);
-	} else if(strncmp(args, "cleanup", 7) == 0){
-		clear_list();
+	/* Everything up to the last newline is applied now, the rest is kept */
+	for (complete = total; complete > 0 && args[complete - 1] != '\n'; complete--)
+		;
+	if (total - complete > MAX_CMD_LEN) {
+		pr_info_ratelimited("my_mod: command line too long\n");
+		ret = -EINVAL;
+		goto out;
 	}
 
-	vfree(args);
+	if (complete > 0) {
+		ret = list_apply(args, complete);
+		if (ret < 0)
+			goto out;
+		ret = len;
+	}
+	memcpy(cursor->partial, args + complete, total - complete);
+	cursor->partial_len = total - complete;
 
 	*off+=len; /* Update the file pointer */
+out:
+	mutex_unlock(&cursor->write_lock);
+	vfree(args);
+	return ret;
+}
 
-	return len;
+static int list_open(struct inode *inode, struct file *filp) {
+	int ret = seq_open_private(filp, use_chunks ? &chunk_seq_ops : &list_seq_ops,
+			sizeof(list_cursor_t));
+
+	if (ret == 0)
+		mutex_init(&((list_cursor_t*) ((struct seq_file*) filp->private_data)->private)->write_lock);
+	return ret;
+}
+
+/* A last line without its newline is still a command */
+static int list_release(struct inode *inode, struct file *filp) {
+	list_cursor_t* cursor = ((struct seq_file*) filp->private_data)->private;
+
+	if (cursor->partial_len > 0) {
+		cursor->partial[cursor->partial_len] = '\0';
+		if (list_apply(cursor->partial, cursor->partial_len) < 0)
+			pr_info_ratelimited("my_mod: last command dropped at close\n");
+	}
+	return seq_release_private(inode, filp);
 }
 
+/* Values moved per chunk by the ioctl interface */
+#define IOCTL_CHUNK (PAGE_SIZE / sizeof(int))
+
+/*
+ * MY_MOD_IOC_ADD: values are copied from user space a page at a time; the
+ * nodes (or chunks) of each page are allocated first and then inserted,
+ * keeping a shard locked while consecutive values fall in it.
+ */
+static long list_ioctl_add(struct my_mod_ints* req) {
+	int __user *src = (int __user *) (unsigned long) req->data;
+	int* kbuf;
+	list_item_t* node;
+	list_shard_t* locked = NULL;
+	LIST_HEAD(new_nodes);
+	LIST_HEAD(spare_chunks);
+	chunk_plan_t plan = { .shards = NULL };
+	unsigned int done = 0;
+	unsigned int n, i;
+	long ret = 0;
+
+	kbuf = (int*) __get_free_page(GFP_KERNEL);
+	if (kbuf == NULL)
+		return -ENOMEM;
+	if (use_chunks && chunk_plan_init(&plan)) {
+		free_page((unsigned long) kbuf);
+		return -ENOMEM;
+	}
+
+	while (done < req->count) {
+		n = min_t(unsigned int, req->count - done, IOCTL_CHUNK);
+		if (copy_from_user(kbuf, src + done, n * sizeof(int))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (use_chunks) {
+			mutex_lock(&chunk_batch_lock);
+			chunk_plan_reset(&plan);
+			for (i = 0; i < n; i++)
+				chunk_plan_add(&plan, kbuf[i]);
+			if (alloc_chunks(&spare_chunks, plan.nr_chunks)) {
+				mutex_unlock(&chunk_batch_lock);
+				ret = -ENOMEM;
+				break;
+			}
+
+			for (i = 0; i < n; i++) {
+				locked = switch_shard(locked, value_shard(kbuf[i]));
+				__chunk_insert(locked, kbuf[i], &spare_chunks);
+			}
+			locked = switch_shard(locked, NULL);
+			mutex_unlock(&chunk_batch_lock);
+		} else {
+			for (i = 0; i < n; i++) {
+				node = alloc_item();
+				if (node == NULL)
+					break;
+				node->data = kbuf[i];
+				list_add_tail(&node->links, &new_nodes);
+			}
+
+			while (!list_empty(&new_nodes)) {
+				node = list_first_entry(&new_nodes, list_item_t, links);
+				list_del(&node->links);
+				locked = switch_shard(locked, value_shard(node->data));
+				__insert_node(locked, node);
+			}
+		}
+		locked = switch_shard(locked, NULL);
+		free_chunks(&spare_chunks); /* Left over when values shared a chunk's room */
+
+		done += i;
+		if (i < n) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+
+	free_chunks(&spare_chunks);
+	kfree(plan.shards);
+	free_page((unsigned long) kbuf);
+	/* Report a partial insertion rather than the error */
+	return done > 0 ? done : ret;
+}
 
-static ssize_t list_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
+/*
+ * MY_MOD_IOC_SNAPSHOT: the values are gathered under RCU into a kernel
+ * array (copy_to_user() can't be called inside the read-side section) and
+ * then copied out in one go.
+ */
+static long list_ioctl_snapshot(struct my_mod_ints* req, struct my_mod_ints __user *ureq) {
+	int __user *dst = (int __user *) (unsigned long) req->data;
+	int* kbuf;
 	list_item_t* cur;
-	int nr_bytes;
-	char* aux;
-	int real_bytes;
-	int i = 0;
-	
-	if ((*off) > 0) /* Tell the application that there is nothing left to read */
-		return 0;
-	
-	/* aux size =  # ints + # \n + 1 (\0)*/
-	nr_bytes = t_chars * sizeof(char) + length * sizeof(char); // Dirty read
+	list_chunk_t* chunk;
+	unsigned int n = 0;
+	unsigned int total = 0;
+	unsigned int max;
+	unsigned int i, j;
 
-	if (len < nr_bytes)
-		return -ENOSPC;
-	
-	aux = vmalloc(nr_bytes + 1);
-	
-	/* Iterate over the list and store the contents in aux */
-	read_lock(&rw);
-	real_bytes = t_chars * sizeof(char) + length * sizeof(char);
-	if(real_bytes > nr_bytes) {
-		read_unlock(&rw);
-		vfree(aux);
-		return -ENOSPC;
+	max = min_t(unsigned int, req->count, list_length());
+	kbuf = vmalloc(max_t(unsigned int, max, 1) * sizeof(int));
+	if (kbuf == NULL)
+		return -ENOMEM;
+
+	rcu_read_lock();
+	for (i = 0; i < nr_shards; i++) {
+		if (use_chunks) {
+			list_for_each_entry_rcu(chunk, &shards[i].chunks, links) {
+				for (j = smp_load_acquire(&chunk->used); j > 0; j--) {
+					if (n < max)
+						kbuf[n++] = chunk->vals[j - 1];
+					total++;
+				}
+			}
+		} else {
+			list_for_each_entry_rcu(cur, &shards[i].list, links) {
+				if (n < max)
+					kbuf[n++] = cur->data;
+				total++;
+			}
+		}
 	}
-	list_for_each_entry(cur, &mylist, links) {
-		i += sprintf(&aux[i], "%d\n", cur->data);
+	rcu_read_unlock();
+
+	if (copy_to_user(dst, kbuf, n * sizeof(int)) ||
+			put_user(total, &ureq->total)) {
+		vfree(kbuf);
+		return -EFAULT;
 	}
-	read_unlock(&rw);
-	aux[i] = '\0';
 
+	vfree(kbuf);
+	return n;
+}
+
+static long list_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct my_mod_ints __user *ureq = (struct my_mod_ints __user *) arg;
+	struct my_mod_ints req;
 
-	/* Transfer data from user to kernel space */
-	if (copy_to_user(buf,aux,nr_bytes))
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+	if (req.count > INT_MAX)
 		return -EINVAL;
 
-	(*off)+=len;
-	vfree(aux);
-	
-	return nr_bytes; 
+	switch (cmd) {
+	case MY_MOD_IOC_ADD:
+		return list_ioctl_add(&req);
+	case MY_MOD_IOC_SNAPSHOT:
+		return list_ioctl_snapshot(&req, ureq);
+	default:
+		return -ENOTTY;
+	}
 }
 
 static const struct file_operations proc_entry_fops = {
-    .read = list_read,
+    .open = list_open,
+    .read = seq_read,
     .write = list_write,
+    .unlocked_ioctl = list_ioctl,
+    .compat_ioctl = list_ioctl, /* struct my_mod_ints has the same layout on 32 and 64 bits */
+    .llseek = seq_lseek,
+    .release = list_release,
+};
+
+/* Shows this:
+	allocs=1024        // 7 + 11 + 1  chars
+	frees=24           // 6 + 11 + 1  chars
+	alloc_fails=0      // 12 + 11 + 1 chars
+	live=1000          // 5 + 11 + 1  chars
+	length=1000        // 7 + 11 + 1  chars
+	object_size=32     // 12 + 10 + 1 chars
+	shards=1           // 7 + 10 + 1  chars
+	backend=chunks     // 8 + 6 + 1   chars
+	chunks=0           // 7 + 11 + 1  chars
+	bytes_per_elem=32  // 15 + 10 + 1 chars
+	------------------ // TOTAL 198 + 1 chars
+*/
+static ssize_t stats_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
+	char str[199];
+	int allocs, frees, live;
+	int length, chunks;
+	unsigned int obj_size;
+	unsigned int bytes_per_elem;
+	int ret;
+
+	if ((*off) > 0) /* Tell the application that there is nothing left to read */
+		return 0;
+
+	allocs = atomic_read(&nr_allocs);
+	frees = atomic_read(&nr_frees);
+	live = allocs - frees;
+	obj_size = kmem_cache_size(item_cache);
+	length = list_length();
+	chunks = atomic_read(&nr_chunks);
+
+	/* Memory that holds the values, not counting the value index */
+	if (use_chunks)
+		bytes_per_elem = length > 0 ? (unsigned long) chunks * CHUNK_SIZE / length : 0;
+	else
+		bytes_per_elem = obj_size;
+
+	ret = snprintf(str, sizeof(str),
+			"allocs=%d\n"
+			"frees=%d\n"
+			"alloc_fails=%d\n"
+			"live=%d\n"
+			"length=%d\n"
+			"object_size=%u\n"
+			"shards=%u\n"
+			"backend=%s\n"
+			"chunks=%d\n"
+			"bytes_per_elem=%u\n",
+			allocs, frees, atomic_read(&nr_alloc_fails), live,
+			length, obj_size, nr_shards, use_chunks ? "chunks" : "list",
+			chunks, bytes_per_elem);
+
+	if (ret > len)
+		return -ENOSPC;
+
+	if (copy_to_user(buf, str, ret))
+		return -EFAULT;
+
+	(*off) += ret;
+	return ret;
+}
+
+static const struct file_operations stats_proc_entry_fops = {
+    .read = stats_read,
+};
+
+/*
+ * /proc/my_mod_query: write "count N" or "contains N", then read the answer
+ * from the same open file. Each query is answered once; write a new one to
+ * ask again.
+ */
+typedef struct {
+	int op;
+	int num;
+	int answered;
+} list_query_t;
+
+enum { QUERY_NONE, QUERY_COUNT, QUERY_CONTAINS };
+
+static int query_open(struct inode *inode, struct file *filp) {
+	filp->private_data = kzalloc(sizeof(list_query_t), GFP_KERNEL);
+	return filp->private_data ? 0 : -ENOMEM;
+}
+
+static int query_release(struct inode *inode, struct file *filp) {
+	kfree(filp->private_data);
+	return 0;
+}
+
+/*
+ * Parses a query. Returns QUERY_COUNT, QUERY_CONTAINS or -EINVAL; as in
+ * parse_cmd(), trailing garbage ("count 5abc") makes it invalid.
+ */
+static int parse_query(const char* str, int* num) {
+	int end;
+
+	end = -1;
+	if (sscanf(str, "count %d %n", num, &end) == 1 && end >= 0 && str[end] == '\0')
+		return QUERY_COUNT;
+	end = -1;
+	if (sscanf(str, "contains %d %n", num, &end) == 1 && end >= 0 && str[end] == '\0')
+		return QUERY_CONTAINS;
+	return -EINVAL;
+}
+
+static ssize_t query_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
+	list_query_t* query = filp->private_data;
+	char str[32];
+	int num;
+	int op;
+
+	if (len >= sizeof(str))
+		return -EINVAL;
+	if (copy_from_user(str, buf, len))
+		return -EFAULT;
+	str[len] = '\0';
+
+	op = parse_query(str, &num);
+	if (op < 0)
+		return op;
+	query->op = op;
+	query->num = num;
+	query->answered = 0;
+
+	return len;
+}
+
+static ssize_t query_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
+	list_query_t* query = filp->private_data;
+	char str[13]; /* 11 chars + \n + \0 */
+	int count;
+	int ret;
+
+	if (query->op == QUERY_NONE)
+		return -EINVAL;
+	if (query->answered)
+		return 0;
+
+	count = count_value(query->num);
+	if (query->op == QUERY_CONTAINS)
+		count = (count > 0);
+
+	ret = snprintf(str, sizeof(str), "%d\n", count);
+	if (ret > len)
+		return -ENOSPC;
+
+	if (copy_to_user(buf, str, ret))
+		return -EFAULT;
+
+	query->answered = 1;
+	return ret;
+}
+
+static const struct file_operations query_proc_entry_fops = {
+    .open = query_open,
+    .read = query_read,
+    .write = query_write,
+    .release = query_release,
 };
 
 
 int init_list_module( void ) {
   int ret = 0;
+	unsigned int i;
+
+	if (hash_bits < 1 || hash_bits > 24) {
+		printk(KERN_INFO "my_mod: hash_bits must be between 1 and 24\n");
+		return -EINVAL;
+	}
+	if (strcmp(backend, "chunks") == 0) {
+		use_chunks = true;
+	} else if (strcmp(backend, "list") != 0) {
+		printk(KERN_INFO "my_mod: backend must be \"list\" or \"chunks\"\n");
+		return -EINVAL;
+	}
+	if (nr_shards < 1 || nr_shards > 1024 || nr_shards > (1 << hash_bits)) {
+		printk(KERN_INFO "my_mod: nr_shards must be between 1 and min(1024, 2^hash_bits)\n");
+		return -EINVAL;
+	}
+
+	item_cache = kmem_cache_create("my_mod_item", sizeof(list_item_t), 0, 0, NULL);
+	if (item_cache == NULL) {
+		printk(KERN_INFO "my_mod: Can't create slab cache\n");
+		return -ENOMEM;
+	}
+
+	/* All-zero hlist_heads are empty buckets */
+	value_index = vzalloc((1 << hash_bits) * sizeof(struct hlist_head));
+	if (value_index == NULL) {
+		printk(KERN_INFO "my_mod: Can't allocate the value index\n");
+		kmem_cache_destroy(item_cache);
+		return -ENOMEM;
+	}
+
+	shards = kcalloc(nr_shards, sizeof(list_shard_t), GFP_KERNEL);
+	if (shards == NULL) {
+		printk(KERN_INFO "my_mod: Can't allocate the shards\n");
+		vfree(value_index);
+		kmem_cache_destroy(item_cache);
+		return -ENOMEM;
+	}
+	for (i = 0; i < nr_shards; i++) {
+		spin_lock_init(&shards[i].lock);
+		INIT_LIST_HEAD(&shards[i].list);
+		INIT_LIST_HEAD(&shards[i].chunks);
+	}
 
 	proc_entry = proc_create( "my_mod", 0666, NULL, &proc_entry_fops);
-	if (proc_entry == NULL) {
+	stats_proc_entry = proc_create( "my_mod_stats", 0444, NULL, &stats_proc_entry_fops);
+	query_proc_entry = proc_create( "my_mod_query", 0666, NULL, &query_proc_entry_fops);
+	if (proc_entry == NULL || stats_proc_entry == NULL || query_proc_entry == NULL) {
 		ret = -ENOMEM;
 		printk(KERN_INFO "my_mod: Can't create /proc entry\n");
+		if (proc_entry)
+			remove_proc_entry("my_mod", NULL);
+		if (stats_proc_entry)
+			remove_proc_entry("my_mod_stats", NULL);
+		if (query_proc_entry)
+			remove_proc_entry("my_mod_query", NULL);
+		kfree(shards);
+		vfree(value_index);
+		kmem_cache_destroy(item_cache);
 	} else {
 		printk(KERN_INFO "my_mod: Module loaded\n");
-		length = 0;
-		t_chars = 0;
-		INIT_LIST_HEAD(&mylist);
 	}
 
   return ret;
@@ -193,7 +1341,13 @@ int init_list_module( void ) {
 
 void exit_list_module( void ) {
 	remove_proc_entry("my_mod", NULL);
+	remove_proc_entry("my_mod_stats", NULL);
+	remove_proc_entry("my_mod_query", NULL);
 	clear_list();
+	rcu_barrier(); /* Wait for the pending free_item_rcu() callbacks */
+	kfree(shards);
+	vfree(value_index);
+	kmem_cache_destroy(item_cache);
 
 	printk(KERN_INFO "my_mod: Module unloaded.\n");
 }
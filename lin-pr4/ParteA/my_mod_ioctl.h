@@ -0,0 +1,24 @@
+#ifndef MY_MOD_IOCTL_H
+#define MY_MOD_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Binary interface of /proc/my_mod, shared by the module and user programs.
+ * Values cross the boundary as packed arrays of int32, with no text parsing.
+ */
+struct my_mod_ints {
+	__u64 data;  /* User pointer to an array of int32 */
+	__u32 count; /* Number of elements of data */
+	__u32 total; /* SNAPSHOT only: length of the list when it was taken */
+};
+
+#define MY_MOD_IOC_MAGIC 'm'
+
+/* Insert the "count" values of "data". Returns how many were inserted */
+#define MY_MOD_IOC_ADD		_IOW(MY_MOD_IOC_MAGIC, 1, struct my_mod_ints)
+/* Copy up to "count" values into "data", in list order. Returns how many were copied */
+#define MY_MOD_IOC_SNAPSHOT	_IOWR(MY_MOD_IOC_MAGIC, 2, struct my_mod_ints)
+
+#endif
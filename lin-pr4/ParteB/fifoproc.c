@@ -6,186 +6,458 @@
 #include <linux/spinlock.h>
 #include <linux/kfifo.h>
 #include <linux/semaphore.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/uio.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+
+#define CREATE_TRACE_POINTS
+#include "prodcons_trace.h"
+#include "prodcons_spin.h"
+#include "prodcons_stats.h"
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Module pr4");
 MODULE_AUTHOR("Germán Franco Dorca - Álvaro Velasco García");
 
-#define MAX_CBUFFER_LEN 64
-#define MAX_KBUF 200
+#define MIN_RING_SIZE 64
+#define MAX_RING_SIZE (256 << 20)
+
+static unsigned int ring_size = 65536;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Bytes in the ring (64 B - 256 MiB, rounded up to a power of two)");
+
+/* Registros de hasta 65535 bytes: kfifo guarda la longitud en una cabecera de 2 */
+#define MAX_RECORD 65535
+
+static bool msg_mode = false;
+module_param(msg_mode, bool, 0444);
+MODULE_PARM_DESC(msg_mode, "Keep each write() (each writev() segment) as a record; a read() returns one whole record");
+
+static unsigned int spin_us = 0;
+module_param(spin_us, uint, 0644);
+MODULE_PARM_DESC(spin_us, "Microseconds to spin waiting for the other end before sleeping (0 = always sleep)");
 
 static struct proc_dir_entry *proc_entry;
+static struct proc_dir_entry *stats_proc_entry;
+
+static struct kfifo cbuffer; /* El anillo como flujo de bytes */
+static struct kfifo_rec_ptr_2 rbuffer; /* El mismo anillo como registros, con msg_mode */
+static void *ring; /* Memoria de cbuffer; vmalloc para admitir anillos de muchos MB */
+static struct semaphore mtx; /* Para garantizar exclusión mutua en open/release */
+
+/*
+ * kfifo admite un lector y un escritor a la vez sin ningún cerrojo. Los
+ * productores solo se serializan entre sí (wr_lock) y los consumidores entre
+ * sí (rd_lock), así que productor y consumidor nunca comparten un cerrojo: con
+ * uno a cada lado cada mutex está libre y solo lo toca su propio lado.
+ */
+static DEFINE_MUTEX(wr_lock);
+static DEFINE_MUTEX(rd_lock);
+static DECLARE_WAIT_QUEUE_HEAD(wq_prod); /* Cola de espera para productor(es) */
+static DECLARE_WAIT_QUEUE_HEAD(wq_cons); /* Cola de espera para consumidor(es) */
+
+static int prod_count = 0; /* Número de procesos que abrieron la entrada /proc para escritura (productores) */
+static int cons_count = 0; /* Número de procesos que abrieron la entrada /proc para lectura (consumidores) */
 
-static struct kfifo cbuffer;
-static struct semaphore mtx; /* Para garantizar exclusión mutua */
-static struct semaphore sem_prod; /* Cola de espera para productor(es) */
-static struct semaphore sem_cons; /* Cola de espera para consumidor(es) */
+/* Presupuesto de espera activa de cada lado, en ns; protegidos por wr_lock y rd_lock */
+static unsigned int prod_spin_ns = 0;
+static unsigned int cons_spin_ns = 0;
 
-static volatile int prod_count = 0; /* Número de procesos que abrieron la entrada /proc para escritura (productores) */
-static volatile int cons_count = 0; /* Número de procesos que abrieron la entrada /proc para lectura (consumidores) */
-static volatile int nr_prod_waiting = 0; /* Número de procesos productores esperando */
-static volatile int nr_cons_waiting = 0; /* Número de procesos consumidores esperando */
+/* Estadísticas de /proc/prodcons_stats (ver prodcons_stats.h) */
+static DEFINE_PER_CPU(prodcons_stats_t, stats);
+static unsigned int ring_hwm = 0; /* Máxima ocupación del anillo; solo la sube un productor con wr_lock */
+
+/*
+ * Despierta a quien espere en "wq". La barrera ordena el cambio de estado
+ * previo (kfifo o contadores) antes de mirar la cola, que empareja con la de
+ * wait_event_interruptible(); así, si nadie espera, no se toca el cerrojo de
+ * la cola y el camino rápido no comparte nada con el otro extremo.
+ */
+static void wake_waiters(wait_queue_head_t *wq) {
+	smp_mb();
+	if (waitqueue_active(wq)) {
+		wake_up_interruptible(wq);
+		this_cpu_inc(stats.wakeups[wq == &wq_prod ? PROD : CONS]);
+		trace_prodcons_wake(wq == &wq_prod ? PROD : CONS);
+	}
+}
+
+/* Estado del anillo, sea cual sea su modo */
+static bool ring_empty(void) {
+	return msg_mode ? kfifo_is_empty(&rbuffer) : kfifo_is_empty(&cbuffer);
+}
+
+/* Cabe un registro de len bytes (con msg_mode) o algún byte más (sin él) */
+static bool ring_fits(size_t len) {
+	return msg_mode ? kfifo_avail(&rbuffer) >= len : !kfifo_is_full(&cbuffer);
+}
+
+static unsigned int ring_used(void) {
+	return msg_mode ? kfifo_len(&rbuffer) : kfifo_len(&cbuffer);
+}
+
+static void ring_reset(void) {
+	if (msg_mode)
+		kfifo_reset(&rbuffer);
+	else
+		kfifo_reset(&cbuffer);
+}
+
+/* Al empezar y acabar cada espera de spin_then_wait(): tracepoints y estadísticas */
+static void wait_start(prodcons_stats_t __percpu *s, int side) {
+	trace_prodcons_block(side);
+}
+
+static void wait_end(prodcons_stats_t __percpu *s, int side, u64 ns, int ret) {
+	account_blocked(s, side, ns);
+	trace_prodcons_unblock(side, ns, ret);
+}
+
+static int fifoproc_release(struct inode * inode, struct file * file);
 
 /* Se invoca al hacer open() de entrada /proc */
 static int fifoproc_open(struct inode * inode, struct file * file) {
+	int ret = 0;
+
 	if(down_interruptible(&mtx))
-			return -EINTR;
+		return -EINTR;
 
 	if (file->f_mode & FMODE_READ) {    // Consumidores
-		cons_count++;
-		while(nr_prod_waiting > 0) {   // cond_signal(prod);
-			nr_prod_waiting--;
-			up(&sem_prod);
-		}
-		while(prod_count < 1) {
-			nr_cons_waiting++; // cond_wait(cons,mtx);
-			up(&mtx);
-			if(down_interruptible(&sem_cons))
-				return -EINTR;
-			if(down_interruptible(&mtx))
-					return -EINTR;
-		}
+		WRITE_ONCE(cons_count, cons_count + 1);
+		up(&mtx);
+		wake_waiters(&wq_prod);
+		/* Esperar hasta que entre un productor */
+		if (file->f_flags & O_NONBLOCK)
+			ret = READ_ONCE(prod_count) > 0 ? 0 : -EAGAIN;
+		else if (wait_event_interruptible(wq_cons, READ_ONCE(prod_count) > 0))
+			ret = -EINTR;
 	} else {    // Productores
-		prod_count++;
-		while(nr_cons_waiting > 0) {   // cond_signal(cons);
-			nr_cons_waiting--;
-			up(&sem_cons);
-		}
-		while(cons_count < 1) {
-			nr_prod_waiting++; // cond_wait(cons,mtx);
-			up(&mtx);
-			if(down_interruptible(&sem_prod))
-				return -EINTR;
-			if(down_interruptible(&mtx))
-					return -EINTR;
-		}
+		WRITE_ONCE(prod_count, prod_count + 1);
+		up(&mtx);
+		wake_waiters(&wq_cons);
+		/* Esperar hasta que entre un consumidor */
+		if (file->f_flags & O_NONBLOCK)
+			ret = READ_ONCE(cons_count) > 0 ? 0 : -EAGAIN;
+		else if (wait_event_interruptible(wq_prod, READ_ONCE(cons_count) > 0))
+			ret = -EINTR;
 	}
-	up(&mtx);
-	return 0;
+
+	if (ret)
+		fifoproc_release(inode, file);
+	return ret;
 }
 
 /* Se invoca al hacer close() de entrada /proc */
 static int fifoproc_release(struct inode * inode, struct file * file) {
-	if(down_interruptible(&mtx))
-			return -EINTR;
-	if(file->f_mode & FMODE_READ) { // Lectores (consumidores)
-		cons_count--;
-		while(nr_prod_waiting > 0) {
-			nr_prod_waiting--;
-			up(&sem_prod);
-		}
-	} else { // Escritores (productores)
-		prod_count--;
-		while(nr_cons_waiting > 0) {
-			nr_cons_waiting--;
-			up(&sem_cons);
-		}
-	}
-
-	if(prod_count == 0 && cons_count == 0) 
-		kfifo_reset(&cbuffer);
+	/* No interrumpible: los contadores tienen que quedar bien siempre */
+	down(&mtx);
+	if(file->f_mode & FMODE_READ) // Lectores (consumidores)
+		WRITE_ONCE(cons_count, cons_count - 1);
+	else // Escritores (productores)
+		WRITE_ONCE(prod_count, prod_count - 1);
 
+	if(prod_count == 0 && cons_count == 0)
+		ring_reset();
 	up(&mtx);
+
+	/* El otro extremo puede estar esperando datos o hueco que ya no llegarán */
+	wake_waiters(file->f_mode & FMODE_READ ? &wq_prod : &wq_cons);
 	return 0;
 }
 
-/* Se invoca al hacer read() de entrada /proc */
-static ssize_t fifoproc_read(struct file * file, char *buff, size_t len, loff_t * offset) {
-	char kbuffer[MAX_KBUF];
-	if (len > MAX_CBUFFER_LEN || len > MAX_KBUF)
-		return -ENOMEM;
+/*
+ * Se invoca al hacer read() de entrada /proc. Como en un pipe, espera a que
+ * haya algún byte y devuelve los que haya, copiándolos directamente del
+ * anillo a los buffers de usuario. Con msg_mode cada segmento recibe un
+ * registro entero y la lectura acaba tras el primero que no llena su
+ * segmento. Un registro que no cabe en su segmento se queda en el anillo
+ * (-EMSGSIZE si es el primero).
+ *
+ * En estos kernels /proc no llama a ->read_iter: un readv() llega como un
+ * ->read por segmento y la VFS para en la primera lectura corta o con error.
+ * Con msg_mode, si cada registro llena justo su segmento, la lectura del
+ * siguiente se bloquea hasta que llegue otro registro (o se vayan los
+ * productores); con O_NONBLOCK se devuelve lo ya leído.
+ */
+static ssize_t fifoproc_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	struct file *file = iocb->ki_filp;
+	size_t read = 0;
+	struct iovec seg;
+	unsigned int copied;
+	int ret = 0;
 
-	if(down_interruptible(&mtx))
-		return -EINTR;
+	if (!iter_is_iovec(to))
+		return -EINVAL;
+	if (iov_iter_count(to) == 0)
+		return 0;
 
-	/* Esperar hasta que haya elementos para consumir (debe haber productores) */
-	while (kfifo_len(&cbuffer)<len && prod_count>0) {
-		nr_cons_waiting++; // cond_wait(cons,mtx);
-		up(&mtx);
-		if(down_interruptible(&sem_cons))
+	if ((file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+		if (!mutex_trylock(&rd_lock))
+			return -EAGAIN;
+		if (ring_empty() && READ_ONCE(prod_count) > 0) {
+			mutex_unlock(&rd_lock);
+			this_cpu_inc(stats.stalls[CONS]);
+			return -EAGAIN;
+		}
+	} else {
+		if (mutex_lock_interruptible(&rd_lock))
 			return -EINTR;
-		if(down_interruptible(&mtx))
+
+		/* Esperar hasta que haya elementos para consumir (debe haber productores) */
+		if (spin_then_wait(wq_cons, cons_spin_ns, spin_us, !ring_empty() || READ_ONCE(prod_count) == 0,
+				wait_start, wait_end, &stats, CONS)) {
+			mutex_unlock(&rd_lock);
 			return -EINTR;
+		}
 	}
 
-	/* Detectar fin de comunicación por error (consumidor cierra FIFO antes) */
-	if (prod_count==0 && kfifo_is_empty(&cbuffer)) {
-		up(&mtx);
-		return 0;
+	/* Vacía y sin productores es fin de comunicación: se devuelve 0 */
+	while (iov_iter_count(to) > 0 && !ring_empty()) {
+		seg = iov_iter_iovec(to);
+		if (msg_mode && kfifo_peek_len(&rbuffer) > seg.iov_len) {
+			ret = -EMSGSIZE;
+			break;
+		}
+		if (msg_mode)
+			ret = kfifo_to_user(&rbuffer, seg.iov_base, seg.iov_len, &copied);
+		else
+			ret = kfifo_to_user(&cbuffer, seg.iov_base, seg.iov_len, &copied);
+		/* Un -EFAULT a mitad deja lo ya copiado fuera del anillo: también cuenta */
+		read += copied;
+		if (ret)
+			break;
+		trace_prodcons_dequeue(copied, ring_used());
+
+		/* Con msg_mode el registro ocupa el segmento entero, aunque no lo llene */
+		iov_iter_advance(to, msg_mode ? seg.iov_len : copied);
+		if (msg_mode && copied < seg.iov_len)
+			break;
 	}
-	kfifo_out(&cbuffer,kbuffer,len);
+	mutex_unlock(&rd_lock);
 
 	/* Despertar a posible productor bloqueado */
-	if(nr_prod_waiting > 0) {   // cond_signal(prod);
-		nr_prod_waiting--;
-		up(&sem_prod);
+	if (read > 0) {
+		wake_waiters(&wq_prod);
+		this_cpu_add(stats.bytes[CONS], read);
+		this_cpu_inc(stats.ops[CONS]);
 	}
-	up(&mtx);
 
-	if (copy_to_user(buff,kbuffer,len))
-		return -EFAULT;
+	return read > 0 ? read : ret;
+}
+
+/*
+ * Se invoca al hacer write()/writev() de entrada /proc. Escribe todos los
+ * bytes en tantos trozos como haga falta, esperando hueco entre uno y otro,
+ * y despierta a los consumidores tras cada trozo para que vayan leyendo. Con
+ * msg_mode cada segmento no vacío es un registro, que entra en el anillo de
+ * una vez o espera a que quepa entero. Si se interrumpe o se van los
+ * consumidores a mitad, devuelve lo ya escrito.
+ */
+static ssize_t fifoproc_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+	struct file *file = iocb->ki_filp;
+	bool nonblock = (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	size_t written = 0, need;
+	struct iovec seg;
+	unsigned int copied;
+	int ret = 0;
+
+	if (!iter_is_iovec(from))
+		return -EINVAL;
+
+	if (nonblock) {
+		if (!mutex_trylock(&wr_lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&wr_lock)) {
+		return -EINTR;
+	}
+
+	while (iov_iter_count(from) > 0) {
+		seg = iov_iter_iovec(from);
+		if (seg.iov_len == 0) {
+			iov_iter_advance(from, 0);
+			continue;
+		}
+
+		need = msg_mode ? seg.iov_len : 1;
+		if (msg_mode && seg.iov_len > min_t(size_t, MAX_RECORD, ring_size - 2)) {
+			ret = -EMSGSIZE;
+			break;
+		}
+
+		/* Sin bloqueo se escribe lo que quepa */
+		if (nonblock && !ring_fits(need) && READ_ONCE(cons_count) > 0) {
+			this_cpu_inc(stats.stalls[PROD]);
+			ret = -EAGAIN;
+			break;
+		}
+
+		/* Esperar hasta que haya hueco para insertar (debe haber consumidores) */
+		if (spin_then_wait(wq_prod, prod_spin_ns, spin_us, ring_fits(need) || READ_ONCE(cons_count) == 0,
+				wait_start, wait_end, &stats, PROD)) {
+			ret = -EINTR;
+			break;
+		}
+
+		/* Detectar fin de comunicación por error (consumidor cierra FIFO antes) */
+		if (READ_ONCE(cons_count) == 0) {
+			ret = -EPIPE;
+			break;
+		}
+
+		if (msg_mode)
+			ret = kfifo_from_user(&rbuffer, seg.iov_base, seg.iov_len, &copied);
+		else
+			ret = kfifo_from_user(&cbuffer, seg.iov_base, seg.iov_len, &copied);
+		/* Un -EFAULT a mitad deja lo ya copiado en el anillo: también cuenta */
+		written += copied;
+		if (copied > 0) {
+			trace_prodcons_enqueue(copied, ring_used());
+			if (ring_used() > ring_hwm)
+				WRITE_ONCE(ring_hwm, ring_used());
+
+			/* Despertar a posible consumidor bloqueado */
+			wake_waiters(&wq_cons);
+		}
+		if (ret)
+			break;
+		iov_iter_advance(from, copied);
+	}
+	mutex_unlock(&wr_lock);
+
+	if (written > 0) {
+		this_cpu_add(stats.bytes[PROD], written);
+		this_cpu_inc(stats.ops[PROD]);
+	}
+	return written > 0 ? written : ret;
+}
+
+/*
+ * /proc solo llama a ->read y ->write (readv() y writev() llegan aquí una vez
+ * por segmento, sin saber que forman parte de un vector), así que se hace como
+ * new_sync_read(): un iov_iter de un segmento sobre el buffer de usuario.
+ */
+static ssize_t fifoproc_read(struct file * file, char *buff, size_t len, loff_t * offset) {
+	struct iovec iov = { .iov_base = buff, .iov_len = len };
+	struct iov_iter iter;
+	struct kiocb kiocb;
 
-	return len;
+	init_sync_kiocb(&kiocb, file);
+	iov_iter_init(&iter, READ, &iov, 1, len);
+	return fifoproc_read_iter(&kiocb, &iter);
 }
 
-/* Se invoca al hacer write() de entrada /proc */
 static ssize_t fifoproc_write(struct file * file, const char *buff, size_t len, loff_t * offset) {
-	char kbuffer[MAX_KBUF];
+	struct iovec iov = { .iov_base = (void __user *) buff, .iov_len = len };
+	struct iov_iter iter;
+	struct kiocb kiocb;
 
-	if (len > MAX_CBUFFER_LEN || len> MAX_KBUF)
-		return -ENOMEM;
+	init_sync_kiocb(&kiocb, file);
+	iov_iter_init(&iter, WRITE, &iov, 1, len);
+	return fifoproc_write_iter(&kiocb, &iter);
+}
 
-	if (copy_from_user(kbuffer,buff,len))
-		return -EFAULT;
+/*
+ * Se invoca al hacer poll()/select()/epoll de entrada /proc. Los consumidores
+ * son legibles con datos en el anillo y ven POLLHUP cuando no quedan
+ * productores; los productores son escribibles con hueco y ven POLLERR
+ * cuando no quedan consumidores, como en un pipe.
+ */
+static unsigned int fifoproc_poll(struct file *file, poll_table *wait) {
+	unsigned int mask = 0;
 
-	if(down_interruptible(&mtx))
-		return -EINTR;
-	/* Esperar hasta que haya hueco para insertar (debe haber consumidores) */
-	while (kfifo_avail(&cbuffer) < len && cons_count > 0) {
-		nr_prod_waiting++;
-		up(&mtx);
-		if(down_interruptible(&sem_prod))
-			return -EINTR;
-		if(down_interruptible(&mtx))
-			return -EINTR;
-	}
-	/* Detectar fin de comunicación por error (consumidor cierra FIFO antes) */
-	if (cons_count==0) { up(&mtx); return -EPIPE; }
-	kfifo_in(&cbuffer,kbuffer,len);
-	/* Despertar a posible consumidor bloqueado */
-
-	if(nr_cons_waiting > 0) {   // cond_signal(cons);
-		nr_cons_waiting--;
-		up(&sem_cons);
+	poll_wait(file, &wq_cons, wait);
+	poll_wait(file, &wq_prod, wait);
+	/* Empareja con la barrera de wake_waiters(): o nos ven en la cola o vemos su cambio */
+	smp_mb();
+
+	if (file->f_mode & FMODE_READ) {
+		if (!ring_empty())
+			mask |= POLLIN | POLLRDNORM;
+		if (READ_ONCE(prod_count) == 0)
+			mask |= POLLHUP;
+	} else {
+		if (ring_fits(1))
+			mask |= POLLOUT | POLLWRNORM;
+		if (READ_ONCE(cons_count) == 0)
+			mask |= POLLERR;
 	}
-	up(&mtx);
-	return len;
+	return mask;
 }
 
 static const struct file_operations proc_entry_fops = {
 	.read = fifoproc_read,
 	.write = fifoproc_write,
+	.read_iter = fifoproc_read_iter,
+	.write_iter = fifoproc_write_iter,
+	.poll = fifoproc_poll,
 	.open = fifoproc_open,
 	.release = fifoproc_release
 };
 
 
+/*
+ * Se invoca al leer /proc/prodcons_stats: suma las estadísticas de todas las
+ * CPU. Cada contador se lee suelto, así que con tráfico en curso los valores
+ * pueden no cuadrar exactamente entre sí.
+ */
+static int stats_show(struct seq_file *m, void *v) {
+	prodcons_stats_show(m, &stats, ring_size, ring_used(), READ_ONCE(ring_hwm),
+			READ_ONCE(prod_count), READ_ONCE(cons_count));
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file) {
+	return single_open(file, stats_show, NULL);
+}
+
+static const struct file_operations stats_proc_entry_fops = {
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 int init_module( void ) {
 	int ret = 0;
 
+	if (ring_size < MIN_RING_SIZE || ring_size > MAX_RING_SIZE) {
+		printk(KERN_INFO "prodcons: ring_size must be between %d and %d\n", MIN_RING_SIZE, MAX_RING_SIZE);
+		return -EINVAL;
+	}
+	ring_size = roundup_pow_of_two(ring_size);
+
+	/* El anillo tiene que existir antes de que nadie pueda abrir la entrada */
+	ring = vmalloc(ring_size);
+	if (ring == NULL)
+		return -ENOMEM;
+	if (msg_mode)
+		kfifo_init(&rbuffer, ring, ring_size);
+	else
+		kfifo_init(&cbuffer, ring, ring_size);
+	sema_init(&mtx, 1);
+
 	proc_entry = proc_create( "prodcons", 0666, NULL, &proc_entry_fops);
-	if (proc_entry == NULL) {
+	stats_proc_entry = proc_create( "prodcons_stats", 0444, NULL, &stats_proc_entry_fops);
+	if (proc_entry == NULL || stats_proc_entry == NULL) {
 		ret = -ENOMEM;
+		if (proc_entry)
+			remove_proc_entry("prodcons", NULL);
+		if (stats_proc_entry)
+			remove_proc_entry("prodcons_stats", NULL);
+		vfree(ring);
 		printk(KERN_INFO "prodcons: Can't create /proc entry\n");
 	} else {
-		printk(KERN_INFO "prodcons: Module loaded\n");
-
-		if(kfifo_alloc(&cbuffer, MAX_CBUFFER_LEN, GFP_KERNEL)) {
-			return -ENOMEM;
-		}
-		sema_init(&mtx, 1);
-		sema_init(&sem_prod,0);
-		sema_init(&sem_cons,0);
+		printk(KERN_INFO "prodcons: Module loaded (%u-byte ring, %s mode)\n", ring_size,
+				msg_mode ? "message" : "stream");
 	}
 
 	return ret;
@@ -193,7 +465,8 @@ int init_module( void ) {
 
 
 void cleanup_module( void ) {
+	remove_proc_entry("prodcons_stats", NULL);
 	remove_proc_entry("prodcons", NULL);
-	kfifo_free(&cbuffer);
+	vfree(ring);
 	printk(KERN_INFO "prodcons: Module unloaded.\n");
 }
@@ -0,0 +1,64 @@
+/*
+ * Espera activa acotada antes de dormir, común a /proc/prodcons (fifoproc.c)
+ * y /dev/prodcons (Opcional/opcional.c). Si el otro extremo corre en otra
+ * CPU, los datos o el hueco suelen llegar en pocos µs y así se ahorran el
+ * sueño y el despertar.
+ */
+#ifndef _PRODCONS_SPIN_H
+#define _PRODCONS_SPIN_H
+
+#include <linux/kernel.h>
+#include <linux/wait.h>
+#include <linux/cpumask.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
+
+/*
+ * Presupuesto de espera activa de un lado, en ns: entero (spin_us) tras un
+ * acierto y a la mitad tras acabar durmiendo igualmente, sin bajar de 1/16.
+ * Así girar cuesta poco cuando el otro extremo no corre en paralelo y vuelve
+ * a compensar en cuanto lo hace. 0 es "aún sin ajustar".
+ */
+static inline unsigned int spin_budget(unsigned int budget, unsigned int spin_us) {
+	unsigned int full = spin_us * NSEC_PER_USEC;
+
+	return (budget == 0 || budget > full) ? full : budget;
+}
+
+static inline unsigned int spin_adapt(unsigned int budget, bool hit, unsigned int spin_us) {
+	unsigned int full = spin_us * NSEC_PER_USEC;
+
+	return hit ? full : max(spin_budget(budget, spin_us) / 2, full / 16);
+}
+
+/*
+ * wait_event_interruptible() precedido de una espera activa de hasta spin_us
+ * µs, recortada por el presupuesto "budget" del lado que espera, que se
+ * actualiza. Se deja de girar si hay que ceder la CPU o llega una señal. Si
+ * cond no se cumple de entrada, se llama a on_block(arg, side) al empezar a
+ * esperar y a on_unblock(arg, side, ns, ret) al acabar, para que cada módulo
+ * anote la espera donde quiera.
+ */
+#define spin_then_wait(wq, budget, spin_us, cond, on_block, on_unblock, arg, side) ({	\
+	bool __done = (cond);							\
+	u64 __start, __end;							\
+	int __ret = 0;								\
+										\
+	if (!__done) {								\
+		__start = local_clock();					\
+		on_block(arg, side);						\
+		if ((spin_us) > 0 && num_online_cpus() > 1) {			\
+			__end = __start + spin_budget(budget, spin_us);		\
+			while (!(__done = (cond)) && local_clock() < __end &&	\
+					!need_resched() && !signal_pending(current)) \
+				cpu_relax();					\
+			(budget) = spin_adapt(budget, __done, spin_us);		\
+		}								\
+		if (!__done)							\
+			__ret = wait_event_interruptible(wq, cond);		\
+		on_unblock(arg, side, local_clock() - __start, __ret);		\
+	}									\
+	__ret;									\
+})
+
+#endif /* _PRODCONS_SPIN_H */
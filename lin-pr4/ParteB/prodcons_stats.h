@@ -0,0 +1,77 @@
+/*
+ * Estadísticas de /proc/prodcons_stats (fifoproc.c) y de cada canal de
+ * /proc/prodcons_dev_stats (Opcional/opcional.c). Son por CPU para que contar
+ * no añada nada compartido entre productor y consumidor: cada lado incrementa
+ * las de la CPU en la que corre y solo la lectura del fichero las suma. El
+ * tiempo bloqueado va en un histograma logarítmico: <1 µs, [1,2) µs, [2,4) µs...
+ */
+#ifndef _PRODCONS_STATS_H
+#define _PRODCONS_STATS_H
+
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+
+#define NR_BLOCKED_BUCKETS 20
+
+enum { PROD = 0, CONS = 1 };
+
+typedef struct {
+	u64 bytes[2];		/* Bytes escritos (PROD) y leídos (CONS) */
+	u64 ops[2];		/* Llamadas que movieron algún byte */
+	u64 stalls[2];		/* Veces que el anillo estaba lleno (PROD) o vacío (CONS) */
+	u64 wakeups[2];		/* Despertares enviados a productores o consumidores */
+	u64 blocked[2][NR_BLOCKED_BUCKETS];
+} prodcons_stats_t;
+
+/* Anota una espera por anillo lleno o vacío que ha durado ns */
+static inline void account_blocked(prodcons_stats_t __percpu *s, int side, u64 ns) {
+	u64 us = ns / NSEC_PER_USEC;
+
+	this_cpu_inc(s->stalls[side]);
+	this_cpu_inc(s->blocked[side][us ? min(ilog2(us) + 1, NR_BLOCKED_BUCKETS - 1) : 0]);
+}
+
+/*
+ * Suma las estadísticas de todas las CPU y las escribe en m junto con el
+ * estado del anillo y de los extremos, una "clave=valor" por línea
+ */
+static inline void prodcons_stats_show(struct seq_file *m, prodcons_stats_t __percpu *stats,
+		unsigned int ring_size, unsigned int ring_used, unsigned int ring_hwm,
+		int prod_count, int cons_count) {
+	static const char *const side_name[2] = { "prod", "cons" };
+	prodcons_stats_t sum = { };
+	prodcons_stats_t *s;
+	int cpu, side, b;
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(stats, cpu);
+		for (side = PROD; side <= CONS; side++) {
+			sum.bytes[side] += READ_ONCE(s->bytes[side]);
+			sum.ops[side] += READ_ONCE(s->ops[side]);
+			sum.stalls[side] += READ_ONCE(s->stalls[side]);
+			sum.wakeups[side] += READ_ONCE(s->wakeups[side]);
+			for (b = 0; b < NR_BLOCKED_BUCKETS; b++)
+				sum.blocked[side][b] += READ_ONCE(s->blocked[side][b]);
+		}
+	}
+
+	seq_printf(m, "bytes_in=%llu\nbytes_out=%llu\nops_in=%llu\nops_out=%llu\n",
+			sum.bytes[PROD], sum.bytes[CONS], sum.ops[PROD], sum.ops[CONS]);
+	seq_printf(m, "ring_size=%u\nring_used=%u\nring_hwm=%u\n", ring_size, ring_used, ring_hwm);
+	seq_printf(m, "full_stalls=%llu\nempty_stalls=%llu\nprod_wakeups=%llu\ncons_wakeups=%llu\n",
+			sum.stalls[PROD], sum.stalls[CONS], sum.wakeups[PROD], sum.wakeups[CONS]);
+	seq_printf(m, "prod_count=%d\ncons_count=%d\n", prod_count, cons_count);
+
+	/* Una línea por lado: "<desde µs>:<esperas>" por cubeta */
+	for (side = PROD; side <= CONS; side++) {
+		seq_printf(m, "%s_blocked_us=", side_name[side]);
+		for (b = 0; b < NR_BLOCKED_BUCKETS; b++)
+			seq_printf(m, "%s%u:%llu", b ? " " : "", b ? 1U << (b - 1) : 0, sum.blocked[side][b]);
+		seq_printf(m, "\n");
+	}
+}
+
+#endif /* _PRODCONS_STATS_H */
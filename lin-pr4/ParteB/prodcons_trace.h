@@ -0,0 +1,93 @@
+/*
+ * Tracepoints de /proc/prodcons. Con ellos apagados cada llamada cuesta un
+ * salto no tomado; se activan con perf o trace-cmd, p. ej.
+ * "trace-cmd record -e prodcons", y la latencia de cada espera sale de
+ * prodcons_unblock o de emparejar prodcons_block con prodcons_unblock.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM prodcons
+
+#if !defined(_PRODCONS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PRODCONS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define show_prodcons_side(side) __print_symbolic(side, { 0, "prod" }, { 1, "cons" })
+
+/* Un trozo que entra en el anillo (enqueue) o sale de él (dequeue) */
+DECLARE_EVENT_CLASS(prodcons_xfer,
+	TP_PROTO(unsigned int len, unsigned int used),
+	TP_ARGS(len, used),
+	TP_STRUCT__entry(
+		__field(unsigned int, len)
+		__field(unsigned int, used)
+	),
+	TP_fast_assign(
+		__entry->len = len;
+		__entry->used = used;
+	),
+	TP_printk("len=%u used=%u", __entry->len, __entry->used)
+);
+
+DEFINE_EVENT(prodcons_xfer, prodcons_enqueue,
+	TP_PROTO(unsigned int len, unsigned int used),
+	TP_ARGS(len, used)
+);
+
+DEFINE_EVENT(prodcons_xfer, prodcons_dequeue,
+	TP_PROTO(unsigned int len, unsigned int used),
+	TP_ARGS(len, used)
+);
+
+/* Un lado empieza a esperar porque el anillo está lleno (prod) o vacío (cons) */
+TRACE_EVENT(prodcons_block,
+	TP_PROTO(int side),
+	TP_ARGS(side),
+	TP_STRUCT__entry(
+		__field(int, side)
+	),
+	TP_fast_assign(
+		__entry->side = side;
+	),
+	TP_printk("side=%s", show_prodcons_side(__entry->side))
+);
+
+/* Fin de esa espera, con lo que ha durado (girando y durmiendo) */
+TRACE_EVENT(prodcons_unblock,
+	TP_PROTO(int side, u64 ns, int ret),
+	TP_ARGS(side, ns, ret),
+	TP_STRUCT__entry(
+		__field(int, side)
+		__field(u64, ns)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->side = side;
+		__entry->ns = ns;
+		__entry->ret = ret;
+	),
+	TP_printk("side=%s ns=%llu ret=%d", show_prodcons_side(__entry->side),
+		(unsigned long long) __entry->ns, __entry->ret)
+);
+
+/* Se despierta a los que esperan en la cola de "side" */
+TRACE_EVENT(prodcons_wake,
+	TP_PROTO(int side),
+	TP_ARGS(side),
+	TP_STRUCT__entry(
+		__field(int, side)
+	),
+	TP_fast_assign(
+		__entry->side = side;
+	),
+	TP_printk("side=%s", show_prodcons_side(__entry->side))
+);
+
+#endif /* _PRODCONS_TRACE_H */
+
+/* define_trace.h busca este fichero en el directorio del módulo (-I$(src) en el Makefile) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE prodcons_trace
+#include <trace/define_trace.h>
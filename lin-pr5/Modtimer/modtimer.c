@@ -1,46 +1,111 @@
 #include <linux/module.h>
-#include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/kernel.h>
 #include <linux/proc_fs.h>
 #include <linux/uaccess.h>
 #include <linux/ftrace.h>
 #include <linux/kfifo.h>
 #include <linux/semaphore.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
 #include <linux/random.h>
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+
+#define CREATE_TRACE_POINTS
+#include "modtimer_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Module pr5");
 MODULE_AUTHOR("Germán Franco Dorca - Álvaro Velasco García");
 
-#define MAX_BUFFER_LEN 128
+#define MIN_BUFFER_LEN 128
+#define MAX_BUFFER_LEN (64 << 10) /* A block holds a whole buffer and comes from a slab cache */
+#define BATCH_CHUNK 32 /* Numbers drawn on the stack per kfifo_in() */
+#define MIN_PERIOD_US 10 /* Shorter hrtimer periods would leave the CPU doing nothing else */
 
 DEFINE_SPINLOCK(buff_lock);
-DEFINE_SEMAPHORE(list_lock);
-DEFINE_SEMAPHORE(cond_lectura);
 DEFINE_SEMAPHORE(lock_open);
 
 /* Default Values*/
 struct timer_list my_timer; /* Structure that describes the kernel timer */
+static struct hrtimer my_hrtimer; /* Used instead of my_timer while timer_period_us > 0 */
+static bool timers_on = false; /* Cleared on release so that neither timer re-arms the other */
 static unsigned int timer_period_ms = 1000;
+static unsigned int timer_period_us = 0; /* 0 = jiffies timer with timer_period_ms */
+static unsigned int batch = 1; /* Numbers generated on every expiry; at most a buffer_size worth */
+
+/* Bytes of the buffer and of every per-CPU ring; a larger one absorbs more batches before a flush */
+static unsigned int buffer_size = MIN_BUFFER_LEN;
+module_param(buffer_size, uint, 0444);
+MODULE_PARM_DESC(buffer_size, "Bytes in the buffer and in each per-CPU ring (128 B - 64 KiB, rounded up to a power of two)");
+
+/*
+ * Per-CPU mode: every online CPU runs its own pinned timer (or hrtimer) that
+ * fills its own ring, so producers share neither a lock nor a cache line and
+ * no IRQs are disabled. Each ring has a single producer (its CPU's timer) and
+ * a single consumer (the worker), which kfifo handles without locking. CPUs
+ * brought online while /proc/modtimer is open don't produce until it's
+ * reopened.
+ */
+static bool percpu_mode = false;
+module_param(percpu_mode, bool, 0444);
+MODULE_PARM_DESC(percpu_mode, "One timer and one ring per CPU instead of a single shared buffer");
+
+typedef struct {
+	struct timer_list timer;
+	struct hrtimer hrtimer;
+	struct kfifo ring;
+	unsigned long dropped; /* Numbers that didn't fit in the ring; only its CPU's timer writes it */
+} cpu_producer_t;
+
+static DEFINE_PER_CPU(cpu_producer_t, producers);
+
+/* Sampled at open(): each reader keeps the format it opened with */
+static bool binary_format = false;
+module_param(binary_format, bool, 0644);
+MODULE_PARM_DESC(binary_format, "read() returns packed native-endian int32 instead of one decimal number per line");
 static unsigned int emergency_threshold = 75; /* Max occupation percent */
 static unsigned int max_random = 300;
 
 struct kfifo buffer;
+static unsigned long dropped; /* Numbers that didn't fit in the buffer, or that a flush had no block for; under buff_lock */
 static struct work_struct transfer_task;
-static unsigned int nr_readers_waiting = 0;
 
 static struct proc_dir_entry *proc_entry;
 static struct proc_dir_entry *config_proc_entry;
 
-static struct list_head randlist;
+/*
+ * The worker hands numbers over a whole buffer (or per-CPU ring) at a time:
+ * each flush copies the buffer into one block from block_cache and pushes
+ * the flush's blocks onto "handoff" with one llist_add_batch(), so it never
+ * takes a lock a reader may hold. Readers take the whole llist with
+ * llist_del_all(), keep it oldest first in "pending" and free each block
+ * once "head" reaches "count", so there's no allocation per number on
+ * either side.
+ */
 typedef struct {
-	struct list_head links;
-	int num;
-} list_item_t;
+	struct llist_node node;
+	unsigned int head; /* Next number to read */
+	unsigned int count; /* Numbers in nums[] */
+	int nums[]; /* buffer_size bytes */
+} num_block_t;
+
+static LLIST_HEAD(handoff);
+static DECLARE_WAIT_QUEUE_HEAD(readers_wq); /* Woken when handoff stops being empty */
+/* Only serializes readers sharing the file, the worker never takes it */
+static DEFINE_MUTEX(readers_lock);
+static struct llist_node *pending; /* Blocks already taken from handoff; under readers_lock */
 
-static void clear_list(struct list_head* list);
+static struct kmem_cache *block_cache;
+
+static void clear_list(struct llist_node *first);
 
 
 /************************************\
@@ -52,34 +117,134 @@ static void clear_list(struct list_head* list);
 |                                    |
 \************************************/
 
-/* Function invoked when timer expires (fires) */
-static void fire_timer(unsigned long data) {
-	int num;
+/*
+ * Generates a batch of numbers into the buffer (or the ring of producer "p"
+ * in per-CPU mode) and, past the emergency threshold, asks for a flush.
+ * Common to both timers. The numbers are drawn BATCH_CHUNK at a time before
+ * taking buff_lock, so each IRQ-disabled section is one kfifo_in(); the
+ * per-CPU rings need no lock. Once the buffer is full the rest of the batch
+ * is dropped without drawing it and counted in "dropped" (shown by
+ * /proc/modconfig).
+ */
+static void produce_batch(cpu_producer_t *p) {
+	int nums[BATCH_CHUNK];
+	unsigned int n = READ_ONCE(batch);
+	unsigned int done, chunk, in;
+	unsigned int lost = 0;
 	unsigned long flags;
-	int size;
+	int first = 0;
+	int size = 0;
 	int cpu;
+	int i;
 
-	spin_lock_irqsave(&buff_lock, flags);
-	num = get_random_int() %  max_random;
-	kfifo_in(&buffer, &num, sizeof(int));
-	size = kfifo_len(&buffer);
-	spin_unlock_irqrestore(&buff_lock, flags);
+	for(done = 0; done < n; done += chunk) {
+		chunk = min_t(unsigned int, n - done, BATCH_CHUNK);
+		for(i = 0; i < chunk; i++)
+			nums[i] = get_random_int() % max_random;
+		if(done == 0)
+			first = nums[0];
+
+		if(p != NULL) {
+			in = kfifo_in(&p->ring, nums, chunk * sizeof(int)) / sizeof(int);
+		} else {
+			spin_lock_irqsave(&buff_lock, flags);
+			in = kfifo_in(&buffer, nums, chunk * sizeof(int)) / sizeof(int);
+			if(in < chunk)
+				dropped += n - done - in;
+			size = kfifo_len(&buffer);
+			spin_unlock_irqrestore(&buff_lock, flags);
+		}
+		if(in < chunk) {
+			lost = n - done - in;
+			break;
+		}
+	}
 
-	printk(KERN_INFO "RANDOM: %d\n", num);
+	if(p != NULL) {
+		p->dropped += lost;
+		size = kfifo_len(&p->ring);
+	}
+
+	trace_modtimer_fire(first, n, size, buffer_size, lost);
 
-	if(size * 100 > emergency_threshold * MAX_BUFFER_LEN && !work_pending(&transfer_task)) {
+	if((u64) size * 100 > (u64) emergency_threshold * buffer_size && !work_pending(&transfer_task)) {
 		cpu = smp_processor_id();
-		printk(KERN_INFO "TIMER REQUESTED FLUSH FROM CPU %d\n", cpu);
+		trace_modtimer_flush_request(cpu == 0 ? 1 : cpu - 1);
 		schedule_work_on((cpu == 0 ? 1 : cpu - 1), &transfer_task);
-	} else {
-		printk(KERN_INFO "BUFFER CAPACITY=%d%%\n", (size * 100 / MAX_BUFFER_LEN));
 	}
+}
 
-	/* Re-activate the timer one second from now */
-	mod_timer(&my_timer, jiffies + msecs_to_jiffies(timer_period_ms));
+static ktime_t hrtimer_period(void) {
+	return ns_to_ktime((u64) READ_ONCE(timer_period_us) * NSEC_PER_USEC);
 }
 
+/* The per-CPU hrtimers are pinned so that each keeps producing on its own CPU */
+static void start_hrtimer(struct hrtimer *timer, cpu_producer_t *p) {
+	hrtimer_start(timer, hrtimer_period(), p ? HRTIMER_MODE_REL_PINNED : HRTIMER_MODE_REL);
+}
+
+/* Function invoked when timer expires (fires); "data" is the cpu_producer_t in per-CPU mode */
+static void fire_timer(unsigned long data) {
+	cpu_producer_t *p = (cpu_producer_t *) data;
+	struct timer_list *timer = p ? &p->timer : &my_timer;
+
+	produce_batch(p);
+
+	if(!READ_ONCE(timers_on))
+		return;
+	/* Re-activate the timer one period from now, or hand over to the hrtimer if /proc/modconfig asked for it */
+	if(READ_ONCE(timer_period_us) > 0)
+		start_hrtimer(p ? &p->hrtimer : &my_hrtimer, p);
+	else
+		mod_timer(timer, jiffies + msecs_to_jiffies(timer_period_ms));
+}
+
+/* Same for the hrtimer, re-armed from the previous expiry so that the rate doesn't drift */
+static enum hrtimer_restart fire_hrtimer(struct hrtimer *timer) {
+	cpu_producer_t *p = timer == &my_hrtimer ? NULL : container_of(timer, cpu_producer_t, hrtimer);
+
+	produce_batch(p);
+
+	if(!READ_ONCE(timers_on))
+		return HRTIMER_NORESTART;
+	if(READ_ONCE(timer_period_us) == 0) {
+		mod_timer(p ? &p->timer : &my_timer, jiffies + msecs_to_jiffies(timer_period_ms));
+		return HRTIMER_NORESTART;
+	}
+	hrtimer_forward_now(timer, hrtimer_period());
+	return HRTIMER_RESTART;
+}
+
+/* Run on every CPU by on_each_cpu() to start its producer */
+static void start_cpu_timer(void *info) {
+	cpu_producer_t *p = this_cpu_ptr(&producers);
+
+	if(READ_ONCE(timer_period_us) > 0)
+		start_hrtimer(&p->hrtimer, p);
+	else
+		mod_timer(&p->timer, jiffies + msecs_to_jiffies(timer_period_ms));
+}
+
+/* kfifo_free() leaves a freed (or never allocated) ring zeroed, so this may run more than once */
+static void modt_free_rings(void) {
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfifo_free(&per_cpu_ptr(&producers, cpu)->ring);
+}
+
+/* Stops a producer's timers. One that was already running may arm the other, hence the second del_timer_sync() */
+static void stop_timers(struct timer_list *timer, struct hrtimer *hrtimer) {
+	del_timer_sync(timer);
+	hrtimer_cancel(hrtimer);
+	del_timer_sync(timer);
+}
+
+/* Sets up both timers and, for every possible CPU, its timers and (in per-CPU mode) a ring of buffer_size bytes */
 int modt_init_timer (void) {
+	cpu_producer_t *p;
+	int cpu;
+
 	/* Create timer */
 	init_timer(&my_timer);
 	/* Initialize fields */
@@ -87,6 +252,22 @@ int modt_init_timer (void) {
 	my_timer.function = fire_timer;
 	my_timer.expires = jiffies + msecs_to_jiffies(timer_period_ms);
 
+	hrtimer_init(&my_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	my_hrtimer.function = fire_hrtimer;
+
+	for_each_possible_cpu(cpu) {
+		p = per_cpu_ptr(&producers, cpu);
+		init_timer_pinned(&p->timer);
+		p->timer.data = (unsigned long) p;
+		p->timer.function = fire_timer;
+		hrtimer_init(&p->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		p->hrtimer.function = fire_hrtimer;
+		if(percpu_mode && kfifo_alloc(&p->ring, buffer_size, GFP_KERNEL)) {
+			modt_free_rings();
+			return -ENOMEM;
+		}
+	}
+
 	return 0;
 }
 
@@ -99,62 +280,117 @@ int modt_init_timer (void) {
 |                                         |
 \*****************************************/
 
-static void copy_items_into_list(struct work_struct *work) {
-	int i;
+/* Without a block to move them to, takes the numbers out of "fifo" and counts them in "dropped" */
+static void drop_numbers(struct kfifo *fifo) {
 	unsigned long flags;
-	struct list_head templist;
-	list_item_t* node;
-	int kbuffer[MAX_BUFFER_LEN];
 	unsigned int size;
 
-	INIT_LIST_HEAD(&templist);
+	spin_lock_irqsave(&buff_lock, flags);
+	size = kfifo_len(fifo);
+	kfifo_dma_out_finish(fifo, size);
+	dropped += size / sizeof(int);
+	spin_unlock_irqrestore(&buff_lock, flags);
+}
+
+/*
+ * Moves what's in "fifo" to a new block at the head of "templist" (newest
+ * first, as in handoff); "lock" is NULL for the per-CPU rings, whose only
+ * consumer is this worker. Returns how many numbers it moved, or -ENOMEM
+ * after dropping them.
+ */
+static int drain_into(struct llist_head *templist, struct kfifo *fifo, spinlock_t *lock) {
+	unsigned long flags;
+	num_block_t* block;
+	unsigned int size;
 
-	printk(KERN_INFO "WORKER DOES FLUSH FROM CPU %d\n", smp_processor_id());
+	/*
+	 * Most rings are empty on a per-CPU flush, so they're skipped before
+	 * allocating. The check needs no lock: a number that lands right after
+	 * it waits for the next flush.
+	 */
+	if(kfifo_is_empty(fifo))
+		return 0;
+
+	/* The block is allocated outside the spinlock; kfifo_out() copies straight into it */
+	block = kmem_cache_alloc(block_cache, GFP_KERNEL);
+	if(block == NULL) {
+		drop_numbers(fifo);
+		return -ENOMEM;
+	}
 
 	/* Copy buffer. Idea: agilizar la concurrencia. */
-	spin_lock_irqsave(&buff_lock, flags);
-	size = kfifo_out(&buffer, kbuffer, kfifo_len(&buffer));
-	spin_unlock_irqrestore(&buff_lock, flags);
+	if(lock != NULL) {
+		spin_lock_irqsave(lock, flags);
+		size = kfifo_out(fifo, block->nums, buffer_size);
+		spin_unlock_irqrestore(lock, flags);
+	} else {
+		size = kfifo_out(fifo, block->nums, buffer_size);
+	}
 
-	for(i = 0; i < size / sizeof(int); i++) {
-		node = vmalloc(sizeof (list_item_t));
-		if(node == NULL) {
-			clear_list(&templist);
-			return;
-		}
-		node->num = kbuffer[i];
-		list_add(&node->links, &templist);
+	if(size == 0) {
+		kmem_cache_free(block_cache, block);
+		return 0;
 	}
+	block->head = 0;
+	block->count = size / sizeof(int);
+	llist_add(&block->node, templist);
+	return block->count;
+}
 
-	if(down_interruptible(&list_lock))
-		return;
+/*
+ * In per-CPU mode one pass drains every CPU's ring, whichever one asked for
+ * the flush. If a block can't be allocated, that ring's numbers are dropped
+ * and counted, the blocks already drained are still handed over and the
+ * rings left wait for the next flush.
+ */
+static void copy_items_into_list(struct work_struct *work) {
+	struct llist_head templist;
+	struct llist_node *last = NULL; /* The first block drained, the oldest */
+	int total = 0;
+	int ret = 0;
+	int cpu;
 
-	/* Link temp list into our list */
-	templist.prev->next = randlist.next; /* El puntero next de el ultimo nodo de templist apunta al primer nodo de randlist.*/
-	randlist.next->prev = templist.prev; /* El puntero prev de el primer nodo de randlist apunta al ultimo nodo de templist.*/
-	templist.next->prev = &randlist; /* El puntero prev de el primer nodo de templist apunta al ultimo nodo de randlist*/
-	randlist.next = templist.next; /* El puntero next de el primer nodo de randlist apunta al primer nodo de randlist.*/
+	init_llist_head(&templist);
 
-	if(nr_readers_waiting > 0) {
-		nr_readers_waiting--;
-		up(&cond_lectura);
+	trace_modtimer_flush_start(smp_processor_id());
+
+	if(percpu_mode) {
+		for_each_possible_cpu(cpu) {
+			ret = drain_into(&templist, &per_cpu_ptr(&producers, cpu)->ring, NULL);
+			if(ret < 0)
+				break;
+			if(last == NULL)
+				last = templist.first;
+			total += ret;
+		}
+	} else {
+		ret = drain_into(&templist, &buffer, &buff_lock);
+		total = max(ret, 0);
+		last = templist.first;
 	}
-	up(&list_lock);
+	if(llist_empty(&templist))
+		return;
+
+	/*
+	 * Readers only sleep while handoff is empty, so only the push that fills
+	 * it may have to wake them. The cmpxchg in llist_add_batch() is a full
+	 * barrier, which makes the lock-free waitqueue_active() check safe.
+	 */
+	if(llist_add_batch(templist.first, last, &handoff) && waitqueue_active(&readers_wq))
+		wake_up_interruptible(&readers_wq);
 
-	printk(KERN_INFO "FLUSH BUFFER!!\n");
+	trace_modtimer_flush_end(total);
 }
 
 /**
- * Remove all elements from the list.
+ * Remove all blocks of a chain taken off an llist.
  */
-static void clear_list(struct list_head* list) {
-	list_item_t* cur;
-	list_item_t* aux;
-	/* Recorremos la lista para eliminar todos los nodos de la lista.*/
-	list_for_each_entry_safe(cur, aux, list, links) {
-		list_del( &(cur->links) );
-		vfree(cur);
-	}
+static void clear_list(struct llist_node *first) {
+	num_block_t* cur;
+	num_block_t* aux;
+	/* Recorremos la cadena para eliminar todos sus bloques.*/
+	llist_for_each_entry_safe(cur, aux, first, node)
+		kmem_cache_free(block_cache, cur);
 }
 
 /***************************************************************************************\
@@ -167,39 +403,81 @@ static void clear_list(struct list_head* list) {
 |                                                                                       |
 \***************************************************************************************/
 
+#define MAX_NUMSTR 12 /* "-2147483648\n" */
+#define KBUF_LEN (BATCH_CHUNK * MAX_NUMSTR) /* A block larger than this is copied out in several steps */
+
+/*
+ * Fills the user buffer with as many numbers as fit, in text or binary
+ * (file->private_data != NULL) format, and only blocks while there's
+ * nothing pending nor in handoff. Numbers go through kbuf, KBUF_LEN bytes
+ * at a time, whatever the size of the blocks. handoff is refilled from the worker
+ * without locks, so readers_lock can be held across copy_to_user(). A
+ * number that doesn't fit stays pending; if not even the first one fits,
+ * -ENOMEM.
+ */
 static ssize_t modtimer_read(struct file * file, char *buff, size_t len, loff_t * offset) {
-	char numstr[21]; /* 2^64 + \n =  20 digits + 1 */
-	int num;
-	int ret = 0;
-	list_item_t* last;
-
-	if(down_interruptible(&list_lock))
+	char numstr[MAX_NUMSTR + 1];
+	char kbuf[KBUF_LEN];
+	bool binary = file->private_data != NULL;
+	bool exhausted;
+	size_t done = 0;
+	ssize_t ret = 0;
+	size_t n;
+	int w;
+	num_block_t* block;
+
+	if(mutex_lock_interruptible(&readers_lock))
 		return -EINTR;
 
-	while (list_empty(&randlist)) {
-		nr_readers_waiting++; // cond_wait(cons,mtx);
-		up(&list_lock);
-		if(down_interruptible(&cond_lectura)) /* Cuando no hay elementos se bloquea.*/
-			return -EINTR;
-		if(down_interruptible(&list_lock))/* Randlist.*/
-			return -EINTR;
-	}
-
-	last = list_entry(randlist.prev, list_item_t, links);
-	list_del(randlist.prev);
-	up(&list_lock);
-
-	num = last->num;
-	vfree(last);
+	while(done < len) {
+		/* handoff is newest first: reversed, what was pushed first is read first */
+		if(pending == NULL)
+			pending = llist_reverse_order(llist_del_all(&handoff));
+		if(pending == NULL) {
+			if(done > 0)
+				break;
+			/* Cuando no hay elementos se bloquea.*/
+			if(wait_event_interruptible(readers_wq, !llist_empty(&handoff))) {
+				ret = -EINTR;
+				break;
+			}
+			continue;
+		}
 
-	ret = snprintf(numstr, sizeof(numstr), "%d\n", num);
-	if(ret > len)
-		return -ENOMEM;
+		block = llist_entry(pending, num_block_t, node);
+		for(n = 0; block->head < block->count && n + MAX_NUMSTR <= sizeof(kbuf); block->head++, n += w) {
+			if(binary) {
+				w = sizeof(int);
+				if(done + n + w > len)
+					break;
+				memcpy(kbuf + n, &block->nums[block->head], w);
+			} else {
+				w = snprintf(numstr, sizeof(numstr), "%d\n", block->nums[block->head]);
+				if(done + n + w > len)
+					break;
+				memcpy(kbuf + n, numstr, w);
+			}
+		}
+		/* A block is freed with its last number; otherwise kbuf or the user buffer is full */
+		exhausted = block->head == block->count;
+		if(exhausted) {
+			pending = llist_next(pending);
+			kmem_cache_free(block_cache, block);
+		}
 
-	if (copy_to_user(buff,numstr,ret))
-		return -EFAULT;
+		if(n == 0) {
+			ret = -ENOMEM;
+			break;
+		}
+		if(copy_to_user(buff + done, kbuf, n)) {
+			ret = -EFAULT;
+			break;
+		}
+		done += n;
+	}
 
-	return ret;
+	mutex_unlock(&readers_lock);
+	return done > 0 ? done : ret;
 }
 
 static int modtimer_open(struct inode * inode, struct file * file) {
@@ -214,31 +492,47 @@ static int modtimer_open(struct inode * inode, struct file * file) {
 
 	up(&lock_open);
 
+	file->private_data = READ_ONCE(binary_format) ? (void *) 1 : NULL;
+
 	/* Activate the timer for the first time */
-	add_timer(&my_timer);
+	WRITE_ONCE(timers_on, true);
+	if(percpu_mode) {
+		on_each_cpu(start_cpu_timer, NULL, 1);
+	} else if(READ_ONCE(timer_period_us) > 0) {
+		start_hrtimer(&my_hrtimer, NULL);
+	} else {
+		my_timer.expires = jiffies + msecs_to_jiffies(timer_period_ms);
+		add_timer(&my_timer);
+	}
 
 	return 0;
 }
 
 static int modtimer_release(struct inode * inode, struct file * file) {
-
 	unsigned long flags;
+	int cpu;
 
-	// eliminar el timer
-	del_timer_sync(&my_timer);
+	// eliminar los timers
+	WRITE_ONCE(timers_on, false);
+	stop_timers(&my_timer, &my_hrtimer);
+	for_each_possible_cpu(cpu)
+		stop_timers(&per_cpu_ptr(&producers, cpu)->timer, &per_cpu_ptr(&producers, cpu)->hrtimer);
 
 	flush_work(&transfer_task);
 
-	// vaciar el buffer
+	// vaciar el buffer; los anillos por CPU ya no tienen productor ni consumidor
 	spin_lock_irqsave(&buff_lock, flags);
 	kfifo_reset(&buffer);
 	spin_unlock_irqrestore(&buff_lock, flags);
+	for_each_possible_cpu(cpu)
+		kfifo_reset(&per_cpu_ptr(&producers, cpu)->ring);
 
-	// vaciar lista
-	if(down_interruptible(&list_lock))
-		return -EINTR;
-	clear_list(&randlist);
-	up(&list_lock);
+	// vaciar los bloques pendientes y los que el worker dejó en handoff
+	mutex_lock(&readers_lock);
+	clear_list(pending);
+	pending = NULL;
+	clear_list(llist_del_all(&handoff));
+	mutex_unlock(&readers_lock);
 
 	if(down_interruptible(&lock_open))
 		return -EINTR;
@@ -267,15 +561,28 @@ static const struct file_operations proc_entry_fops = {
 	timer_period_ms=500     // 16 + 20 + 1  chars
 	emergency_threshold=75  // 20 + 20 + 1  chars
 	max_random=300          // 11 + 20 + 1  chars
-	----------------------- // TOTAL 110 + 1 chars
+	timer_period_us=0       // 16 + 20 + 1  chars
+	batch=1                 // 6 + 20 + 1   chars
+	dropped=0               // 8 + 20 + 1   chars
+	----------------------- // TOTAL 203 + 1 chars
 */
 static ssize_t modconfig_read(struct file * file, char *buff, size_t len, loff_t * offset) {
-	char str[111];
-	int ret = snprintf(str, sizeof(str),
+	char str[204];
+	unsigned long lost = READ_ONCE(dropped);
+	int cpu;
+	int ret;
+
+	for_each_possible_cpu(cpu)
+		lost += READ_ONCE(per_cpu_ptr(&producers, cpu)->dropped);
+
+	ret = snprintf(str, sizeof(str),
 			"timer_period_ms=%u\n"
 			"emergency_threshold=%u\n"
-			"max_random=%u\n",
-			timer_period_ms, emergency_threshold, max_random);
+			"max_random=%u\n"
+			"timer_period_us=%u\n"
+			"batch=%u\n"
+			"dropped=%lu\n",
+			timer_period_ms, emergency_threshold, max_random, timer_period_us, batch, lost);
 
 	if(ret > len)
 		return -ENOMEM;
@@ -289,17 +596,25 @@ static ssize_t modconfig_write(struct file * file, const char __user *buff, size
 	char str[42];
 	unsigned int num;
 
-	if(len > sizeof(str))
+	if(len >= sizeof(str))
 		return -EINVAL;
 	if (copy_from_user(str,buff,len))
 		return -EFAULT;
+	str[len] = '\0';
 
-	if(sscanf(str, "timer_period_ms=%u", &num)) {
+	/* A zero period or range would spin the timer or divide by zero */
+	if(sscanf(str, "timer_period_ms=%u", &num) == 1 && num > 0) {
 		timer_period_ms = num;
-	} else if(sscanf(str, "emergency_threshold=%u", &num)) {
+	} else if(sscanf(str, "emergency_threshold=%u", &num) == 1) {
 		emergency_threshold = num;
-	} else if(sscanf(str, "max_random=%u", &num)) {
+	} else if(sscanf(str, "max_random=%u", &num) == 1 && num > 0) {
 		max_random = num;
+	} else if(sscanf(str, "timer_period_us=%u", &num) == 1 && (num == 0 || num >= MIN_PERIOD_US)) {
+		/* The running timer switches to the other one on its next expiry */
+		WRITE_ONCE(timer_period_us, num);
+	} else if(sscanf(str, "batch=%u", &num) == 1 && num > 0 && num <= buffer_size / sizeof(int)) {
+		/* A larger batch would always overflow an empty buffer */
+		WRITE_ONCE(batch, num);
 	} else {
 		return -EINVAL;
 	}
@@ -325,21 +640,46 @@ static const struct file_operations config_proc_entry_fops = {
 int init_module(void) {
 	int ret = 0;
 
+	if(buffer_size < MIN_BUFFER_LEN || buffer_size > MAX_BUFFER_LEN) {
+		printk(KERN_INFO "modtimer: buffer_size must be between %d and %d\n", MIN_BUFFER_LEN, MAX_BUFFER_LEN);
+		return -EINVAL;
+	}
+	buffer_size = roundup_pow_of_two(buffer_size);
+
+	if(kfifo_alloc(&buffer, buffer_size, GFP_KERNEL)) {
+		printk(KERN_INFO "modtimer: Can't allocate the buffer\n");
+		return -ENOMEM;
+	}
+	block_cache = kmem_cache_create("modtimer_block", sizeof(num_block_t) + buffer_size, 0, 0, NULL);
+	if(block_cache == NULL) {
+		printk(KERN_INFO "modtimer: Can't create slab cache\n");
+		kfifo_free(&buffer);
+		return -ENOMEM;
+	}
+
+	INIT_WORK(&transfer_task, copy_items_into_list);
+
+	if(modt_init_timer()) {
+		printk(KERN_INFO "modtimer: Can't allocate the per-CPU rings\n");
+		kmem_cache_destroy(block_cache);
+		kfifo_free(&buffer);
+		return -ENOMEM;
+	}
+
+	/* The /proc entries go last: a failed load must not leave them behind */
 	proc_entry = proc_create( "modtimer", 0666, NULL, &proc_entry_fops);
 	config_proc_entry = proc_create( "modconfig", 0666, NULL, &config_proc_entry_fops);
 	if (proc_entry == NULL || config_proc_entry == NULL) {
 		ret = -ENOMEM;
 		printk(KERN_INFO "modtimer: Can't create one or both of /proc entry\n");
+		if (proc_entry)
+			remove_proc_entry("modtimer", NULL);
+		if (config_proc_entry)
+			remove_proc_entry("modconfig", NULL);
+		modt_free_rings();
+		kmem_cache_destroy(block_cache);
+		kfifo_free(&buffer);
 	} else {
-
-		if(kfifo_alloc(&buffer, MAX_BUFFER_LEN, GFP_KERNEL))
-			return -ENOMEM;
-
-		INIT_LIST_HEAD(&randlist);
-		INIT_WORK(&transfer_task, copy_items_into_list);
-
-		modt_init_timer();
-
 		printk(KERN_INFO "modtimer: Module loaded\n");
 	}
 
@@ -349,6 +689,9 @@ int init_module(void) {
 
 void cleanup_module( void ) {
 	remove_proc_entry("modtimer", NULL);
+	remove_proc_entry("modconfig", NULL);
 	kfifo_free(&buffer);
+	modt_free_rings();
+	kmem_cache_destroy(block_cache);
 	printk(KERN_INFO "modtimer: Module unloaded.\n");
 }
@@ -0,0 +1,86 @@
+/*
+ * Tracepoints for modtimer, replacing the printk()s that used to run on every
+ * tick. Disabled they cost a not-taken branch; enable them with perf or
+ * "trace-cmd record -e modtimer". The delay between modtimer_flush_request
+ * and modtimer_flush_start is how long the work item waited for its CPU.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM modtimer
+
+#if !defined(_MODTIMER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MODTIMER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * A tick generated "batch" numbers, the first one "num", and "dropped" of
+ * them didn't fit; "used" is the buffer occupancy in bytes afterwards
+ */
+TRACE_EVENT(modtimer_fire,
+	TP_PROTO(int num, unsigned int batch, unsigned int used, unsigned int size, unsigned int dropped),
+	TP_ARGS(num, batch, used, size, dropped),
+	TP_STRUCT__entry(
+		__field(int, num)
+		__field(unsigned int, batch)
+		__field(unsigned int, used)
+		__field(unsigned int, size)
+		__field(unsigned int, dropped)
+	),
+	TP_fast_assign(
+		__entry->num = num;
+		__entry->batch = batch;
+		__entry->used = used;
+		__entry->size = size;
+		__entry->dropped = dropped;
+	),
+	TP_printk("num=%d batch=%u dropped=%u capacity=%u%%", __entry->num, __entry->batch,
+		__entry->dropped, __entry->used * 100 / __entry->size)
+);
+
+/* The timer crossed emergency_threshold and queued the flush on "cpu" */
+TRACE_EVENT(modtimer_flush_request,
+	TP_PROTO(int cpu),
+	TP_ARGS(cpu),
+	TP_STRUCT__entry(
+		__field(int, cpu)
+	),
+	TP_fast_assign(
+		__entry->cpu = cpu;
+	),
+	TP_printk("target_cpu=%d", __entry->cpu)
+);
+
+/* The work item starts emptying the buffer on "cpu" */
+TRACE_EVENT(modtimer_flush_start,
+	TP_PROTO(int cpu),
+	TP_ARGS(cpu),
+	TP_STRUCT__entry(
+		__field(int, cpu)
+	),
+	TP_fast_assign(
+		__entry->cpu = cpu;
+	),
+	TP_printk("cpu=%d", __entry->cpu)
+);
+
+/* The flush moved "batch" numbers from the buffer to the list(s) */
+TRACE_EVENT(modtimer_flush_end,
+	TP_PROTO(unsigned int batch),
+	TP_ARGS(batch),
+	TP_STRUCT__entry(
+		__field(unsigned int, batch)
+	),
+	TP_fast_assign(
+		__entry->batch = batch;
+	),
+	TP_printk("batch=%u", __entry->batch)
+);
+
+#endif /* _MODTIMER_TRACE_H */
+
+/* define_trace.h looks for this file in the module's directory (-I$(src) in the Makefile) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE modtimer_trace
+#include <trace/define_trace.h>
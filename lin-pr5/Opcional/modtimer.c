@@ -1,15 +1,21 @@
 // opcional
 #include <linux/module.h>
-#include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/kernel.h>
 #include <linux/proc_fs.h>
 #include <linux/uaccess.h>
 #include <linux/ftrace.h>
 #include <linux/kfifo.h>
 #include <linux/semaphore.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
 #include <linux/random.h>
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
+#include <linux/slab.h>
+
+#define CREATE_TRACE_POINTS
+#include "modtimer_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Module pr5");
@@ -18,11 +24,6 @@ MODULE_AUTHOR("Germán Franco Dorca - Álvaro Velasco García");
 static struct proc_dir_entry *proc_entry;
 static struct proc_dir_entry *config_proc_entry;
 
-typedef struct {
-	struct semaphore sem;
-	unsigned int waiting;
-} sem_cond_t;
-
 DEFINE_SEMAPHORE(lock_open);
 DEFINE_SEMAPHORE(wait_open);
 static unsigned int readers_in = 0;
@@ -40,25 +41,40 @@ static unsigned int max_random = 300;
 DEFINE_SPINLOCK(buff_lock);
 struct kfifo buffer;
 
-static sem_cond_t wait_even;
-static sem_cond_t wait_odd;
-DEFINE_SEMAPHORE(even_list_lock);
-DEFINE_SEMAPHORE(odd_list_lock);
-static struct list_head even_list;
-static struct list_head odd_list;
-
+/*
+ * As in Modtimer, numbers are handed over in blocks from block_cache: each
+ * flush fills one block per queue (even and odd), pushed onto its handoff
+ * llist without locks, and readers free a block with its last number, so
+ * there's no allocation per number.
+ */
+#define BLOCK_LEN (MAX_BUFFER_LEN / sizeof(int))
 
+typedef struct {
+	struct llist_node node;
+	unsigned int head; /* Next number to read */
+	unsigned int count; /* Numbers in nums[] */
+	int nums[BLOCK_LEN];
+} num_block_t;
 
 typedef struct {
-	struct list_head links;
-	int num;
-} list_item_t;
+	struct llist_head handoff; /* Pushed by the worker, newest first */
+	struct llist_node *pending; /* Taken from handoff, oldest first; under lock */
+	struct mutex lock; /* Only between readers, the worker never takes it */
+	wait_queue_head_t wq; /* Readers waiting for handoff to fill */
+} num_queue_t;
+
+static num_queue_t even_queue;
+static num_queue_t odd_queue;
+
+static struct kmem_cache *block_cache;
 
-static void clear_list(struct list_head* list);
+static void clear_list(struct llist_node *first);
 
-static void sem_cond_init(sem_cond_t* cond) {
-	sema_init(&cond->sem, 0);
-	cond->waiting = 0;
+static void num_queue_init(num_queue_t* q) {
+	init_llist_head(&q->handoff);
+	q->pending = NULL;
+	mutex_init(&q->lock);
+	init_waitqueue_head(&q->wq);
 }
 
 /************************************\
@@ -73,24 +89,23 @@ static void sem_cond_init(sem_cond_t* cond) {
 /* Function invoked when timer expires (fires) */
 static void fire_timer(unsigned long data) {
 	int num;
+	unsigned int lost;
 	unsigned long flags;
 	int size;
 	int cpu;
 
 	spin_lock_irqsave(&buff_lock, flags);
 	num = get_random_int() %  max_random;
-	kfifo_in(&buffer, &num, sizeof(int));
+	lost = kfifo_in(&buffer, &num, sizeof(int)) == 0;
 	size = kfifo_len(&buffer);
 	spin_unlock_irqrestore(&buff_lock, flags);
 
-	printk(KERN_INFO "RANDOM: %d\n", num);
+	trace_modtimer_fire(num, 1, size, MAX_BUFFER_LEN, lost);
 
 	if(size * 100 > emergency_threshold * MAX_BUFFER_LEN && !work_pending(&transfer_task)) {
 		cpu = smp_processor_id();
-		printk(KERN_INFO "TIMER REQUESTED FLUSH FROM CPU %d\n", cpu);
+		trace_modtimer_flush_request(cpu == 0 ? 1 : cpu - 1);
 		queue_work_on((cpu == 0 ? 1 : cpu - 1), workqueue, &transfer_task);
-	} else {
-		printk(KERN_INFO "BUFFER CAPACITY=%d%%\n", (size * 100 / MAX_BUFFER_LEN));
 	}
 
 	/* Re-activate the timer one second from now */
@@ -117,85 +132,78 @@ int modt_init_timer (void) {
 |                                         |
 \*****************************************/
 
-/* l1 <-- into -- l2 */
-static void insert_all(struct list_head* l1, struct list_head* l2) {
-	if(!list_empty(l2)) {
-		l2->prev->next = l1->next; /* El puntero next de el ultimo nodo de templist apunta al primer nodo de randlist.*/
-		l1->next->prev = l2->prev; /* El puntero prev de el primer nodo de randlist apunta al ultimo nodo de templist.*/
-		l2->next->prev = l1; /* El puntero prev de el primer nodo de templist apunta al ultimo nodo de randlist*/
-		l1->next = l2->next; /* El puntero next de el primer nodo de randlist apunta al primer nodo de randlist.*/
-	}
-	INIT_LIST_HEAD(l2);
+/*
+ * Hands "block" over to the readers of "q" if it got any number, or frees
+ * it. Readers only sleep while handoff is empty, so only the push that fills
+ * it may have to wake them; the cmpxchg in llist_add() is a full barrier,
+ * which makes the lock-free waitqueue_active() check safe.
+ */
+static void push_block(num_queue_t* q, num_block_t* block) {
+	if(block->count == 0)
+		kmem_cache_free(block_cache, block);
+	else if(llist_add(&block->node, &q->handoff) && waitqueue_active(&q->wq))
+		wake_up_interruptible(&q->wq);
 }
 
 static void copy_items_into_list(struct work_struct *work) {
 	int i;
 	unsigned long flags;
-	struct list_head even_templist;
-	struct list_head odd_templist;
-	list_item_t* node;
-	int kbuffer[MAX_BUFFER_LEN];
+	num_block_t* even;
+	num_block_t* odd;
+	int kbuffer[BLOCK_LEN];
 	unsigned int size;
 
-	INIT_LIST_HEAD(&even_templist);
-	INIT_LIST_HEAD(&odd_templist);
+	trace_modtimer_flush_start(smp_processor_id());
 
-	printk(KERN_INFO "WORKER DOES FLUSH FROM CPU %d\n", smp_processor_id());
+	/* Both blocks are allocated up front: the buffer fits in either of them */
+	even = kmem_cache_alloc(block_cache, GFP_KERNEL);
+	odd = kmem_cache_alloc(block_cache, GFP_KERNEL);
+	if(even == NULL || odd == NULL) {
+		if(even)
+			kmem_cache_free(block_cache, even);
+		if(odd)
+			kmem_cache_free(block_cache, odd);
+		return;
+	}
+	even->head = even->count = 0;
+	odd->head = odd->count = 0;
 
 	/* Copy buffer. Idea: agilizar la concurrencia. */
 	spin_lock_irqsave(&buff_lock, flags);
-	size = kfifo_out(&buffer, kbuffer, kfifo_len(&buffer));
+	size = kfifo_out(&buffer, kbuffer, sizeof(kbuffer));
 	spin_unlock_irqrestore(&buff_lock, flags);
 
 	for(i = 0; i < size / sizeof(int); i++) {
-		node = vmalloc(sizeof (list_item_t));
-		if(node == NULL) {
-			clear_list(&even_templist);
-			clear_list(&odd_templist);
-			return;
-		}
-		node->num = kbuffer[i];
-		if(node->num % 2 == 0) {
-			list_add(&node->links, &even_templist);
+		if(kbuffer[i] % 2 == 0) {
+			even->nums[even->count++] = kbuffer[i];
 		} else {
-			list_add(&node->links, &odd_templist);
+			odd->nums[odd->count++] = kbuffer[i];
 		}
 	}
+	push_block(&even_queue, even);
+	push_block(&odd_queue, odd);
 
-	/* Link even temp list into even list */
-	if(down_interruptible(&even_list_lock))
-		return;
-	insert_all(&even_list, &even_templist);
-	if(wait_even.waiting > 0) {
-		wait_even.waiting--;
-		up(&wait_even.sem);
-	}
-	up(&even_list_lock);
-
-	/* Link odd temp list into odd list */
-	if(down_interruptible(&odd_list_lock))
-		return;
-	insert_all(&odd_list, &odd_templist);
-	if(wait_odd.waiting > 0) {
-		wait_odd.waiting--;
-		up(&wait_odd.sem);
-	}
-	up(&odd_list_lock);
-
-	printk(KERN_INFO "FLUSH BUFFER!!\n");
+	trace_modtimer_flush_end(size / sizeof(int));
 }
 
 /**
- * Remove all elements from the list.
+ * Remove all blocks of a chain taken off an llist.
  */
-static void clear_list(struct list_head* list) {
-	list_item_t* cur;
-	list_item_t* aux;
-	/* Recorremos la lista para eliminar todos los nodos de la lista.*/
-	list_for_each_entry_safe(cur, aux, list, links) {
-		list_del( &(cur->links) );
-		vfree(cur);
-	}
+static void clear_list(struct llist_node *first) {
+	num_block_t* cur;
+	num_block_t* aux;
+	/* Recorremos la cadena para eliminar todos sus bloques.*/
+	llist_for_each_entry_safe(cur, aux, first, node)
+		kmem_cache_free(block_cache, cur);
+}
+
+/* Drops every number of "q", pending or still in handoff */
+static void clear_queue(num_queue_t* q) {
+	mutex_lock(&q->lock);
+	clear_list(q->pending);
+	q->pending = NULL;
+	clear_list(llist_del_all(&q->handoff));
+	mutex_unlock(&q->lock);
 }
 
 /***************************************************************************************\
@@ -209,30 +217,33 @@ static void clear_list(struct list_head* list) {
 \***************************************************************************************/
 
 
-static int list_pop_sync(struct list_head* list, struct semaphore* lock, sem_cond_t* cond) {
-	int num;
-	list_item_t* last;
+/* Takes the oldest number of "q" into "num". Returns 0 or -EINTR */
+static int queue_pop(num_queue_t* q, int* num) {
+	num_block_t* block;
 
-	if(down_interruptible(lock))
+	if(mutex_lock_interruptible(&q->lock))
 		return -EINTR;
 
-	while (list_empty(list)) {
-		cond->waiting++; // cond_wait(cons,mtx);
-		up(lock);
-		if(down_interruptible(&cond->sem)) /* Cuando no hay elementos se bloquea.*/
-			return -EINTR;
-		if(down_interruptible(lock))/* Randlist.*/
+	if(q->pending == NULL) {
+		/* Cuando no hay elementos se bloquea.*/
+		if(wait_event_interruptible(q->wq, !llist_empty(&q->handoff))) {
+			mutex_unlock(&q->lock);
 			return -EINTR;
+		}
+		/* handoff is newest first: reversed, what was pushed first is read first */
+		q->pending = llist_reverse_order(llist_del_all(&q->handoff));
 	}
 
-	last = list_entry(list->prev, list_item_t, links);
-	list_del(list->prev);
-	up(lock);
-
-	num = last->num;
-	vfree(last);
+	/* A block is freed with its last number */
+	block = llist_entry(q->pending, num_block_t, node);
+	*num = block->nums[block->head++];
+	if(block->head == block->count) {
+		q->pending = llist_next(q->pending);
+		kmem_cache_free(block_cache, block);
+	}
+	mutex_unlock(&q->lock);
 
-	return num;
+	return 0;
 }
 
 static ssize_t modtimer_read(struct file * file, char *buff, size_t len, loff_t * offset) {
@@ -241,10 +252,12 @@ static ssize_t modtimer_read(struct file * file, char *buff, size_t len, loff_t
 	int ret = 0;
 
 	if(file->private_data == 0) {
-		num = list_pop_sync(&even_list, &even_list_lock, &wait_even);
+		ret = queue_pop(&even_queue, &num);
 	} else {
-		num = list_pop_sync(&odd_list, &odd_list_lock, &wait_odd);
+		ret = queue_pop(&odd_queue, &num);
 	}
+	if(ret)
+		return ret;
 
 	ret = snprintf(numstr, sizeof(numstr), "%d\n", num);
 	if(ret > len)
@@ -303,17 +316,9 @@ static int modtimer_release(struct inode * inode, struct file * file) {
 		kfifo_reset(&buffer);
 		spin_unlock_irqrestore(&buff_lock, flags);
 
-		// Clear list of even numbers
-		if(down_interruptible(&even_list_lock))
-			return -EINTR;
-		clear_list(&even_list);
-		up(&even_list_lock);
-
-		// Clear list of odd numbers
-		if(down_interruptible(&odd_list_lock))
-			return -EINTR;
-		clear_list(&odd_list);
-		up(&odd_list_lock);
+		// Clear queues of even and odd numbers
+		clear_queue(&even_queue);
+		clear_queue(&odd_queue);
 
 		module_put(THIS_MODULE);
 		module_put(THIS_MODULE);
@@ -365,16 +370,18 @@ static ssize_t modconfig_write(struct file * file, const char __user *buff, size
 	char str[42];
 	unsigned int num;
 
-	if(len > sizeof(str))
+	if(len >= sizeof(str))
 		return -EINVAL;
 	if (copy_from_user(str,buff,len))
 		return -EFAULT;
+	str[len] = '\0';
 
-	if(sscanf(str, "timer_period_ms=%u", &num)) {
+	/* A zero period or range would spin the timer or divide by zero */
+	if(sscanf(str, "timer_period_ms=%u", &num) == 1 && num > 0) {
 		timer_period_ms = num;
-	} else if(sscanf(str, "emergency_threshold=%u", &num)) {
+	} else if(sscanf(str, "emergency_threshold=%u", &num) == 1) {
 		emergency_threshold = num;
-	} else if(sscanf(str, "max_random=%u", &num)) {
+	} else if(sscanf(str, "max_random=%u", &num) == 1 && num > 0) {
 		max_random = num;
 	} else {
 		return -EINVAL;
@@ -401,28 +408,45 @@ static const struct file_operations config_proc_entry_fops = {
 int init_module(void) {
 	int ret = 0;
 
+	sema_init(&wait_open, 0);
+	num_queue_init(&even_queue);
+	num_queue_init(&odd_queue);
+	if(kfifo_alloc(&buffer, MAX_BUFFER_LEN, GFP_KERNEL)) {
+		printk(KERN_INFO "modtimer: Can't allocate the buffer\n");
+		return -ENOMEM;
+	}
+	block_cache = kmem_cache_create("modtimer_block", sizeof(num_block_t), 0, 0, NULL);
+	if(block_cache == NULL) {
+		printk(KERN_INFO "modtimer: Can't create slab cache\n");
+		kfifo_free(&buffer);
+		return -ENOMEM;
+	}
+	workqueue = create_workqueue("modtimerwq");
+	if(workqueue == NULL) {
+		printk(KERN_INFO "modtimer: Can't create the workqueue\n");
+		kmem_cache_destroy(block_cache);
+		kfifo_free(&buffer);
+		return -ENOMEM;
+	}
+
+	INIT_WORK(&transfer_task, copy_items_into_list);
+
+	modt_init_timer();
+
+	/* The /proc entries go last: a failed load must not leave them behind */
 	proc_entry = proc_create( "modtimer", 0666, NULL, &proc_entry_fops);
 	config_proc_entry = proc_create( "modconfig", 0666, NULL, &config_proc_entry_fops);
 	if (proc_entry == NULL || config_proc_entry == NULL) {
 		ret = -ENOMEM;
 		printk(KERN_INFO "modtimer: Can't create one or both of /proc entry\n");
+		if (proc_entry)
+			remove_proc_entry("modtimer", NULL);
+		if (config_proc_entry)
+			remove_proc_entry("modconfig", NULL);
+		destroy_workqueue(workqueue);
+		kmem_cache_destroy(block_cache);
+		kfifo_free(&buffer);
 	} else {
-		sema_init(&wait_open, 0);
-		sem_cond_init(&wait_even);
-		sem_cond_init(&wait_odd);
-		if(kfifo_alloc(&buffer, MAX_BUFFER_LEN, GFP_KERNEL))
-			return -ENOMEM;
-
-		INIT_LIST_HEAD(&even_list);
-		INIT_LIST_HEAD(&odd_list);
-
-		workqueue = create_workqueue("modtimerwq");
-		if(workqueue == NULL)
-			return -ENOMEM;
-		INIT_WORK(&transfer_task, copy_items_into_list);
-
-		modt_init_timer();
-
 		printk(KERN_INFO "modtimer: Module loaded\n");
 	}
 
@@ -432,6 +456,9 @@ int init_module(void) {
 
 void cleanup_module( void ) {
 	remove_proc_entry("modtimer", NULL);
+	remove_proc_entry("modconfig", NULL);
+	destroy_workqueue(workqueue);
 	kfifo_free(&buffer);
+	kmem_cache_destroy(block_cache);
 	printk(KERN_INFO "modtimer: Module unloaded.\n");
 }
@@ -0,0 +1,30 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <time.h>
+
+/*
+ * Helpers for the microbenchmarks: time a loop with bench_now() and print
+ * one line per case with the operation rate and the cost of each operation.
+ */
+
+static inline unsigned long long bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void bench_report(const char *name, unsigned long ops, unsigned long long ns) {
+	printf("%-40s ops=%-10lu ops/s=%-14.1f ns/op=%.1f\n",
+			name, ops, ops * 1e9 / ns, (double) ns / ops);
+}
+
+/* Same, plus the data rate for benchmarks that move "bytes" in total */
+static inline void bench_report_bytes(const char *name, unsigned long ops, unsigned long long bytes,
+		unsigned long long ns) {
+	printf("%-40s ops=%-10lu ops/s=%-14.1f ns/op=%-10.1f MB/s=%.1f\n",
+			name, ops, ops * 1e9 / ns, (double) ns / ops, bytes * 1e3 / ns);
+}
+
+#endif
@@ -0,0 +1,93 @@
+#include "fifoproc.c"
+#include "bench.h"
+
+/*
+ * Throughput of /proc/prodcons: one producer and one consumer thread move
+ * a fixed amount of data through the ring, for several transfer sizes. The
+ * "fast path" cases alternate a write and a read from a single thread, so
+ * nothing ever blocks and only the cost of the non-blocking path is measured.
+ */
+
+#define TOTAL_BYTES (256UL << 20)
+#define MAX_MSG (1 << 20)
+
+static char buf[MAX_MSG];
+
+static const struct file_operations *fops;
+static struct file prod = { .f_mode = FMODE_WRITE };
+static struct file cons = { .f_mode = FMODE_READ };
+static int msg_size;
+
+static void* consumer(void *arg) {
+	static char rbuf[MAX_MSG];
+
+	fops->open(NULL, &cons);
+	while (fops->read(&cons, rbuf, msg_size, NULL) > 0)
+		;
+	fops->release(NULL, &cons);
+	return NULL;
+}
+
+static void bench_size(int size) {
+	unsigned long i, n = TOTAL_BYTES / size;
+	unsigned long long t0;
+	pthread_t tid;
+	char name[64];
+
+	msg_size = size;
+	pthread_create(&tid, NULL, consumer, NULL);
+	fops->open(NULL, &prod);
+
+	t0 = bench_now();
+	for (i = 0; i < n; i++)
+		fops->write(&prod, buf, size, NULL);
+	fops->release(NULL, &prod);
+	pthread_join(tid, NULL);
+
+	snprintf(name, sizeof(name), "prodcons %d-byte transfers", size);
+	bench_report_bytes(name, n, n * size, bench_now() - t0);
+}
+
+static void* open_consumer(void *arg) {
+	fops->open(NULL, &cons);
+	return NULL;
+}
+
+static void bench_fast_path(int size) {
+	unsigned long i, n = min(TOTAL_BYTES / size, 1UL << 22);
+	unsigned long long t0;
+	pthread_t tid;
+	char name[64];
+
+	pthread_create(&tid, NULL, open_consumer, NULL);
+	fops->open(NULL, &prod);
+	pthread_join(tid, NULL);
+
+	t0 = bench_now();
+	for (i = 0; i < n; i++) {
+		fops->write(&prod, buf, size, NULL);
+		fops->read(&cons, buf, size, NULL);
+	}
+	snprintf(name, sizeof(name), "prodcons fast path %d-byte write+read", size);
+	bench_report_bytes(name, n, n * size, bench_now() - t0);
+
+	fops->release(NULL, &prod);
+	fops->release(NULL, &cons);
+}
+
+int main(void) {
+	if (init_module() != 0)
+		return 1;
+	fops = kshim_proc_fops("prodcons");
+
+	memset(buf, 'x', sizeof(buf));
+	bench_size(64);
+	bench_size(4096);
+	bench_size(65536);
+	bench_size(MAX_MSG);
+	bench_fast_path(4);
+	bench_fast_path(4096);
+
+	cleanup_module();
+	return 0;
+}
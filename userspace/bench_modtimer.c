@@ -0,0 +1,133 @@
+#include "modtimer.c"
+#include "bench.h"
+
+/*
+ * Cost of each stage of the modtimer pipeline: the timer tick that fills the
+ * kfifo, the deferred work that moves it into the list and the read() that
+ * hands the numbers to userspace (one call per flush; ops are numbers). Run
+ * with the jiffies timer (one number per tick), with the per-CPU timer and
+ * ring, which skips buff_lock, and with the hrtimer generating a whole
+ * buffer (32 numbers) per expiry, read as text and as packed int32. The
+ * handoff case times a flush from the start of the work until a reader
+ * asleep on the empty list has returned with its numbers.
+ */
+
+#define ROUNDS 20000
+#define HANDOFF_ROUNDS 2000
+
+static const struct file_operations *handoff_fops;
+static unsigned long long handoff_done_ns;
+
+static int tick(bool hr) {
+	if (percpu_mode)
+		return kshim_run_timer(&per_cpu_ptr(&producers, 0)->timer);
+	return hr ? kshim_run_hrtimer(&my_hrtimer) : kshim_run_timer(&my_timer);
+}
+
+static void bench_pipeline(const struct file_operations *fops, const char *mode, bool hr) {
+	struct file f = { 0 };
+	unsigned long long ticks_ns = 0, work_ns = 0, read_ns = 0, t0;
+	unsigned long ticks = 0, works = 0, reads = 0;
+	char buf[KBUF_LEN], name[64];
+	int i, n;
+
+	fops->open(NULL, &f);
+	for (i = 0; i < ROUNDS; i++) {
+		t0 = bench_now();
+		for (n = 0; !work_pending(&transfer_task); n++)
+			tick(hr);
+		ticks_ns += bench_now() - t0;
+		ticks += n;
+
+		t0 = bench_now();
+		kshim_run_work(&transfer_task);
+		work_ns += bench_now() - t0;
+		works++;
+
+		t0 = bench_now();
+		fops->read(&f, buf, sizeof(buf), NULL);
+		read_ns += bench_now() - t0;
+		reads += n * batch;
+	}
+	fops->release(NULL, &f);
+
+	snprintf(name, sizeof(name), "modtimer %s tick", mode);
+	bench_report(name, ticks, ticks_ns);
+	snprintf(name, sizeof(name), "modtimer %s flush work", mode);
+	bench_report(name, works, work_ns);
+	snprintf(name, sizeof(name), "modtimer %s read", mode);
+	bench_report(name, reads, read_ns);
+}
+
+static void *handoff_reader(void *arg) {
+	char buf[KBUF_LEN];
+	int i;
+
+	for (i = 0; i < HANDOFF_ROUNDS; i++) {
+		handoff_fops->read(arg, buf, sizeof(buf), NULL);
+		__atomic_store_n(&handoff_done_ns, bench_now(), __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void bench_handoff(const struct file_operations *fops) {
+	struct file f = { 0 };
+	unsigned long long ns = 0, t0;
+	pthread_t tid;
+	int i;
+
+	handoff_fops = fops;
+	fops->open(NULL, &f);
+	pthread_create(&tid, NULL, handoff_reader, &f);
+	for (i = 0; i < HANDOFF_ROUNDS; i++) {
+		while (!work_pending(&transfer_task))
+			tick(false);
+		/* Wait for the reader to fall asleep */
+		while (!waitqueue_active(&readers_wq))
+			sched_yield();
+		__atomic_store_n(&handoff_done_ns, 0, __ATOMIC_RELAXED);
+		t0 = bench_now();
+		kshim_run_work(&transfer_task);
+		while (__atomic_load_n(&handoff_done_ns, __ATOMIC_ACQUIRE) == 0)
+			sched_yield();
+		ns += handoff_done_ns - t0;
+	}
+	pthread_join(tid, NULL);
+	fops->release(NULL, &f);
+
+	bench_report("modtimer handoff to a sleeping reader", HANDOFF_ROUNDS, ns);
+}
+
+int main(void) {
+	const struct file_operations *fops;
+
+	if (init_module() != 0)
+		return 1;
+	fops = kshim_proc_fops("modtimer");
+
+	bench_pipeline(fops, "timer", false);
+	/* percpu_mode is read-only: the rings are only allocated when loading with it */
+	cleanup_module();
+	percpu_mode = true;
+	if (init_module() != 0)
+		return 1;
+	fops = kshim_proc_fops("modtimer");
+	bench_pipeline(fops, "per-CPU timer", false);
+	cleanup_module();
+	percpu_mode = false;
+	if (init_module() != 0)
+		return 1;
+	fops = kshim_proc_fops("modtimer");
+	timer_period_us = MIN_PERIOD_US;
+	batch = buffer_size / sizeof(int);
+	bench_pipeline(fops, "hrtimer batch 32", true);
+	binary_format = true;
+	bench_pipeline(fops, "binary batch 32", true);
+	binary_format = false;
+	timer_period_us = 0;
+	batch = 1;
+	bench_handoff(fops);
+
+	cleanup_module();
+	return 0;
+}
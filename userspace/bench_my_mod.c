@@ -0,0 +1,85 @@
+#include "my_mod.c"
+#include "bench.h"
+
+/*
+ * Microbenchmarks for my_mod: text and ioctl inserts, lookups by value,
+ * full reads through seq_file and removals, for each backend and shard count.
+ */
+
+#define NR_VALUES 100000
+
+static char out[16 * NR_VALUES];
+
+static void bench_module(const char *be, unsigned int shards) {
+	const struct file_operations *fops;
+	struct file f = { 0 };
+	struct my_mod_ints req;
+	unsigned long long t0;
+	char name[64];
+	char cmd[32];
+	int* vals = malloc(NR_VALUES * sizeof(int));
+	loff_t off = 0;
+	int i, len;
+
+	backend = (char *) be;
+	nr_shards = shards;
+	use_chunks = false;
+	if (kshim_module_init() != 0 || vals == NULL) {
+		fprintf(stderr, "bench_my_mod: init failed\n");
+		exit(1);
+	}
+	fops = kshim_proc_fops("my_mod");
+	fops->open(NULL, &f);
+
+	t0 = bench_now();
+	for (i = 0; i < NR_VALUES; i++) {
+		len = sprintf(cmd, "add %d\n", i);
+		fops->write(&f, cmd, len, &off);
+	}
+	snprintf(name, sizeof(name), "%s/%u add (text)", be, shards);
+	bench_report(name, NR_VALUES, bench_now() - t0);
+
+	t0 = bench_now();
+	for (i = 0; i < NR_VALUES; i++)
+		count_value(i);
+	snprintf(name, sizeof(name), "%s/%u count", be, shards);
+	bench_report(name, NR_VALUES, bench_now() - t0);
+
+	t0 = bench_now();
+	for (i = 0; i < 10; i++) {
+		fops->llseek(&f, 0, SEEK_SET);
+		while (fops->read(&f, out, sizeof(out), &f.f_pos) > 0)
+			;
+	}
+	snprintf(name, sizeof(name), "%s/%u read (per value)", be, shards);
+	bench_report(name, 10UL * list_length(), bench_now() - t0);
+
+	t0 = bench_now();
+	for (i = 0; i < NR_VALUES; i++) {
+		len = sprintf(cmd, "remove %d\n", i);
+		fops->write(&f, cmd, len, &off);
+	}
+	snprintf(name, sizeof(name), "%s/%u remove (text)", be, shards);
+	bench_report(name, NR_VALUES, bench_now() - t0);
+
+	for (i = 0; i < NR_VALUES; i++)
+		vals[i] = i;
+	req.data = (unsigned long) vals;
+	req.count = NR_VALUES;
+	t0 = bench_now();
+	fops->unlocked_ioctl(&f, MY_MOD_IOC_ADD, (unsigned long) &req);
+	snprintf(name, sizeof(name), "%s/%u add (ioctl)", be, shards);
+	bench_report(name, NR_VALUES, bench_now() - t0);
+
+	fops->release(NULL, &f);
+	kshim_module_exit();
+	free(vals);
+}
+
+int main(void) {
+	bench_module("list", 1);
+	bench_module("list", 8);
+	bench_module("chunks", 1);
+	bench_module("chunks", 8);
+	return 0;
+}
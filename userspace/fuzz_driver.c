@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * Standalone driver for the fuzz targets when libFuzzer isn't available
+ * (e.g. building with gcc). Files given as arguments are replayed once;
+ * otherwise "-runs=N" random inputs are built from a dictionary of the
+ * command keywords mixed with random bytes. With clang, link the targets
+ * with -fsanitize=fuzzer instead and leave this file out.
+ */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static const char* dict[] = {
+	"add ", "remove ", "cleanup", "count ", "contains ",
+	"timer_period_ms=", "emergency_threshold=", "max_random=",
+	"\n", " ", "-", "+", "0", "1", "7", "2147483647", "-2147483648",
+	"4294967295", "4294967296", "99999999999999999999",
+};
+
+#define MAX_INPUT 512
+
+static size_t gen_input(uint8_t *buf) {
+	size_t len = 0;
+	const char* tok;
+	size_t n;
+
+	while (len < MAX_INPUT && rand() % 16 != 0) {
+		if (rand() % 4 == 0) {
+			buf[len++] = rand() % 256;
+			continue;
+		}
+		tok = dict[rand() % (sizeof(dict) / sizeof(dict[0]))];
+		n = strlen(tok);
+		if (len + n > MAX_INPUT)
+			break;
+		memcpy(buf + len, tok, n);
+		len += n;
+	}
+	return len;
+}
+
+static int run_file(const char *path) {
+	static uint8_t buf[1 << 16];
+	size_t n;
+	FILE *f = fopen(path, "rb");
+
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+	n = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	LLVMFuzzerTestOneInput(buf, n);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	uint8_t buf[MAX_INPUT];
+	long runs = 100000;
+	unsigned int seed = 1;
+	int files = 0;
+	long i;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "-runs=", 6) == 0)
+			runs = atol(argv[i] + 6);
+		else if (strncmp(argv[i], "-seed=", 6) == 0)
+			seed = atoi(argv[i] + 6);
+		else if (run_file(argv[i]) == 0)
+			files++;
+	}
+	if (files > 0)
+		return 0;
+
+	srand(seed);
+	for (i = 0; i < runs; i++)
+		LLVMFuzzerTestOneInput(buf, gen_input(buf));
+	printf("%s: %ld runs ok (seed %u)\n", argv[0], runs, seed);
+	return 0;
+}
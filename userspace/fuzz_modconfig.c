@@ -0,0 +1,31 @@
+#include "modtimer.c"
+
+/*
+ * Fuzz target for the /proc/modconfig parser. Whatever is written, the
+ * settings must stay usable by the timers (no zero period or range, no
+ * hrtimer period below MIN_PERIOD_US, a batch that fits the buffer) and the
+ * file must still read back.
+ */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static int initialized = 0;
+	static const struct file_operations *cfops;
+	struct file f = { 0 };
+	char buf[256];
+
+	if (!initialized) {
+		if (init_module() != 0)
+			abort();
+		cfops = kshim_proc_fops("modconfig");
+		initialized = 1;
+	}
+
+	cfops->write(&f, (const char *) data, size, NULL);
+	if (timer_period_ms == 0 || max_random == 0)
+		abort();
+	if ((timer_period_us > 0 && timer_period_us < MIN_PERIOD_US) || batch == 0 || batch > buffer_size / sizeof(int))
+		abort();
+	if (cfops->read(&f, buf, sizeof(buf), NULL) <= 0)
+		abort();
+	return 0;
+}
@@ -0,0 +1,64 @@
+#include "my_mod.c"
+
+/*
+ * Fuzz target for the text parsers of my_mod. The first byte picks the
+ * entry (/proc/my_mod or /proc/my_mod_query) and the rest is written to it
+ * as a single write(). After every input the list must still be consistent:
+ * a full read returns list_length() lines and the allocation counters add up.
+ */
+
+static const struct file_operations *fops;
+static const struct file_operations *qfops;
+static struct file f;
+static struct file q;
+static char out[1 << 20];
+
+static void check_list(void) {
+	ssize_t n;
+	size_t total = 0;
+	int lines = 0;
+
+	fops->llseek(&f, 0, SEEK_SET);
+	while ((n = fops->read(&f, out, sizeof(out), &f.f_pos)) > 0) {
+		for (ssize_t i = 0; i < n; i++)
+			lines += (out[i] == '\n');
+		total += n;
+	}
+	if (n < 0 || lines != list_length() || kshim_warnings > 0 ||
+			atomic_read(&nr_allocs) - atomic_read(&nr_frees) < list_length())
+		abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static int initialized = 0;
+	static unsigned long inputs = 0;
+	loff_t off = 0;
+	char buf[32];
+
+	if (!initialized) {
+		nr_shards = 4;
+		if (kshim_module_init() != 0)
+			abort();
+		fops = kshim_proc_fops("my_mod");
+		qfops = kshim_proc_fops("my_mod_query");
+		fops->open(NULL, &f);
+		qfops->open(NULL, &q);
+		initialized = 1;
+	}
+	if (size == 0)
+		return 0;
+
+	if (data[0] & 1) {
+		if (qfops->write(&q, (const char *) data + 1, size - 1, &off) >= 0 &&
+				qfops->read(&q, buf, sizeof(buf), &off) <= 0)
+			abort();
+	} else {
+		fops->write(&f, (const char *) data + 1, size - 1, &off);
+		check_list();
+	}
+
+	/* Keep the list short so every input stays fast */
+	if (++inputs % 256 == 0)
+		fops->write(&f, "\ncleanup\n", 9, &off);
+	return 0;
+}
@@ -0,0 +1,370 @@
+#include <stdarg.h>
+#include "kshim.h"
+
+int kshim_quiet = 1;
+int kshim_fault_next = 0;
+int kshim_warnings = 0;
+int kshim_nomem_next = 0;
+unsigned long kshim_cache_allocs = 0;
+unsigned long kshim_jiffies = 0;
+unsigned int kshim_online_cpus = 0;
+struct module kshim_this_module;
+
+/* ---------------------------------------------------------------- /proc */
+
+#define KSHIM_MAX_PROC 16
+
+static struct {
+	char name[64];
+	const struct file_operations *fops;
+} proc_entries[KSHIM_MAX_PROC];
+
+struct proc_dir_entry *proc_create(const char *name, unsigned short mode,
+		struct proc_dir_entry *parent, const struct file_operations *fops) {
+	int i;
+
+	(void)mode;
+	(void)parent;
+	for (i = 0; i < KSHIM_MAX_PROC; i++) {
+		if (proc_entries[i].fops == NULL) {
+			snprintf(proc_entries[i].name, sizeof(proc_entries[i].name), "%s", name);
+			proc_entries[i].fops = fops;
+			return (struct proc_dir_entry *) &proc_entries[i];
+		}
+	}
+	return NULL;
+}
+
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent) {
+	int i;
+
+	(void)parent;
+	for (i = 0; i < KSHIM_MAX_PROC; i++) {
+		if (proc_entries[i].fops && strcmp(proc_entries[i].name, name) == 0)
+			proc_entries[i].fops = NULL;
+	}
+}
+
+const struct file_operations *kshim_proc_fops(const char *name) {
+	int i;
+
+	for (i = 0; i < KSHIM_MAX_PROC; i++) {
+		if (proc_entries[i].fops && strcmp(proc_entries[i].name, name) == 0)
+			return proc_entries[i].fops;
+	}
+	return NULL;
+}
+
+int register_chrdev(unsigned int major, const char *name, const struct file_operations *fops) {
+	char path[64];
+
+	snprintf(path, sizeof(path), "dev/%s", name);
+	if (proc_create(path, 0, NULL, fops) == NULL)
+		return -EBUSY;
+	return major ? (int) major : 240; /* First of the "local/experimental" majors */
+}
+
+void unregister_chrdev(unsigned int major, const char *name) {
+	char path[64];
+
+	(void)major;
+	snprintf(path, sizeof(path), "dev/%s", name);
+	remove_proc_entry(path, NULL);
+}
+
+/* --------------------------------------------------------------- splice */
+
+/* As in 4.10+: the caller holds the pipe lock and nothing waits for room */
+ssize_t splice_to_pipe(struct pipe_inode_info *pipe, struct splice_pipe_desc *spd) {
+	struct pipe_buffer *buf;
+	int page_nr = 0;
+	ssize_t ret = 0;
+
+	if (spd->nr_pages == 0)
+		return 0;
+	if (pipe->readers == 0) {
+		ret = -EPIPE;
+		goto out;
+	}
+	while (page_nr < spd->nr_pages && pipe->nrbufs < pipe->buffers) {
+		buf = &pipe->bufs[(pipe->curbuf + pipe->nrbufs) % pipe->buffers];
+		buf->page = spd->pages[page_nr];
+		buf->offset = spd->partial[page_nr].offset;
+		buf->len = spd->partial[page_nr].len;
+		buf->ops = spd->ops;
+		pipe->nrbufs++;
+		ret += buf->len;
+		page_nr++;
+	}
+	if (ret == 0)
+		ret = -EAGAIN;
+out:
+	while (page_nr < spd->nr_pages)
+		spd->spd_release(spd, page_nr++);
+	return ret;
+}
+
+/* splice_from_pipe_feed() of 4.x, without waiting for more data once the pipe is empty */
+ssize_t __splice_from_pipe(struct pipe_inode_info *pipe, struct splice_desc *sd, splice_actor *actor) {
+	struct pipe_buffer *buf;
+	int ret = 0;
+
+	while (pipe->nrbufs && sd->total_len) {
+		buf = &pipe->bufs[pipe->curbuf];
+		sd->len = min((size_t) buf->len, sd->total_len);
+		ret = buf->ops->confirm(pipe, buf);
+		if (ret == 0)
+			ret = actor(pipe, buf, sd);
+		if (ret <= 0)
+			break;
+		buf->offset += ret;
+		buf->len -= ret;
+		sd->num_spliced += ret;
+		sd->total_len -= ret;
+		sd->pos += ret;
+		if (buf->len == 0) {
+			buf->ops->release(pipe, buf);
+			pipe->curbuf = (pipe->curbuf + 1) % pipe->buffers;
+			pipe->nrbufs--;
+		}
+	}
+	return sd->num_spliced ? (ssize_t) sd->num_spliced : ret;
+}
+
+static const struct pipe_buf_operations kshim_pipe_buf_ops = {
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+void kshim_pipe_init(struct pipe_inode_info *pipe) {
+	memset(pipe, 0, sizeof(*pipe));
+	pthread_mutex_init(&pipe->mutex, NULL);
+	pipe->buffers = PIPE_DEF_BUFFERS;
+	pipe->readers = pipe->writers = 1;
+}
+
+size_t kshim_pipe_fill(struct pipe_inode_info *pipe, const void *buf, size_t len) {
+	struct pipe_buffer *pb;
+	size_t done = 0, n;
+
+	while (done < len && pipe->nrbufs < pipe->buffers) {
+		pb = &pipe->bufs[(pipe->curbuf + pipe->nrbufs) % pipe->buffers];
+		pb->page = alloc_page(0);
+		if (pb->page == NULL)
+			break;
+		n = min(len - done, PAGE_SIZE);
+		memcpy(pb->page->addr, (const char *) buf + done, n);
+		pb->offset = 0;
+		pb->len = n;
+		pb->ops = &kshim_pipe_buf_ops;
+		pipe->nrbufs++;
+		done += n;
+	}
+	return done;
+}
+
+size_t kshim_pipe_drain(struct pipe_inode_info *pipe, void *buf, size_t size) {
+	struct pipe_buffer *pb;
+	size_t done = 0, n;
+
+	while (done < size && pipe->nrbufs) {
+		pb = &pipe->bufs[pipe->curbuf];
+		n = min(size - done, (size_t) pb->len);
+		memcpy((char *) buf + done, (char *) pb->page->addr + pb->offset, n);
+		pb->offset += n;
+		pb->len -= n;
+		done += n;
+		if (pb->len == 0) {
+			pb->ops->release(pipe, pb);
+			pipe->curbuf = (pipe->curbuf + 1) % pipe->buffers;
+			pipe->nrbufs--;
+		}
+	}
+	return done;
+}
+
+/* ------------------------------------------------------------- seq_file */
+
+int seq_open_private(struct file *f, const struct seq_operations *op, int psize) {
+	struct seq_file *m = calloc(1, sizeof(*m));
+
+	if (m == NULL)
+		return -ENOMEM;
+	m->private = calloc(1, psize);
+	if (m->private == NULL) {
+		free(m);
+		return -ENOMEM;
+	}
+	m->op = op;
+	f->private_data = m;
+	return 0;
+}
+
+int seq_release_private(struct inode *inode, struct file *f) {
+	struct seq_file *m = f->private_data;
+
+	(void)inode;
+	free(m->private);
+	free(m->buf);
+	free(m);
+	return 0;
+}
+
+/* As in the kernel: a one-record iterator around show(), allocated per open */
+static void *single_start(struct seq_file *m, loff_t *pos) {
+	(void)m;
+	return *pos ? NULL : (void *) 1;
+}
+
+static void *single_next(struct seq_file *m, void *v, loff_t *pos) {
+	(void)m;
+	(void)v;
+	++*pos;
+	return NULL;
+}
+
+static void single_stop(struct seq_file *m, void *v) {
+	(void)m;
+	(void)v;
+}
+
+int single_open(struct file *f, int (*show)(struct seq_file *, void *), void *data) {
+	struct seq_operations *op = calloc(1, sizeof(*op));
+	struct seq_file *m = calloc(1, sizeof(*m));
+
+	if (op == NULL || m == NULL) {
+		free(op);
+		free(m);
+		return -ENOMEM;
+	}
+	op->start = single_start;
+	op->next = single_next;
+	op->stop = single_stop;
+	op->show = show;
+	m->op = op;
+	m->private = data;
+	f->private_data = m;
+	return 0;
+}
+
+int single_release(struct inode *inode, struct file *f) {
+	struct seq_file *m = f->private_data;
+
+	(void)inode;
+	free((void *) m->op);
+	free(m->buf);
+	free(m);
+	return 0;
+}
+
+void seq_printf(struct seq_file *m, const char *fmt, ...) {
+	va_list args;
+	int len;
+
+	if (m->count < m->size) {
+		va_start(args, fmt);
+		len = vsnprintf(m->buf + m->count, m->size - m->count, fmt, args);
+		va_end(args);
+		if (m->count + len < m->size) {
+			m->count += len;
+			return;
+		}
+	}
+	m->count = m->size; /* Overflowed */
+}
+
+/* Same algorithm as the kernel's seq_read(): one buffer per call, start/stop around it */
+ssize_t seq_read(struct file *f, char __user *buf, size_t size, loff_t *ppos) {
+	struct seq_file *m = f->private_data;
+	size_t copied = 0;
+	size_t n, offs;
+	loff_t pos, next;
+	void *p;
+
+	if (m->buf == NULL) {
+		m->size = PAGE_SIZE;
+		m->buf = malloc(m->size);
+	}
+
+	if (m->count) {
+		n = min(m->count, size);
+		memcpy(buf, m->buf + m->from, n);
+		m->count -= n;
+		m->from += n;
+		size -= n;
+		buf += n;
+		copied += n;
+		if (!m->count) {
+			m->from = 0;
+			m->index++;
+		}
+		if (!size)
+			goto done;
+	}
+
+	m->from = 0;
+	pos = m->index;
+	p = m->op->start(m, &pos);
+	while (p) {
+		m->op->show(m, p);
+		if (m->count < m->size)
+			goto fill;
+		/* A single record didn't fit: grow the buffer and retry */
+		m->op->stop(m, p);
+		free(m->buf);
+		m->count = 0;
+		m->size <<= 1;
+		m->buf = malloc(m->size);
+		pos = m->index;
+		p = m->op->start(m, &pos);
+	}
+	m->op->stop(m, p);
+	m->count = 0;
+	goto done;
+
+fill:
+	while (m->count < size) {
+		offs = m->count;
+		next = pos;
+		p = m->op->next(m, p, &next);
+		if (p == NULL)
+			break;
+		m->op->show(m, p);
+		if (m->count == m->size) {
+			m->count = offs;
+			break;
+		}
+		pos = next;
+	}
+	m->op->stop(m, p);
+	n = min(m->count, size);
+	memcpy(buf, m->buf, n);
+	copied += n;
+	m->count -= n;
+	if (m->count)
+		m->from = n;
+	else
+		pos++;
+	m->index = pos;
+
+done:
+	*ppos += copied;
+	m->read_pos += copied;
+	return copied;
+}
+
+loff_t seq_lseek(struct file *f, loff_t offset, int whence) {
+	struct seq_file *m = f->private_data;
+
+	/* Only rewinding is supported */
+	if (offset != 0 || whence != 0)
+		return -EINVAL;
+	m->index = 0;
+	m->count = 0;
+	m->from = 0;
+	m->read_pos = 0;
+	f->f_pos = 0;
+	return 0;
+}
@@ -0,0 +1,1180 @@
+#ifndef KSHIM_H
+#define KSHIM_H
+
+/*
+ * Thin userspace stand-in for the bits of the kernel API used by the
+ * modules, so that their core logic can be compiled and exercised as a
+ * normal program.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+/* ---------------------------------------------------------------- misc */
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef long long s64;
+typedef unsigned int gfp_t;
+
+#define __user
+#define __init
+#define __exit
+#define __must_check
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+/* Every warning is counted in kshim_warnings, so tests can check none fired */
+extern int kshim_warnings;
+#define WARN_ON_ONCE(cond) ({							\
+	int __ret = !!(cond);							\
+	if (__ret && kshim_warnings++ == 0)					\
+		fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__);	\
+	__ret;									\
+})
+
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+static inline void __set_bit(unsigned long nr, unsigned long *map) { map[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG); }
+static inline int test_bit(unsigned long nr, const unsigned long *map) { return (map[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1; }
+static inline void bitmap_zero(unsigned long *map, unsigned int bits) { memset(map, 0, BITS_TO_LONGS(bits) * sizeof(long)); }
+
+#define GFP_KERNEL 0u
+#define GFP_ATOMIC 1u
+
+#define PAGE_SIZE 4096UL
+
+#define KERN_INFO ""
+#define KERN_DEBUG ""
+#define KERN_ERR ""
+#define KERN_WARNING ""
+
+extern int kshim_quiet;
+#define printk(...) do { if (!kshim_quiet) fprintf(stderr, __VA_ARGS__); } while (0)
+#define pr_info_ratelimited(...) printk(__VA_ARGS__)
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b) ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+
+#define READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#ifdef __x86_64__
+/* What the kernel uses on x86: cheaper than mfence, same ordering for normal memory */
+#define smp_mb() __asm__ __volatile__("lock; addl $0,-4(%%rsp)" ::: "memory", "cc")
+#else
+#define smp_mb() __sync_synchronize()
+#endif
+#define smp_rmb() __sync_synchronize()
+#define smp_wmb() __sync_synchronize()
+#define smp_mb__before_atomic() smp_mb()
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#ifdef __x86_64__
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+#define cpu_relax() barrier()
+#endif
+#define smp_processor_id() 0
+
+/* Scheduler bits used by busy-waits: nothing is ever preempted or signalled here */
+#define NSEC_PER_USEC 1000L
+#define current NULL
+#define need_resched() 0
+#define signal_pending(task) 0
+extern unsigned int kshim_online_cpus; /* Tests can pretend to run on more CPUs; 0 is the real count */
+static inline unsigned int num_online_cpus(void) {
+	return kshim_online_cpus ? kshim_online_cpus : sysconf(_SC_NPROCESSORS_ONLN);
+}
+static inline u64 local_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* -------------------------------------------------------------- per-CPU */
+
+/*
+ * One CPU shared by every test thread, so this_cpu_*() are atomic adds: the
+ * kernel gets the same effect by never sharing a CPU's copy while updating.
+ */
+#define NR_CPUS 1
+#define __percpu
+#define DEFINE_PER_CPU(type, name) __typeof__(type) name
+#define per_cpu(var, cpu) (*((void)(cpu), &(var)))
+#define per_cpu_ptr(ptr, cpu) ((void)(cpu), (ptr))
+#define this_cpu_ptr(ptr) (ptr)
+#define this_cpu_add(pcp, val) ((void) __atomic_fetch_add(&(pcp), (val), __ATOMIC_RELAXED))
+#define this_cpu_inc(pcp) this_cpu_add(pcp, 1)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < NR_CPUS; (cpu)++)
+/* The only CPU is the caller's, so the IPI is a plain call */
+static inline void on_each_cpu(void (*func)(void *), void *info, int wait) {
+	(void)wait;
+	func(info);
+}
+#define alloc_percpu(type) ((type *) calloc(1, sizeof(type)))
+#define free_percpu(p) free(p)
+
+#define ilog2(n) (63 - __builtin_clzll(n))
+
+/* ---------------------------------------------------------- tracepoints */
+
+/*
+ * Every event becomes a trace_<name>() that only counts its calls in
+ * kshim_trace_hits_<name>, so tests can see which events fired; the record
+ * layout and format are dropped.
+ */
+#define TP_PROTO(args...) args
+#define TP_ARGS(args...) args
+#define KSHIM_TRACE_EVENT(name, proto...)					\
+	static unsigned long kshim_trace_hits_##name;				\
+	static inline void trace_##name(proto) {				\
+		__atomic_fetch_add(&kshim_trace_hits_##name, 1, __ATOMIC_RELAXED);\
+	}
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) KSHIM_TRACE_EVENT(name, proto)
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) KSHIM_TRACE_EVENT(name, proto)
+
+/* ------------------------------------------------------------- modules */
+
+struct module { int refcount; };
+extern struct module kshim_this_module;
+#define THIS_MODULE (&kshim_this_module)
+#define MODULE_LICENSE(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_PARM_DESC(name, desc)
+#define module_param(name, type, perm)
+#define module_init(fn) int kshim_module_init(void) { return fn(); }
+#define module_exit(fn) void kshim_module_exit(void) { fn(); }
+int kshim_module_init(void);
+void kshim_module_exit(void);
+
+static inline int module_refcount(struct module *m) { return m->refcount; }
+static inline bool try_module_get(struct module *m) { m->refcount++; return true; }
+static inline void module_put(struct module *m) { m->refcount--; }
+
+/* -------------------------------------------------------------- atomic */
+
+typedef struct { int counter; } atomic_t;
+typedef struct { long counter; } atomic_long_t;
+#define ATOMIC_INIT(i) { (i) }
+#define ATOMIC_LONG_INIT(i) { (i) }
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_inc(v) ((void) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_dec(v) ((void) __atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_add(i, v) ((void) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_sub(i, v) ((void) __atomic_sub_fetch(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_inc_return(v) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_return(v) __atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_long_read atomic_read
+#define atomic_long_set atomic_set
+#define atomic_long_inc atomic_inc
+#define atomic_long_add atomic_add
+
+/* -------------------------------------------------------------- locking */
+
+typedef struct { pthread_mutex_t m; } spinlock_t;
+#define __SPIN_LOCK_UNLOCKED(name) { PTHREAD_MUTEX_INITIALIZER }
+#define DEFINE_SPINLOCK(name) spinlock_t name = __SPIN_LOCK_UNLOCKED(name)
+#define spin_lock_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define spin_lock(l) pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l) pthread_mutex_unlock(&(l)->m)
+#define spin_lock_irqsave(l, flags) do { (void)(flags); spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, flags) do { (void)(flags); spin_unlock(l); } while (0)
+#define spin_lock_bh(l) spin_lock(l)
+#define spin_unlock_bh(l) spin_unlock(l)
+
+typedef struct { pthread_rwlock_t l; } rwlock_t;
+#define DEFINE_RWLOCK(name) rwlock_t name = { PTHREAD_RWLOCK_INITIALIZER }
+#define read_lock(l) pthread_rwlock_rdlock(&(l)->l)
+#define read_unlock(l) pthread_rwlock_unlock(&(l)->l)
+#define write_lock(l) pthread_rwlock_wrlock(&(l)->l)
+#define write_unlock(l) pthread_rwlock_unlock(&(l)->l)
+
+/* Like the kernel's: a count guarded by a lock, with sleepers on a wait list */
+struct semaphore {
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	unsigned int count;
+};
+#define __SEMAPHORE_INITIALIZER(name, n) { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, n }
+#define DEFINE_SEMAPHORE(name) struct semaphore name = __SEMAPHORE_INITIALIZER(name, 1)
+static inline void sema_init(struct semaphore *sem, int val) {
+	pthread_mutex_init(&sem->lock, NULL);
+	pthread_cond_init(&sem->wait, NULL);
+	sem->count = val;
+}
+static inline void down(struct semaphore *sem) {
+	pthread_mutex_lock(&sem->lock);
+	while (sem->count == 0)
+		pthread_cond_wait(&sem->wait, &sem->lock);
+	sem->count--;
+	pthread_mutex_unlock(&sem->lock);
+}
+static inline int down_interruptible(struct semaphore *sem) {
+	down(sem);
+	return 0;
+}
+static inline int down_trylock(struct semaphore *sem) {
+	int ret = 1;
+
+	pthread_mutex_lock(&sem->lock);
+	if (sem->count > 0) {
+		sem->count--;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sem->lock);
+	return ret;
+}
+static inline void up(struct semaphore *sem) {
+	pthread_mutex_lock(&sem->lock);
+	sem->count++;
+	pthread_cond_signal(&sem->wait);
+	pthread_mutex_unlock(&sem->lock);
+}
+
+struct mutex { pthread_mutex_t m; };
+#define DEFINE_MUTEX(name) struct mutex name = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l) pthread_mutex_lock(&(l)->m)
+#define mutex_lock_interruptible(l) pthread_mutex_lock(&(l)->m)
+#define mutex_trylock(l) (pthread_mutex_trylock(&(l)->m) == 0)
+#define mutex_unlock(l) pthread_mutex_unlock(&(l)->m)
+
+/*
+ * Wait queues block for real, on a condition variable. nr_waiters is raised
+ * before the condition is checked, so a waker that changes the condition,
+ * issues smp_mb() and then sees waitqueue_active() false can't miss anyone.
+ * There are no signals, so the interruptible waits always return 0.
+ */
+typedef struct {
+	pthread_mutex_t m;
+	pthread_cond_t c;
+	int nr_waiters;
+} wait_queue_head_t;
+#define __WAIT_QUEUE_HEAD_INITIALIZER(name) { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }
+#define DECLARE_WAIT_QUEUE_HEAD(name) wait_queue_head_t name = __WAIT_QUEUE_HEAD_INITIALIZER(name)
+static inline void init_waitqueue_head(wait_queue_head_t *wq) {
+	pthread_mutex_init(&wq->m, NULL);
+	pthread_cond_init(&wq->c, NULL);
+	wq->nr_waiters = 0;
+}
+#define waitqueue_active(wq) (__atomic_load_n(&(wq)->nr_waiters, __ATOMIC_SEQ_CST) > 0)
+static inline void wake_up(wait_queue_head_t *wq) {
+	pthread_mutex_lock(&wq->m);
+	pthread_cond_broadcast(&wq->c);
+	pthread_mutex_unlock(&wq->m);
+}
+#define wake_up_interruptible wake_up
+#define wake_up_all wake_up
+#define wake_up_interruptible_all wake_up
+#define wait_event(wq, cond) do { \
+	if (cond) \
+		break; \
+	pthread_mutex_lock(&(wq).m); \
+	__atomic_add_fetch(&(wq).nr_waiters, 1, __ATOMIC_SEQ_CST); \
+	while (!(cond)) \
+		pthread_cond_wait(&(wq).c, &(wq).m); \
+	__atomic_sub_fetch(&(wq).nr_waiters, 1, __ATOMIC_SEQ_CST); \
+	pthread_mutex_unlock(&(wq).m); \
+} while (0)
+#define wait_event_interruptible(wq, cond) ({ wait_event(wq, cond); 0; })
+
+/* ---------------------------------------------------------------- lists */
+
+struct list_head { struct list_head *next, *prev; };
+struct hlist_head { struct hlist_node *first; };
+struct hlist_node { struct hlist_node *next, **pprev; };
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+static inline void INIT_LIST_HEAD(struct list_head *l) { l->next = l; l->prev = l; }
+static inline void __list_add(struct list_head *n, struct list_head *prev, struct list_head *next) {
+	next->prev = n;
+	n->next = next;
+	n->prev = prev;
+	WRITE_ONCE(prev->next, n);
+}
+static inline void list_add(struct list_head *n, struct list_head *h) { __list_add(n, h, h->next); }
+static inline void list_add_tail(struct list_head *n, struct list_head *h) { __list_add(n, h->prev, h); }
+static inline void __list_del(struct list_head *prev, struct list_head *next) {
+	next->prev = prev;
+	WRITE_ONCE(prev->next, next);
+}
+static inline void list_del(struct list_head *e) { __list_del(e->prev, e->next); e->next = e->prev = NULL; }
+static inline void list_del_init(struct list_head *e) { __list_del(e->prev, e->next); INIT_LIST_HEAD(e); }
+static inline int list_empty(const struct list_head *h) { return READ_ONCE(h->next) == h; }
+static inline int list_is_singular(const struct list_head *h) { return !list_empty(h) && h->next == h->prev; }
+static inline void list_replace(struct list_head *old, struct list_head *n) {
+	n->next = old->next;
+	n->next->prev = n;
+	n->prev = old->prev;
+	n->prev->next = n;
+}
+static inline void list_splice_init(struct list_head *list, struct list_head *head) {
+	if (!list_empty(list)) {
+		struct list_head *first = list->next, *last = list->prev, *at = head->next;
+		first->prev = head;
+		head->next = first;
+		last->next = at;
+		at->prev = last;
+		INIT_LIST_HEAD(list);
+	}
+}
+static inline void list_splice_tail_init(struct list_head *list, struct list_head *head) {
+	if (!list_empty(list)) {
+		struct list_head *first = list->next, *last = list->prev, *at = head->prev;
+		first->prev = at;
+		at->next = first;
+		last->next = head;
+		head->prev = last;
+		INIT_LIST_HEAD(list);
+	}
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member) list_entry((ptr)->prev, type, member)
+#define list_first_entry_or_null(ptr, type, member) \
+	(!list_empty(ptr) ? list_first_entry(ptr, type, member) : NULL)
+#define list_next_entry(pos, member) list_entry((pos)->member.next, __typeof__(*(pos)), member)
+#define list_for_each(pos, head) for (pos = (head)->next; pos != (head); pos = pos->next)
+#define list_for_each_safe(pos, n, head) \
+	for (pos = (head)->next, n = pos->next; pos != (head); pos = n, n = pos->next)
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_first_entry(head, __typeof__(*pos), member); \
+	     &pos->member != (head); pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for (pos = list_first_entry(head, __typeof__(*pos), member), \
+	     n = list_next_entry(pos, member); \
+	     &pos->member != (head); pos = n, n = list_next_entry(n, member))
+
+#define INIT_HLIST_HEAD(h) ((h)->first = NULL)
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h) {
+	struct hlist_node *first = h->first;
+	n->next = first;
+	if (first)
+		first->pprev = &n->next;
+	WRITE_ONCE(h->first, n);
+	n->pprev = &h->first;
+}
+static inline void hlist_del(struct hlist_node *n) {
+	struct hlist_node *next = n->next, **pprev = n->pprev;
+	WRITE_ONCE(*pprev, next);
+	if (next)
+		next->pprev = pprev;
+}
+#define hlist_entry(ptr, type, member) container_of(ptr, type, member)
+#define hlist_entry_safe(ptr, type, member) \
+	({ __typeof__(ptr) ____ptr = (ptr); ____ptr ? hlist_entry(____ptr, type, member) : NULL; })
+#define hlist_for_each_entry(pos, head, member) \
+	for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); pos; \
+	     pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+#define hlist_for_each_entry_safe(pos, n, head, member) \
+	for (pos = hlist_entry_safe((head)->first, __typeof__(*pos), member); \
+	     pos && ({ n = pos->member.next; 1; }); \
+	     pos = hlist_entry_safe(n, __typeof__(*pos), member))
+
+/* Lock-less lists: producers push with a fully ordered compare-and-swap, consumers take the whole list with an exchange */
+struct llist_head { struct llist_node *first; };
+struct llist_node { struct llist_node *next; };
+
+#define LLIST_HEAD_INIT(name) { NULL }
+#define LLIST_HEAD(name) struct llist_head name = LLIST_HEAD_INIT(name)
+static inline void init_llist_head(struct llist_head *h) { h->first = NULL; }
+static inline int llist_empty(const struct llist_head *h) { return __atomic_load_n(&h->first, __ATOMIC_ACQUIRE) == NULL; }
+static inline struct llist_node *llist_next(struct llist_node *n) { return n->next; }
+/* Returns whether the list was empty */
+static inline bool llist_add_batch(struct llist_node *first, struct llist_node *last, struct llist_head *h) {
+	struct llist_node *old = __atomic_load_n(&h->first, __ATOMIC_RELAXED);
+
+	do {
+		last->next = old;
+	} while (!__atomic_compare_exchange_n(&h->first, &old, first, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	return old == NULL;
+}
+#define llist_add(n, h) llist_add_batch(n, n, h)
+static inline struct llist_node *llist_del_all(struct llist_head *h) {
+	return __atomic_exchange_n(&h->first, NULL, __ATOMIC_ACQUIRE);
+}
+static inline struct llist_node *llist_reverse_order(struct llist_node *head) {
+	struct llist_node *n, *rev = NULL;
+
+	while (head) {
+		n = head;
+		head = head->next;
+		n->next = rev;
+		rev = n;
+	}
+	return rev;
+}
+#define llist_entry(ptr, type, member) container_of(ptr, type, member)
+#define llist_for_each_entry_safe(pos, n, node, member) \
+	for (pos = llist_entry((node), __typeof__(*pos), member); \
+	     (uintptr_t) pos + offsetof(__typeof__(*pos), member) != 0 && \
+	     (n = llist_entry(pos->member.next, __typeof__(*n), member), 1); \
+	     pos = n)
+
+/* ------------------------------------------------------------------ RCU */
+
+/*
+ * Readers and writers of the tests never overlap with a grace period in
+ * flight, so RCU degenerates to plain list operations and callbacks run
+ * right away.
+ */
+struct rcu_head { struct rcu_head *next; void (*func)(struct rcu_head *); };
+#define rcu_read_lock() do { } while (0)
+#define rcu_read_unlock() do { } while (0)
+#define rcu_dereference(p) READ_ONCE(p)
+#define rcu_assign_pointer(p, v) smp_store_release(&(p), (v))
+#define synchronize_rcu() do { } while (0)
+#define rcu_barrier() do { } while (0)
+static inline void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *)) { func(head); }
+#define kfree_rcu(ptr, field) free(ptr)
+#define list_next_rcu(list) ((list)->next)
+#define list_add_rcu list_add
+#define list_add_tail_rcu list_add_tail
+#define list_del_rcu(e) __list_del((e)->prev, (e)->next)
+#define list_replace_rcu list_replace
+#define list_for_each_entry_rcu list_for_each_entry
+#define hlist_add_head_rcu hlist_add_head
+#define hlist_del_rcu hlist_del
+#define hlist_for_each_entry_rcu hlist_for_each_entry
+
+/* -------------------------------------------------------------- hashing */
+
+#define GOLDEN_RATIO_32 0x61C88647u
+static inline u32 hash_32(u32 val, unsigned int bits) { return (val * GOLDEN_RATIO_32) >> (32 - bits); }
+
+/* --------------------------------------------------------------- memory */
+
+static inline void *kmalloc(size_t size, gfp_t flags) { (void)flags; return malloc(size); }
+static inline void *kzalloc(size_t size, gfp_t flags) { (void)flags; return calloc(1, size); }
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags) { (void)flags; return calloc(n, size); }
+static inline void kfree(const void *p) { free((void *)p); }
+static inline void *vmalloc(unsigned long size) { return malloc(size); }
+static inline void *vzalloc(unsigned long size) { return calloc(1, size); }
+static inline void vfree(const void *p) { free((void *)p); }
+/* Zeroed and page aligned, like the memory the kernel lets userspace map */
+static inline void *vmalloc_user(unsigned long size) {
+	void *p;
+
+	if (posix_memalign(&p, PAGE_SIZE, size))
+		return NULL;
+	return memset(p, 0, size);
+}
+static inline unsigned long __get_free_page(gfp_t flags) { (void)flags; return (unsigned long) malloc(PAGE_SIZE); }
+static inline void free_page(unsigned long addr) { free((void *)addr); }
+
+/* A struct page is just its (always mapped) memory */
+struct page { void *addr; };
+static inline struct page *alloc_page(gfp_t flags) {
+	struct page *page = malloc(sizeof(*page));
+
+	(void)flags;
+	if (page && (page->addr = malloc(PAGE_SIZE)) == NULL) {
+		free(page);
+		page = NULL;
+	}
+	return page;
+}
+static inline void put_page(struct page *page) { free(page->addr); free(page); }
+static inline void *page_address(const struct page *page) { return page->addr; }
+static inline void *kmap(struct page *page) { return page->addr; }
+static inline void kunmap(struct page *page) { (void)page; }
+
+/*
+ * kshim_cache_allocs counts kmem_cache_alloc() calls, and kshim_nomem_next = n
+ * makes the n-th one from now fail
+ */
+extern int kshim_nomem_next;
+extern unsigned long kshim_cache_allocs;
+
+struct kmem_cache { size_t size; };
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+		unsigned long flags, void (*ctor)(void *)) {
+	struct kmem_cache *c = malloc(sizeof(*c));
+	(void)name; (void)align; (void)flags; (void)ctor;
+	if (c)
+		c->size = (size + 7) & ~(size_t)7;
+	return c;
+}
+static inline void kmem_cache_destroy(struct kmem_cache *c) { free(c); }
+static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t flags) {
+	(void)flags;
+	__atomic_fetch_add(&kshim_cache_allocs, 1, __ATOMIC_RELAXED);
+	if (kshim_nomem_next && --kshim_nomem_next == 0)
+		return NULL;
+	return malloc(c->size);
+}
+static inline void kmem_cache_free(struct kmem_cache *c, void *p) { (void)c; free(p); }
+static inline unsigned int kmem_cache_size(struct kmem_cache *c) { return c->size; }
+
+/* ---------------------------------------------------------------- kfifo */
+
+/* Byte FIFO with the kernel's semantics: power-of-two size, free-running indexes */
+struct kfifo {
+	unsigned int in;
+	unsigned int out;
+	unsigned int mask;
+	unsigned char *data;
+};
+
+static inline int kfifo_alloc(struct kfifo *fifo, unsigned int size, gfp_t flags) {
+	unsigned int n = 2;
+
+	(void)flags;
+	if (size < 2)
+		return -EINVAL;
+	while (n < size)
+		n <<= 1;
+	fifo->data = malloc(n);
+	if (fifo->data == NULL)
+		return -ENOMEM;
+	fifo->in = fifo->out = 0;
+	fifo->mask = n - 1;
+	return 0;
+}
+static inline void kfifo_free(struct kfifo *fifo) {
+	free(fifo->data);
+	fifo->data = NULL;
+	fifo->mask = 0;
+}
+static inline void kfifo_reset(struct kfifo *fifo) { fifo->in = fifo->out = 0; }
+static inline unsigned int kfifo_size(struct kfifo *fifo) { return fifo->mask + 1; }
+static inline unsigned int kfifo_len(struct kfifo *fifo) { return fifo->in - fifo->out; }
+static inline unsigned int kfifo_avail(struct kfifo *fifo) { return kfifo_size(fifo) - kfifo_len(fifo); }
+static inline bool kfifo_is_empty(struct kfifo *fifo) { return fifo->in == fifo->out; }
+static inline bool kfifo_is_full(struct kfifo *fifo) { return kfifo_len(fifo) > fifo->mask; }
+
+static inline void kshim_kfifo_copy_in(struct kfifo *fifo, const void *src, unsigned int len, unsigned int off) {
+	unsigned int size = kfifo_size(fifo);
+	unsigned int l;
+
+	off &= fifo->mask;
+	l = min(len, size - off);
+	memcpy(fifo->data + off, src, l);
+	memcpy(fifo->data, (const unsigned char *)src + l, len - l);
+}
+static inline void kshim_kfifo_copy_out(struct kfifo *fifo, void *dst, unsigned int len, unsigned int off) {
+	unsigned int size = kfifo_size(fifo);
+	unsigned int l;
+
+	off &= fifo->mask;
+	l = min(len, size - off);
+	memcpy(dst, fifo->data + off, l);
+	memcpy((unsigned char *)dst + l, fifo->data, len - l);
+}
+static inline unsigned int kfifo_in(struct kfifo *fifo, const void *buf, unsigned int len) {
+	len = min(len, kfifo_avail(fifo));
+	kshim_kfifo_copy_in(fifo, buf, len, fifo->in);
+	smp_wmb();
+	fifo->in += len;
+	return len;
+}
+static inline unsigned int kfifo_out_peek(struct kfifo *fifo, void *buf, unsigned int len) {
+	len = min(len, kfifo_len(fifo));
+	kshim_kfifo_copy_out(fifo, buf, len, fifo->out);
+	return len;
+}
+static inline unsigned int kfifo_out(struct kfifo *fifo, void *buf, unsigned int len) {
+	len = kfifo_out_peek(fifo, buf, len);
+	smp_wmb();
+	fifo->out += len;
+	return len;
+}
+/* Drops "len" bytes already peeked, as after a DMA transfer out of the fifo */
+static inline void kfifo_dma_out_finish(struct kfifo *fifo, unsigned int len) {
+	smp_wmb();
+	fifo->out += len;
+}
+
+/* Buffer supplied by the caller; like the kernel, a size that isn't a power of two is rounded down */
+static inline int kfifo_init(struct kfifo *fifo, void *buffer, unsigned int size) {
+	unsigned int n = 1;
+
+	while (n <= size / 2)
+		n <<= 1;
+	if (n < 2)
+		return -EINVAL;
+	fifo->data = buffer;
+	fifo->in = fifo->out = 0;
+	fifo->mask = n - 1;
+	return 0;
+}
+
+/* Defined further down, with the rest of the user copies */
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n);
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n);
+
+/* Like the kernel's: on a fault nothing is transferred and *copied is 0 */
+static inline int kfifo_from_user(struct kfifo *fifo, const void __user *from, unsigned long len,
+		unsigned int *copied) {
+	unsigned int off = fifo->in & fifo->mask;
+	unsigned int l;
+
+	len = min(len, (unsigned long) kfifo_avail(fifo));
+	l = min((unsigned int) len, kfifo_size(fifo) - off);
+	if (copy_from_user(fifo->data + off, from, l)) {
+		*copied = 0;
+		return -EFAULT;
+	}
+	/* Like the kernel, what was copied before a fault stays in the FIFO */
+	if (copy_from_user(fifo->data, (const char *) from + l, len - l)) {
+		smp_wmb();
+		fifo->in += l;
+		*copied = l;
+		return -EFAULT;
+	}
+	smp_wmb();
+	fifo->in += len;
+	*copied = len;
+	return 0;
+}
+static inline int kfifo_to_user(struct kfifo *fifo, void __user *to, unsigned long len,
+		unsigned int *copied) {
+	unsigned int off = fifo->out & fifo->mask;
+	unsigned int l;
+
+	len = min(len, (unsigned long) kfifo_len(fifo));
+	l = min((unsigned int) len, kfifo_size(fifo) - off);
+	if (copy_to_user(to, fifo->data + off, l)) {
+		*copied = 0;
+		return -EFAULT;
+	}
+	if (copy_to_user((char *) to + l, fifo->data, len - l)) {
+		smp_wmb();
+		fifo->out += l;
+		*copied = l;
+		return -EFAULT;
+	}
+	smp_wmb();
+	fifo->out += len;
+	*copied = len;
+	return 0;
+}
+
+/*
+ * Record FIFO (kfifo_rec_ptr_2): the same ring, with every record preceded
+ * by its length in 2 bytes. Like the kernel, a record is published only once
+ * it's fully copied, and a record that doesn't fit isn't copied at all. The
+ * kfifo_* names below take either kind of FIFO.
+ */
+struct kfifo_rec_ptr_2 { struct kfifo kfifo; };
+
+#define KSHIM_REC_MAX 65535
+
+static inline unsigned int kshim_kfifo_rec_peek_len(struct kfifo *fifo) {
+	if (kfifo_is_empty(fifo))
+		return 0;
+	return fifo->data[fifo->out & fifo->mask] | (fifo->data[(fifo->out + 1) & fifo->mask] << 8);
+}
+static inline unsigned int kshim_kfifo_rec_avail(struct kfifo *fifo) {
+	unsigned int unused = kfifo_avail(fifo);
+
+	return unused < 2 ? 0 : min(unused - 2, (unsigned int) KSHIM_REC_MAX);
+}
+static inline int kshim_kfifo_rec_from_user(struct kfifo *fifo, const void __user *from,
+		unsigned long len, unsigned int *copied) {
+	unsigned int off = (fifo->in + 2) & fifo->mask;
+	unsigned int l;
+
+	len = min(len, (unsigned long) KSHIM_REC_MAX);
+	*copied = 0;
+	if (len + 2 > kfifo_avail(fifo))
+		return 0;
+	l = min((unsigned int) len, kfifo_size(fifo) - off);
+	if (copy_from_user(fifo->data + off, from, l) ||
+			copy_from_user(fifo->data, (const char *) from + l, len - l))
+		return -EFAULT;
+	fifo->data[fifo->in & fifo->mask] = len & 0xff;
+	fifo->data[(fifo->in + 1) & fifo->mask] = len >> 8;
+	smp_wmb();
+	fifo->in += len + 2;
+	*copied = len;
+	return 0;
+}
+/* A record longer than len is cut short; the rest of it is dropped */
+static inline int kshim_kfifo_rec_to_user(struct kfifo *fifo, void __user *to,
+		unsigned long len, unsigned int *copied) {
+	unsigned int n = kshim_kfifo_rec_peek_len(fifo);
+	unsigned int off = (fifo->out + 2) & fifo->mask;
+	unsigned int l;
+
+	*copied = 0;
+	if (kfifo_is_empty(fifo))
+		return 0;
+	len = min(len, (unsigned long) n);
+	l = min((unsigned int) len, kfifo_size(fifo) - off);
+	if (copy_to_user(to, fifo->data + off, l) ||
+			copy_to_user((char *) to + l, fifo->data, len - l))
+		return -EFAULT;
+	smp_wmb();
+	fifo->out += n + 2;
+	*copied = len;
+	return 0;
+}
+
+#define KSHIM_KFIFO(f) _Generic((f), struct kfifo_rec_ptr_2 *: &((struct kfifo_rec_ptr_2 *) (f))->kfifo, \
+		default: (f))
+#define KSHIM_KFIFO_REC(f, rec, byte) _Generic((f), struct kfifo_rec_ptr_2 *: rec, default: byte)
+
+#define kfifo_init(f, buffer, size) kfifo_init(KSHIM_KFIFO(f), buffer, size)
+#define kfifo_reset(f) kfifo_reset(KSHIM_KFIFO(f))
+#define kfifo_size(f) kfifo_size(KSHIM_KFIFO(f))
+#define kfifo_len(f) kfifo_len(KSHIM_KFIFO(f))
+#define kfifo_is_empty(f) kfifo_is_empty(KSHIM_KFIFO(f))
+#define kfifo_is_full(f) kfifo_is_full(KSHIM_KFIFO(f))
+#define kfifo_avail(f) KSHIM_KFIFO_REC(f, kshim_kfifo_rec_avail, kfifo_avail)(KSHIM_KFIFO(f))
+#define kfifo_peek_len(f) kshim_kfifo_rec_peek_len(&(f)->kfifo)
+#define kfifo_from_user(f, from, len, copied) \
+	KSHIM_KFIFO_REC(f, kshim_kfifo_rec_from_user, kfifo_from_user)(KSHIM_KFIFO(f), from, len, copied)
+#define kfifo_to_user(f, to, len, copied) \
+	KSHIM_KFIFO_REC(f, kshim_kfifo_rec_to_user, kfifo_to_user)(KSHIM_KFIFO(f), to, len, copied)
+
+static inline bool is_power_of_2(unsigned long n) { return n != 0 && (n & (n - 1)) == 0; }
+static inline unsigned long roundup_pow_of_two(unsigned long n) {
+	unsigned long r = 1;
+
+	while (r < n)
+		r <<= 1;
+	return r;
+}
+
+/* ----------------------------------------------------- timers, workqueues */
+
+/*
+ * Nothing runs asynchronously: timers and work items only record that they
+ * are pending, and the tests fire them with kshim_run_timer() and
+ * kshim_run_work() at the points they want to exercise.
+ */
+#define HZ 1000
+extern unsigned long kshim_jiffies;
+#define jiffies kshim_jiffies
+static inline unsigned long msecs_to_jiffies(unsigned int ms) { return ms; }
+static inline unsigned int jiffies_to_msecs(unsigned long j) { return j; }
+
+struct timer_list {
+	unsigned long expires;
+	void (*function)(unsigned long);
+	unsigned long data;
+	int pending;
+};
+static inline void init_timer(struct timer_list *t) { t->pending = 0; }
+#define init_timer_pinned init_timer
+static inline void add_timer(struct timer_list *t) { t->pending = 1; }
+static inline int mod_timer(struct timer_list *t, unsigned long expires) {
+	int was = t->pending;
+	t->expires = expires;
+	t->pending = 1;
+	return was;
+}
+static inline int del_timer(struct timer_list *t) {
+	int was = t->pending;
+	t->pending = 0;
+	return was;
+}
+#define del_timer_sync del_timer
+static inline int timer_pending(const struct timer_list *t) { return t->pending; }
+/* Test helper: runs the handler of a pending timer, as if it had expired */
+static inline int kshim_run_timer(struct timer_list *t) {
+	if (!t->pending)
+		return 0;
+	t->pending = 0;
+	kshim_jiffies = t->expires;
+	t->function(t->data);
+	return 1;
+}
+
+/* hrtimers keep the expiry as a plain interval: the tests only care whether they're armed */
+typedef long long ktime_t;
+static inline ktime_t ns_to_ktime(u64 ns) { return ns; }
+static inline s64 ktime_to_ns(ktime_t kt) { return kt; }
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode { HRTIMER_MODE_REL, HRTIMER_MODE_REL_PINNED };
+
+struct hrtimer {
+	enum hrtimer_restart (*function)(struct hrtimer *);
+	ktime_t expires;
+	int pending;
+};
+static inline void hrtimer_init(struct hrtimer *t, clockid_t clock, enum hrtimer_mode mode) {
+	(void)clock;
+	(void)mode;
+	t->pending = 0;
+}
+static inline void hrtimer_start(struct hrtimer *t, ktime_t tim, enum hrtimer_mode mode) {
+	(void)mode;
+	t->expires = tim;
+	t->pending = 1;
+}
+static inline u64 hrtimer_forward_now(struct hrtimer *t, ktime_t interval) {
+	t->expires = interval;
+	return 1;
+}
+static inline int hrtimer_cancel(struct hrtimer *t) {
+	int was = t->pending;
+	t->pending = 0;
+	return was;
+}
+static inline bool hrtimer_active(const struct hrtimer *t) { return t->pending; }
+/* Test helper: runs the handler of an armed hrtimer and re-arms it if it asks to */
+static inline int kshim_run_hrtimer(struct hrtimer *t) {
+	if (!t->pending)
+		return 0;
+	t->pending = 0;
+	if (t->function(t) == HRTIMER_RESTART)
+		t->pending = 1;
+	return 1;
+}
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *);
+struct work_struct {
+	work_func_t func;
+	int pending;
+};
+#define INIT_WORK(w, f) do { (w)->func = (f); (w)->pending = 0; } while (0)
+#define work_pending(w) ((w)->pending)
+static inline bool schedule_work(struct work_struct *w) {
+	if (w->pending)
+		return false;
+	w->pending = 1;
+	return true;
+}
+static inline bool schedule_work_on(int cpu, struct work_struct *w) { (void)cpu; return schedule_work(w); }
+/* Test helper: runs a pending work item, as if a worker had picked it up */
+static inline int kshim_run_work(struct work_struct *w) {
+	if (!w->pending)
+		return 0;
+	w->pending = 0;
+	w->func(w);
+	return 1;
+}
+static inline bool flush_work(struct work_struct *w) { return kshim_run_work(w); }
+static inline bool cancel_work_sync(struct work_struct *w) {
+	int was = w->pending;
+	w->pending = 0;
+	return was;
+}
+
+/* --------------------------------------------------------------- random */
+
+static inline unsigned int get_random_int(void) { return (unsigned int) random(); }
+static inline u32 prandom_u32(void) { return (u32) random(); }
+
+/* ------------------------------------------------------------- uaccess */
+
+/*
+ * "User" pointers are plain pointers. The zero page faults like it would in
+ * the kernel, and kshim_fault_next = n makes the n-th copy from now fail.
+ */
+extern int kshim_fault_next;
+static inline int kshim_user_fault(const void *p) {
+	if (kshim_fault_next && --kshim_fault_next == 0)
+		return 1;
+	return (unsigned long) p < PAGE_SIZE;
+}
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n) {
+	if (n && kshim_user_fault(to))
+		return n;
+	memcpy(to, from, n);
+	return 0;
+}
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n) {
+	if (n && kshim_user_fault(from))
+		return n;
+	memcpy(to, from, n);
+	return 0;
+}
+#define put_user(x, ptr) (kshim_user_fault(ptr) ? -EFAULT : (*(ptr) = (x), 0))
+#define get_user(x, ptr) (kshim_user_fault(ptr) ? -EFAULT : ((x) = *(ptr), 0))
+
+/* ---------------------------------------------------------------- files */
+
+typedef unsigned int fmode_t;
+#define FMODE_READ 0x1
+#define FMODE_WRITE 0x2
+
+#define MINORBITS 20
+#define MINOR(dev) ((unsigned int) ((dev) & ((1U << MINORBITS) - 1)))
+#define MAJOR(dev) ((unsigned int) ((dev) >> MINORBITS))
+#define MKDEV(ma, mi) (((ma) << MINORBITS) | (mi))
+struct inode { dev_t i_rdev; };
+static inline unsigned int iminor(const struct inode *inode) { return MINOR(inode->i_rdev); }
+static inline unsigned int imajor(const struct inode *inode) { return MAJOR(inode->i_rdev); }
+struct file {
+	fmode_t f_mode;
+	unsigned int f_flags;
+	loff_t f_pos;
+	void *private_data;
+};
+
+struct poll_table_struct;
+struct pipe_inode_info;
+
+/*
+ * Synchronous kiocb and the ITER_IOVEC flavour of iov_iter, following 4.x:
+ * advancing past the end of a segment (or by 0 over an empty one) moves on
+ * to the next segment.
+ */
+#define READ 0
+#define WRITE 1
+#define IOCB_NOWAIT (1 << 7)
+#define ITER_IOVEC 0
+
+struct kiocb {
+	struct file *ki_filp;
+	loff_t ki_pos;
+	int ki_flags;
+};
+
+static inline void init_sync_kiocb(struct kiocb *kiocb, struct file *filp) {
+	kiocb->ki_filp = filp;
+	kiocb->ki_pos = 0;
+	kiocb->ki_flags = 0;
+}
+
+struct iov_iter {
+	int type;
+	size_t iov_offset;
+	size_t count;
+	const struct iovec *iov;
+	unsigned long nr_segs;
+};
+
+static inline void iov_iter_init(struct iov_iter *i, int direction, const struct iovec *iov,
+		unsigned long nr_segs, size_t count) {
+	i->type = ITER_IOVEC | direction;
+	i->iov = iov;
+	i->nr_segs = nr_segs;
+	i->iov_offset = 0;
+	i->count = count;
+}
+static inline bool iter_is_iovec(const struct iov_iter *i) { return (i->type & ~1) == ITER_IOVEC; }
+static inline size_t iov_iter_count(const struct iov_iter *i) { return i->count; }
+static inline struct iovec iov_iter_iovec(const struct iov_iter *i) {
+	return (struct iovec) {
+		.iov_base = (char *) i->iov->iov_base + i->iov_offset,
+		.iov_len = min(i->count, i->iov->iov_len - i->iov_offset),
+	};
+}
+static inline void iov_iter_advance(struct iov_iter *i, size_t size) {
+	size_t n;
+
+	size = min(size, i->count);
+	if (i->count == 0)
+		return;
+	i->count -= size;
+	for (;;) {
+		n = min(size, i->iov->iov_len - i->iov_offset);
+		i->iov_offset += n;
+		size -= n;
+		if (i->iov_offset < i->iov->iov_len || i->nr_segs == 1)
+			break;
+		i->iov++;
+		i->nr_segs--;
+		i->iov_offset = 0;
+		if (size == 0)
+			break;
+	}
+}
+
+/*
+ * There is no page table to fill in: remap_vmalloc_range() just leaves the
+ * kernel address of the mapping in kshim_addr, so tests can use it as the
+ * process would use its mapping.
+ */
+#define VM_SHARED	0x00000008UL
+struct vm_area_struct {
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_pgoff;
+	unsigned long vm_flags;
+	void *kshim_addr;
+};
+
+static inline int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff) {
+	vma->kshim_addr = (char *) addr + pgoff * PAGE_SIZE;
+	return 0;
+}
+struct file_operations {
+	struct module *owner;
+	loff_t (*llseek)(struct file *, loff_t, int);
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+	ssize_t (*read_iter)(struct kiocb *, struct iov_iter *);
+	ssize_t (*write_iter)(struct kiocb *, struct iov_iter *);
+	unsigned int (*poll)(struct file *, struct poll_table_struct *);
+	long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+	long (*compat_ioctl)(struct file *, unsigned int, unsigned long);
+	int (*mmap)(struct file *, struct vm_area_struct *);
+	ssize_t (*splice_write)(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);
+	ssize_t (*splice_read)(struct file *, loff_t *, struct pipe_inode_info *, size_t, unsigned int);
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+};
+
+/* Nothing sleeps in poll() here: poll_wait() only has to exist */
+typedef struct poll_table_struct { int unused; } poll_table;
+static inline void poll_wait(struct file *f, wait_queue_head_t *wq, poll_table *p) {
+	(void)f; (void)wq; (void)p;
+}
+
+struct proc_dir_entry;
+struct proc_dir_entry *proc_create(const char *name, unsigned short mode,
+		struct proc_dir_entry *parent, const struct file_operations *fops);
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent);
+/* Test helper: fops registered under "name", or NULL */
+const struct file_operations *kshim_proc_fops(const char *name);
+
+/* Character devices are kept in the same registry, as "dev/<name>" */
+int register_chrdev(unsigned int major, const char *name, const struct file_operations *fops);
+void unregister_chrdev(unsigned int major, const char *name);
+
+/* --------------------------------------------------------------- splice */
+
+/*
+ * A pipe as in 4.x: a ring of page buffers guarded by a mutex. Nothing ever
+ * sleeps on it: __splice_from_pipe() returns once the pipe is empty and
+ * splice_to_pipe() fails with -EAGAIN once it's full, so tests fill and
+ * drain it around each call with kshim_pipe_fill()/kshim_pipe_drain().
+ */
+#define PIPE_DEF_BUFFERS 16
+#define SPLICE_F_NONBLOCK 0x02
+
+struct pipe_buffer;
+struct pipe_buf_operations {
+	int can_merge;
+	int (*confirm)(struct pipe_inode_info *, struct pipe_buffer *);
+	void (*release)(struct pipe_inode_info *, struct pipe_buffer *);
+	int (*steal)(struct pipe_inode_info *, struct pipe_buffer *);
+	void (*get)(struct pipe_inode_info *, struct pipe_buffer *);
+};
+
+struct pipe_buffer {
+	struct page *page;
+	unsigned int offset, len;
+	const struct pipe_buf_operations *ops;
+};
+
+struct pipe_inode_info {
+	pthread_mutex_t mutex;
+	unsigned int nrbufs, curbuf, buffers;
+	unsigned int readers, writers;
+	struct pipe_buffer bufs[PIPE_DEF_BUFFERS];
+};
+
+static inline void pipe_lock(struct pipe_inode_info *pipe) { pthread_mutex_lock(&pipe->mutex); }
+static inline void pipe_unlock(struct pipe_inode_info *pipe) { pthread_mutex_unlock(&pipe->mutex); }
+
+static inline int generic_pipe_buf_confirm(struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+	(void)pipe; (void)buf;
+	return 0;
+}
+static inline void generic_pipe_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+	(void)pipe;
+	put_page(buf->page);
+}
+static inline int generic_pipe_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+	(void)pipe; (void)buf;
+	return 1;
+}
+static inline void generic_pipe_buf_get(struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+	(void)pipe; (void)buf;
+}
+
+struct partial_page {
+	unsigned int offset;
+	unsigned int len;
+	unsigned long private;
+};
+
+struct splice_pipe_desc {
+	struct page **pages;
+	struct partial_page *partial;
+	int nr_pages;
+	unsigned int nr_pages_max;
+	const struct pipe_buf_operations *ops;
+	void (*spd_release)(struct splice_pipe_desc *, unsigned int);
+};
+
+struct splice_desc {
+	size_t total_len;
+	unsigned int len;
+	unsigned int flags;
+	union {
+		void __user *userptr;
+		struct file *file;
+		void *data;
+		loff_t *opos;
+	} u;
+	loff_t pos;
+	loff_t *opos;
+	size_t num_spliced;
+	bool need_wakeup;
+};
+
+typedef int (splice_actor)(struct pipe_inode_info *, struct pipe_buffer *, struct splice_desc *);
+
+ssize_t splice_to_pipe(struct pipe_inode_info *pipe, struct splice_pipe_desc *spd);
+ssize_t __splice_from_pipe(struct pipe_inode_info *pipe, struct splice_desc *sd, splice_actor *actor);
+
+/* Test helpers: an empty pipe; queue len bytes of buf; take up to size bytes out */
+void kshim_pipe_init(struct pipe_inode_info *pipe);
+size_t kshim_pipe_fill(struct pipe_inode_info *pipe, const void *buf, size_t len);
+size_t kshim_pipe_drain(struct pipe_inode_info *pipe, void *buf, size_t size);
+
+/* ------------------------------------------------------------- seq_file */
+
+struct seq_file;
+struct seq_operations {
+	void *(*start)(struct seq_file *m, loff_t *pos);
+	void (*stop)(struct seq_file *m, void *v);
+	void *(*next)(struct seq_file *m, void *v, loff_t *pos);
+	int (*show)(struct seq_file *m, void *v);
+};
+struct seq_file {
+	char *buf;
+	size_t size;
+	size_t from;
+	size_t count;
+	loff_t index;
+	loff_t read_pos;
+	const struct seq_operations *op;
+	void *private;
+};
+int seq_open_private(struct file *f, const struct seq_operations *op, int psize);
+int seq_release_private(struct inode *inode, struct file *f);
+ssize_t seq_read(struct file *f, char __user *buf, size_t size, loff_t *ppos);
+loff_t seq_lseek(struct file *f, loff_t offset, int whence);
+void seq_printf(struct seq_file *m, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int single_open(struct file *f, int (*show)(struct seq_file *, void *), void *data);
+int single_release(struct inode *inode, struct file *f);
+
+#endif
@@ -0,0 +1,413 @@
+#include "fifoproc.c"
+#include "test.h"
+
+/*
+ * Unit tests for /proc/prodcons, as a byte stream and with msg_mode. open()
+ * blocks until the other end shows up, so every test opens the consumer from
+ * a helper thread while the main thread opens the producer.
+ */
+
+static const struct file_operations *fops;
+static struct file prod = { .f_mode = FMODE_WRITE };
+static struct file cons = { .f_mode = FMODE_READ };
+
+static void* open_consumer(void *arg) {
+	CHECK(fops->open(NULL, &cons) == 0);
+	return NULL;
+}
+
+static void open_both(void) {
+	pthread_t tid;
+
+	pthread_create(&tid, NULL, open_consumer, NULL);
+	CHECK(fops->open(NULL, &prod) == 0);
+	pthread_join(tid, NULL);
+}
+
+/* The stream is a known byte pattern, written and read in uneven pieces */
+#define STREAM_LEN (3 << 20)
+
+static inline char stream_byte(size_t i) {
+	return (char) (i * 7 + (i >> 12));
+}
+
+static void* produce(void *arg) {
+	static char buf[200000];
+	size_t sizes[] = { 1, 24, 4096, 100000, 199999, 3 };
+	size_t done = 0, n, i;
+	ssize_t ret;
+	int k = 0;
+
+	while (done < STREAM_LEN) {
+		n = min(sizes[k++ % ARRAY_SIZE(sizes)], STREAM_LEN - done);
+		for (i = 0; i < n; i++)
+			buf[i] = stream_byte(done + i);
+		/* Larger than the ring: a blocking write still takes all of it */
+		ret = fops->write(&prod, buf, n, NULL);
+		CHECK(ret == (ssize_t) n);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	CHECK(fops->release(NULL, &prod) == 0);
+	return NULL;
+}
+
+/* The consumer sees every byte, in order, and then EOF */
+static void test_stream(void) {
+	static char buf[150000];
+	size_t sizes[] = { 7, 65536, 150000, 1, 333 };
+	size_t done = 0, i;
+	pthread_t tid;
+	ssize_t ret;
+	int k = 0, ok = 1;
+
+	open_both();
+	pthread_create(&tid, NULL, produce, NULL);
+	while ((ret = fops->read(&cons, buf, sizes[k++ % ARRAY_SIZE(sizes)], NULL)) > 0) {
+		for (i = 0; i < ret; i++)
+			ok &= (buf[i] == stream_byte(done + i));
+		done += ret;
+	}
+	CHECK(ret == 0);
+	CHECK(ok);
+	CHECK(done == STREAM_LEN);
+	pthread_join(tid, NULL);
+	CHECK(fops->release(NULL, &cons) == 0);
+}
+
+static void test_errors(void) {
+	static char big[70000];
+	char buf[16] = "hola";
+
+	open_both();
+	CHECK(fops->read(&cons, buf, 0, NULL) == 0);
+
+	kshim_fault_next = 1;
+	CHECK(fops->write(&prod, buf, 4, NULL) == -EFAULT);
+	CHECK(kfifo_is_empty(&cbuffer));
+	CHECK(fops->write(&prod, buf, 4, NULL) == 4);
+	kshim_fault_next = 1;
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == -EFAULT);
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == 4);
+
+	/*
+	 * A fault after the ring wraps: the bytes before it were already moved
+	 * and are counted, on both sides
+	 */
+	CHECK(fops->write(&prod, big, ring_size - 6, NULL) == (ssize_t) ring_size - 6);
+	CHECK(fops->read(&cons, big, sizeof(big), NULL) == (ssize_t) ring_size - 6);
+	kshim_fault_next = 2;
+	CHECK(fops->write(&prod, "holamundo", 9, NULL) == 2);
+	CHECK(kfifo_len(&cbuffer) == 2);
+	CHECK(fops->write(&prod, "lamundo", 7, NULL) == 7);
+	kshim_fault_next = 2;
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == 2 && memcmp(buf, "ho", 2) == 0);
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == 7 && memcmp(buf, "lamundo", 7) == 0);
+
+	/* Writing once the consumer is gone */
+	CHECK(fops->release(NULL, &cons) == 0);
+	CHECK(fops->write(&prod, buf, 4, NULL) == -EPIPE);
+	CHECK(fops->release(NULL, &prod) == 0);
+	CHECK(kfifo_is_empty(&cbuffer));
+}
+
+static void test_nonblock(void) {
+	static char buf[70000];
+	struct file nb = { .f_mode = FMODE_READ, .f_flags = O_NONBLOCK };
+	struct file nbw = { .f_mode = FMODE_WRITE, .f_flags = O_NONBLOCK };
+	ssize_t n;
+
+	/* Nobody on the other end */
+	CHECK(fops->open(NULL, &nb) == -EAGAIN);
+	CHECK(fops->open(NULL, &nbw) == -EAGAIN);
+	CHECK(cons_count == 0 && prod_count == 0);
+
+	open_both();
+	CHECK(fops->poll(&cons, NULL) == 0);
+	CHECK(fops->poll(&prod, NULL) == (POLLOUT | POLLWRNORM));
+
+	cons.f_flags = O_NONBLOCK;
+	prod.f_flags = O_NONBLOCK;
+	CHECK(fops->read(&cons, buf, 10, NULL) == -EAGAIN);
+
+	/* A non-blocking write takes what fits */
+	n = fops->write(&prod, buf, sizeof(buf), NULL);
+	CHECK(n == (ssize_t) kfifo_size(&cbuffer));
+	CHECK(fops->write(&prod, buf, 1, NULL) == -EAGAIN);
+	CHECK(fops->poll(&prod, NULL) == 0);
+	CHECK(fops->poll(&cons, NULL) == (POLLIN | POLLRDNORM));
+
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == n);
+	CHECK(fops->read(&cons, buf, 10, NULL) == -EAGAIN);
+
+	/* Hangup on each side once the other one leaves */
+	CHECK(fops->release(NULL, &prod) == 0);
+	CHECK(fops->poll(&cons, NULL) == POLLHUP);
+	CHECK(fops->read(&cons, buf, 10, NULL) == 0);
+	CHECK(fops->release(NULL, &cons) == 0);
+	cons.f_flags = 0;
+	prod.f_flags = 0;
+
+	open_both();
+	CHECK(fops->release(NULL, &cons) == 0);
+	CHECK(fops->poll(&prod, NULL) == (POLLOUT | POLLWRNORM | POLLERR));
+	CHECK(fops->release(NULL, &prod) == 0);
+}
+
+/*
+ * readv()/writev() as the VFS issues them on /proc (do_loop_readv_writev()):
+ * one ->read or ->write per segment, stopping at the first error or short
+ * transfer, and returning what was done before it, if anything
+ */
+static ssize_t rw_iov(struct file *f, struct iovec *iov, int nseg) {
+	ssize_t ret = 0, nr;
+	int i;
+
+	for (i = 0; i < nseg; i++) {
+		if (f->f_mode & FMODE_READ)
+			nr = fops->read(f, iov[i].iov_base, iov[i].iov_len, NULL);
+		else
+			nr = fops->write(f, iov[i].iov_base, iov[i].iov_len, NULL);
+		if (nr < 0) {
+			if (!ret)
+				ret = nr;
+			break;
+		}
+		ret += nr;
+		if (nr != (ssize_t) iov[i].iov_len)
+			break;
+	}
+	return ret;
+}
+
+/* In stream mode segments are just pieces of one byte stream */
+static void test_vectored(void) {
+	char a[3], b[5], c[8];
+	struct iovec w[] = { { "abc", 3 }, { "", 0 }, { "defgh", 5 }, { "i", 1 } };
+	struct iovec r[] = { { a, sizeof(a) }, { b, sizeof(b) }, { c, sizeof(c) } };
+
+	open_both();
+	CHECK(rw_iov(&prod, w, 4) == 9);
+	CHECK(rw_iov(&cons, r, 3) == 9);
+	CHECK(memcmp(a, "abc", 3) == 0 && memcmp(b, "defgh", 5) == 0 && c[0] == 'i');
+	CHECK(fops->release(NULL, &prod) == 0);
+	CHECK(fops->release(NULL, &cons) == 0);
+}
+
+/* Records of every size from 1 to RECORD_MAX, each filled with its own length */
+#define NR_RECORDS 3000
+#define RECORD_MAX 5000
+
+static size_t record_len(int i) {
+	return (i * 7919) % RECORD_MAX + 1;
+}
+
+static void* produce_records(void *arg) {
+	static char buf[RECORD_MAX];
+	size_t len;
+	int i;
+
+	for (i = 0; i < NR_RECORDS; i++) {
+		len = record_len(i);
+		memset(buf, (char) len, len);
+		CHECK(fops->write(&prod, buf, len, NULL) == (ssize_t) len);
+	}
+	CHECK(fops->release(NULL, &prod) == 0);
+	return NULL;
+}
+
+static void test_records(void) {
+	static char buf[70000];
+	char a[1], b[2], c[10];
+	struct iovec w[] = { { "x", 1 }, { "", 0 }, { "yy", 2 }, { "zzz", 3 } };
+	struct iovec r[] = { { a, sizeof(a) }, { b, sizeof(b) }, { c, sizeof(c) } };
+	struct file nbw = { .f_mode = FMODE_WRITE, .f_flags = O_NONBLOCK };
+	pthread_t tid;
+	ssize_t n;
+	int i, ok = 1;
+
+	open_both();
+
+	/* One read() per write(), never more, never less */
+	CHECK(fops->write(&prod, "abc", 3, NULL) == 3);
+	CHECK(fops->write(&prod, "", 0, NULL) == 0);
+	CHECK(fops->write(&prod, "hello", 5, NULL) == 5);
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == 3 && memcmp(buf, "abc", 3) == 0);
+	CHECK(fops->read(&cons, buf, 2, NULL) == -EMSGSIZE);
+	CHECK(fops->read(&cons, buf, 5, NULL) == 5 && memcmp(buf, "hello", 5) == 0);
+
+	/* writev(): a record per non-empty segment; readv(): a record per segment */
+	CHECK(rw_iov(&prod, w, 4) == 6);
+	CHECK(rw_iov(&cons, r, 3) == 6);
+	CHECK(a[0] == 'x' && memcmp(b, "yy", 2) == 0 && memcmp(c, "zzz", 3) == 0);
+	CHECK(fops->write(&prod, "ab", 2, NULL) == 2);
+	CHECK(fops->write(&prod, "cd", 2, NULL) == 2);
+	CHECK(fops->write(&prod, "ef", 2, NULL) == 2);
+	/* "ab" fills its segment so "cd" follows; "cd" doesn't, so "ef" waits */
+	CHECK(rw_iov(&cons, r + 1, 2) == 4 && memcmp(c, "cd", 2) == 0);
+	CHECK(rw_iov(&cons, r + 2, 1) == 2 && memcmp(c, "ef", 2) == 0);
+
+	/*
+	 * When every record fills its segment the next segment's read waits for
+	 * another record; without blocking it gets -EAGAIN and readv() returns
+	 * what it has
+	 */
+	CHECK(fops->write(&prod, "ab", 2, NULL) == 2);
+	cons.f_flags = O_NONBLOCK;
+	CHECK(rw_iov(&cons, r + 1, 2) == 2 && memcmp(b, "ab", 2) == 0);
+	cons.f_flags = 0;
+
+	/* The largest record is the ring minus its header */
+	CHECK(fops->write(&prod, buf, ring_size - 1, NULL) == -EMSGSIZE);
+	CHECK(fops->write(&prod, buf, ring_size - 2, NULL) == (ssize_t) ring_size - 2);
+	CHECK(fops->poll(&prod, NULL) == 0);
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == (ssize_t) ring_size - 2);
+
+	/* A faulting write leaves no torn record behind */
+	kshim_fault_next = 1;
+	CHECK(fops->write(&prod, "abc", 3, NULL) == -EFAULT);
+	CHECK(kfifo_is_empty(&rbuffer));
+
+	/* Without blocking a record that doesn't fit is refused as a whole */
+	CHECK(fops->open(NULL, &nbw) == 0);
+	CHECK(fops->write(&nbw, buf, 40000, NULL) == 40000);
+	CHECK(fops->write(&nbw, buf, 30000, NULL) == -EAGAIN);
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == 40000);
+	CHECK(fops->release(NULL, &nbw) == 0);
+
+	/* Boundaries survive a concurrent stream of records */
+	pthread_create(&tid, NULL, produce_records, NULL);
+	for (i = 0; (n = fops->read(&cons, buf, RECORD_MAX, NULL)) > 0; i++)
+		ok &= (n == (ssize_t) record_len(i) && buf[0] == (char) n && buf[n - 1] == (char) n);
+	CHECK(n == 0);
+	CHECK(ok);
+	CHECK(i == NR_RECORDS);
+	pthread_join(tid, NULL);
+	CHECK(fops->release(NULL, &cons) == 0);
+}
+
+static void* write_later(void *arg) {
+	usleep(10000);
+	CHECK(fops->write(&prod, "x", 1, NULL) == 1);
+	return NULL;
+}
+
+/* The spin budget halves with every wait that ends up sleeping anyway */
+static void test_spin(void) {
+	char buf[4];
+	pthread_t tid;
+	int i;
+
+	spin_us = 20;
+	kshim_online_cpus = 2;
+	open_both();
+	CHECK(fops->write(&prod, "ab", 2, NULL) == 2);
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == 2);
+	CHECK(cons_spin_ns == 0); /* Data was there: no spinning at all */
+
+	for (i = 0; i < 6; i++) {
+		pthread_create(&tid, NULL, write_later, NULL);
+		CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == 1);
+		pthread_join(tid, NULL);
+		CHECK(cons_spin_ns == max(20000u >> (i + 1), 20000u / 16));
+	}
+	CHECK(fops->release(NULL, &prod) == 0);
+	CHECK(fops->release(NULL, &cons) == 0);
+
+	/* Spinning on both sides doesn't change what goes through */
+	test_stream();
+	spin_us = 0;
+	kshim_online_cpus = 0;
+}
+
+static void read_stats(char *buf, size_t size) {
+	const struct file_operations *sfops = kshim_proc_fops("prodcons_stats");
+	struct file f = { 0 };
+
+	CHECK(sfops != NULL);
+	CHECK(sfops->open(NULL, &f) == 0);
+	CHECK(proc_read_all(sfops, &f, buf, size, 64) > 0);
+	CHECK(sfops->release(NULL, &f) == 0);
+}
+
+/* The counters are cumulative, so the test checks how much they moved */
+static void test_stats(void) {
+	static char before[4096], after[4096];
+	char buf[8];
+	pthread_t tid;
+
+	read_stats(before, sizeof(before));
+	CHECK(stat_value(before, "prod_count") == 0);
+
+	open_both();
+	CHECK(fops->write(&prod, "hello", 5, NULL) == 5);
+	read_stats(after, sizeof(after));
+	CHECK(stat_value(after, "ring_used") == 5);
+	CHECK(stat_value(after, "ring_hwm") >= 5);
+	CHECK(stat_value(after, "prod_count") == 1);
+	CHECK(stat_value(after, "cons_count") == 1);
+
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == 5);
+	cons.f_flags = O_NONBLOCK;
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == -EAGAIN);
+	cons.f_flags = 0;
+	/* A read that sleeps ~10 ms until write_later() shows up */
+	pthread_create(&tid, NULL, write_later, NULL);
+	CHECK(fops->read(&cons, buf, sizeof(buf), NULL) == 1);
+	pthread_join(tid, NULL);
+	CHECK(fops->release(NULL, &prod) == 0);
+	CHECK(fops->release(NULL, &cons) == 0);
+
+	read_stats(after, sizeof(after));
+	CHECK(stat_value(after, "bytes_in") - stat_value(before, "bytes_in") == 6);
+	CHECK(stat_value(after, "bytes_out") - stat_value(before, "bytes_out") == 6);
+	CHECK(stat_value(after, "ops_in") - stat_value(before, "ops_in") == 2);
+	CHECK(stat_value(after, "ops_out") - stat_value(before, "ops_out") == 2);
+	CHECK(stat_value(after, "empty_stalls") - stat_value(before, "empty_stalls") == 2);
+	CHECK(stat_value(after, "cons_wakeups") > stat_value(before, "cons_wakeups"));
+	CHECK(stat_buckets(after, "cons_blocked_us", 4096) - stat_buckets(before, "cons_blocked_us", 4096) == 1);
+	/* The non-blocking miss counts as a stall but blocks for no time */
+	CHECK(stat_buckets(after, "cons_blocked_us", 0) - stat_buckets(before, "cons_blocked_us", 0) == 1);
+	CHECK(stat_value(after, "ring_used") == 0);
+	CHECK(stat_value(after, "prod_count") == 0);
+
+	/* The sleeping read shows up in the tracepoints too */
+	CHECK(kshim_trace_hits_prodcons_block == kshim_trace_hits_prodcons_unblock);
+	CHECK(kshim_trace_hits_prodcons_block > 0);
+	CHECK(kshim_trace_hits_prodcons_enqueue > 0 && kshim_trace_hits_prodcons_dequeue > 0);
+	CHECK(kshim_trace_hits_prodcons_wake > 0);
+}
+
+static void test_ring_size(void) {
+	ring_size = 10;
+	CHECK(init_module() == -EINVAL);
+	ring_size = 1000;
+	CHECK(init_module() == 0);
+	CHECK(kfifo_size(&cbuffer) == 1024);
+	cleanup_module();
+	ring_size = 65536;
+}
+
+int main(void) {
+	test_ring_size();
+
+	CHECK(init_module() == 0);
+	fops = kshim_proc_fops("prodcons");
+	CHECK(fops != NULL);
+
+	test_stream();
+	test_errors();
+	test_nonblock();
+	test_vectored();
+	test_spin();
+	test_stats();
+	cleanup_module();
+
+	msg_mode = true;
+	CHECK(init_module() == 0);
+	fops = kshim_proc_fops("prodcons");
+	test_records();
+	cleanup_module();
+	TEST_DONE("t_fifoproc");
+}
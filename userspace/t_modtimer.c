@@ -0,0 +1,354 @@
+#include "modtimer.c"
+#include "test.h"
+
+/*
+ * Unit tests for /proc/modtimer and /proc/modconfig. The timer and the
+ * deferred work are fired by hand (kshim_run_timer/kshim_run_work), so the
+ * tests decide exactly when numbers are produced and flushed to the list.
+ */
+
+static const struct file_operations *fops;
+static const struct file_operations *cfops;
+
+/* Ticks until the timer asks for a flush; returns the number of ticks */
+static int tick_until_flush(void) {
+	int ticks = 0;
+
+	while (!work_pending(&transfer_task) && ticks < 1000) {
+		CHECK(kshim_run_timer(&my_timer));
+		ticks++;
+	}
+	return ticks;
+}
+
+/* Blocks handed over by the worker that no reader has freed yet */
+static int queued_blocks(void) {
+	struct llist_node *n;
+	int blocks = 0;
+
+	for (n = pending; n; n = llist_next(n))
+		blocks++;
+	for (n = handoff.first; n; n = llist_next(n))
+		blocks++;
+	return blocks;
+}
+
+/*
+ * Reads "count" text numbers, in as many read() calls as it takes, and checks
+ * their range. Every number takes at least 2 bytes ("d\n"), so asking for
+ * 2 * count never takes more than "count".
+ */
+static void read_numbers(struct file *f, int count) {
+	char buf[64], *p, *end;
+	ssize_t n;
+	long num;
+
+	while (count > 0) {
+		n = fops->read(f, buf, min(sizeof(buf) - 1, 2 * (size_t) count), NULL);
+		CHECK(n > 0);
+		if (n <= 0)
+			return;
+		buf[n] = '\0';
+		for (p = buf; *p; p = end + 1, count--) {
+			num = strtol(p, &end, 10);
+			CHECK(*end == '\n' && num >= 0 && num < max_random);
+		}
+	}
+	CHECK(count == 0);
+}
+
+static void test_config(void) {
+	char buf[128];
+	struct file f = { 0 };
+
+	CHECK(cfops->read(&f, buf, sizeof(buf), NULL) > 0);
+	CHECK(strstr(buf, "max_random=300\n") != NULL);
+	CHECK(cfops->read(&f, buf, 10, NULL) == -ENOMEM);
+
+	CHECK(proc_write(cfops, &f, "max_random=10") == 13);
+	CHECK(max_random == 10);
+	CHECK(proc_write(cfops, &f, "timer_period_ms=20\n") == 19);
+	CHECK(timer_period_ms == 20);
+	CHECK(proc_write(cfops, &f, "bogus=1") == -EINVAL);
+	CHECK(proc_write(cfops, &f, "") == -EINVAL);
+	CHECK(proc_write(cfops, &f, "max_random=0") == -EINVAL);
+	CHECK(proc_write(cfops, &f, "max_random=000000000000000000000000000000000000001") == -EINVAL);
+	CHECK(max_random == 10);
+}
+
+static void test_numbers(void) {
+	struct file f = { 0 };
+	struct file other = { 0 };
+	int ticks;
+
+	CHECK(fops->open(NULL, &f) == 0);
+	CHECK(fops->open(NULL, &other) == -EAGAIN);
+	CHECK(timer_pending(&my_timer));
+
+	/* 75% of 128 bytes is reached with the 25th int */
+	ticks = tick_until_flush();
+	CHECK(ticks == 25);
+	CHECK(kshim_trace_hits_modtimer_fire == 25);
+	CHECK(kshim_trace_hits_modtimer_flush_request == 1);
+	CHECK(kshim_run_work(&transfer_task));
+	CHECK(kfifo_is_empty(&buffer));
+	CHECK(kshim_trace_hits_modtimer_flush_start == 1);
+	CHECK(kshim_trace_hits_modtimer_flush_end == 1);
+
+	/* The whole flush is one block, freed with its last number */
+	CHECK(queued_blocks() == 1);
+	CHECK(llist_entry(handoff.first, num_block_t, node)->count == ticks);
+	read_numbers(&f, ticks - 1);
+	CHECK(queued_blocks() == 1 && llist_empty(&handoff));
+	read_numbers(&f, 1);
+	CHECK(queued_blocks() == 0);
+
+	/* Closing drops what's pending and stops the timer */
+	tick_until_flush();
+	CHECK(fops->release(NULL, &f) == 0);
+	CHECK(!timer_pending(&my_timer));
+	CHECK(queued_blocks() == 0 && kfifo_is_empty(&buffer));
+	CHECK(module_refcount(THIS_MODULE) == 0);
+}
+
+/* hrtimer mode: batches of numbers per expiry, and live switching between the two timers */
+static void test_hrtimer(void) {
+	struct file f = { 0 };
+	char buf[32], config[256];
+	int i;
+
+	CHECK(proc_write(cfops, &f, "timer_period_us=5") == -EINVAL);
+	CHECK(proc_write(cfops, &f, "batch=0") == -EINVAL);
+	CHECK(proc_write(cfops, &f, "batch=33") == -EINVAL);
+	CHECK(proc_write(cfops, &f, "timer_period_us=100") == 19);
+	CHECK(proc_write(cfops, &f, "batch=8") == 7);
+	CHECK(cfops->read(&f, buf, sizeof(buf), NULL) == -ENOMEM);
+
+	CHECK(fops->open(NULL, &f) == 0);
+	CHECK(hrtimer_active(&my_hrtimer) && !timer_pending(&my_timer));
+
+	/* 3 batches are exactly 75%: the 4th fills the buffer and asks for a flush */
+	for (i = 0; i < 3; i++)
+		CHECK(kshim_run_hrtimer(&my_hrtimer));
+	CHECK(kfifo_len(&buffer) == 24 * sizeof(int) && !work_pending(&transfer_task));
+	CHECK(kshim_run_hrtimer(&my_hrtimer));
+	CHECK(hrtimer_active(&my_hrtimer));
+
+	/* Another batch before the flush runs doesn't fit and is counted */
+	CHECK(kshim_run_hrtimer(&my_hrtimer));
+	CHECK(dropped == 8);
+	CHECK(cfops->read(&f, config, sizeof(config) - 1, NULL) > 0);
+	CHECK(strstr(config, "dropped=8\n") != NULL);
+	CHECK(kshim_run_work(&transfer_task));
+	read_numbers(&f, 32);
+	CHECK(queued_blocks() == 0);
+
+	/* Each timer hands over to the other on its next expiry */
+	CHECK(proc_write(cfops, &f, "timer_period_us=0") == 17);
+	CHECK(kshim_run_hrtimer(&my_hrtimer));
+	CHECK(!hrtimer_active(&my_hrtimer) && timer_pending(&my_timer));
+	CHECK(proc_write(cfops, &f, "timer_period_us=10") == 18);
+	CHECK(kshim_run_timer(&my_timer));
+	CHECK(hrtimer_active(&my_hrtimer) && !timer_pending(&my_timer));
+
+	CHECK(fops->release(NULL, &f) == 0);
+	CHECK(!hrtimer_active(&my_hrtimer) && !timer_pending(&my_timer));
+	CHECK(proc_write(cfops, &f, "timer_period_us=0") == 17);
+	CHECK(proc_write(cfops, &f, "batch=1") == 7);
+}
+
+/* Reloads the module, as insmod would with the current parameters */
+static void reload(void) {
+	cleanup_module();
+	CHECK(init_module() == 0);
+	fops = kshim_proc_fops("modtimer");
+	cfops = kshim_proc_fops("modconfig");
+}
+
+/* Per-CPU mode: the CPU's own timer fills its own ring and the worker drains it */
+static void test_percpu(void) {
+	cpu_producer_t *p = per_cpu_ptr(&producers, 0);
+	struct file f = { 0 };
+	unsigned long allocs, lost;
+	int i;
+
+	/* The rings only exist in per-CPU mode */
+	CHECK(p->ring.data == NULL);
+	percpu_mode = true;
+	reload();
+	CHECK(kfifo_size(&p->ring) == buffer_size);
+	CHECK(fops->open(NULL, &f) == 0);
+	CHECK(timer_pending(&p->timer) && !timer_pending(&my_timer));
+
+	for (i = 0; i < 25; i++)
+		CHECK(kshim_run_timer(&p->timer));
+	CHECK(kfifo_is_empty(&buffer) && kfifo_len(&p->ring) == 25 * sizeof(int));
+	CHECK(work_pending(&transfer_task));
+	CHECK(kshim_run_work(&transfer_task));
+	CHECK(kfifo_is_empty(&p->ring));
+	read_numbers(&f, 25);
+	CHECK(queued_blocks() == 0);
+
+	/* A flush with every ring empty allocates nothing */
+	allocs = kshim_cache_allocs;
+	schedule_work(&transfer_task);
+	CHECK(kshim_run_work(&transfer_task));
+	CHECK(kshim_cache_allocs == allocs && queued_blocks() == 0);
+
+	/* Without memory for a block the ring's numbers are dropped, and counted */
+	for (i = 0; i < 25; i++)
+		CHECK(kshim_run_timer(&p->timer));
+	lost = dropped;
+	kshim_nomem_next = 1;
+	CHECK(kshim_run_work(&transfer_task));
+	CHECK(kfifo_is_empty(&p->ring) && queued_blocks() == 0 && dropped - lost == 25);
+
+	/* The per-CPU timer hands over to the per-CPU hrtimer */
+	CHECK(proc_write(cfops, &f, "timer_period_us=10") == 18);
+	CHECK(kshim_run_timer(&p->timer));
+	CHECK(hrtimer_active(&p->hrtimer) && !hrtimer_active(&my_hrtimer));
+	CHECK(kshim_run_hrtimer(&p->hrtimer));
+	CHECK(kfifo_len(&p->ring) == 2 * sizeof(int));
+
+	CHECK(fops->release(NULL, &f) == 0);
+	CHECK(!hrtimer_active(&p->hrtimer) && !timer_pending(&p->timer));
+	CHECK(kfifo_is_empty(&p->ring));
+	CHECK(proc_write(cfops, &f, "timer_period_us=0") == 17);
+	percpu_mode = false;
+	reload();
+	CHECK(p->ring.data == NULL);
+
+	/* The same with the shared buffer */
+	CHECK(fops->open(NULL, &f) == 0);
+	i = tick_until_flush();
+	lost = dropped;
+	kshim_nomem_next = 1;
+	CHECK(kshim_run_work(&transfer_task));
+	CHECK(kfifo_is_empty(&buffer) && queued_blocks() == 0 && dropped - lost == i);
+	CHECK(fops->release(NULL, &f) == 0);
+}
+
+/* One read() returns every number that fits, in text or packed int32 */
+static void test_bulk(void) {
+	struct file f = { 0 };
+	char buf[256];
+	int nums[64];
+	int i, ok = 1;
+
+	/* max_random=10 from test_config(): every number is "d\n" */
+	CHECK(fops->open(NULL, &f) == 0);
+	tick_until_flush();
+	kshim_run_work(&transfer_task);
+	tick_until_flush();
+	kshim_run_work(&transfer_task);
+	CHECK(queued_blocks() == 2);
+
+	CHECK(fops->read(&f, buf, 1, NULL) == -ENOMEM);
+	CHECK(fops->read(&f, buf, 3, NULL) == 2);
+	/* Two blocks of 25, minus the one already read, in one call */
+	CHECK(fops->read(&f, buf, sizeof(buf), NULL) == 49 * 2);
+	for (i = 0; i < 49; i++)
+		ok &= (buf[2 * i] >= '0' && buf[2 * i] <= '9' && buf[2 * i + 1] == '\n');
+	CHECK(ok);
+	CHECK(queued_blocks() == 0);
+	CHECK(fops->release(NULL, &f) == 0);
+
+	binary_format = true;
+	CHECK(fops->open(NULL, &f) == 0);
+	binary_format = false; /* Already sampled by open() */
+	tick_until_flush();
+	kshim_run_work(&transfer_task);
+	CHECK(fops->read(&f, (char *) nums, 3, NULL) == -ENOMEM);
+	CHECK(fops->read(&f, (char *) nums, 10 * sizeof(int) + 1, NULL) == 10 * sizeof(int));
+	CHECK(fops->read(&f, (char *) (nums + 10), sizeof(nums) - 10 * sizeof(int), NULL) == 15 * sizeof(int));
+	for (i = 0; i < 25; i++)
+		ok &= (nums[i] >= 0 && nums[i] < (int) max_random);
+	CHECK(ok);
+	CHECK(queued_blocks() == 0);
+	CHECK(fops->release(NULL, &f) == 0);
+}
+
+static void *blocked_read(void *arg) {
+	read_numbers(arg, 25);
+	return NULL;
+}
+
+/* A reader asleep on an empty handoff holds readers_lock, and the worker still gets the flush to it */
+static void test_handoff(void) {
+	struct file f = { 0 };
+	pthread_t tid;
+
+	CHECK(fops->open(NULL, &f) == 0);
+	pthread_create(&tid, NULL, blocked_read, &f);
+	while (!waitqueue_active(&readers_wq))
+		usleep(100);
+	CHECK(!mutex_trylock(&readers_lock));
+
+	CHECK(tick_until_flush() == 25);
+	CHECK(kshim_run_work(&transfer_task));
+	pthread_join(tid, NULL);
+	CHECK(queued_blocks() == 0);
+	CHECK(fops->release(NULL, &f) == 0);
+}
+
+/* A larger buffer holds more before the flush, and read() copies its blocks out in steps */
+static void test_buffer_size(void) {
+	struct file f = { 0 };
+	unsigned long lost;
+	char buf[1024];
+
+	cleanup_module();
+	buffer_size = 64;
+	CHECK(init_module() == -EINVAL);
+	CHECK(kshim_proc_fops("modtimer") == NULL);
+	buffer_size = 1000;
+	CHECK(init_module() == 0);
+	fops = kshim_proc_fops("modtimer");
+	cfops = kshim_proc_fops("modconfig");
+	CHECK(kfifo_size(&buffer) == 1024);
+
+	/* 75% of 1024 bytes is reached with the 193rd int, all in one block; "d\n" each with max_random=10 */
+	CHECK(fops->open(NULL, &f) == 0);
+	CHECK(tick_until_flush() == 193);
+	CHECK(kshim_run_work(&transfer_task));
+	CHECK(queued_blocks() == 1);
+	CHECK(fops->read(&f, buf, sizeof(buf), NULL) == 193 * 2);
+	CHECK(queued_blocks() == 0);
+	CHECK(fops->release(NULL, &f) == 0);
+
+	/* A batch can take the whole buffer, and is generated in pieces of BATCH_CHUNK */
+	CHECK(proc_write(cfops, &f, "batch=257") == -EINVAL);
+	CHECK(proc_write(cfops, &f, "batch=200") == 9);
+	CHECK(proc_write(cfops, &f, "timer_period_us=100") == 19);
+	CHECK(fops->open(NULL, &f) == 0);
+	CHECK(kshim_run_hrtimer(&my_hrtimer));
+	CHECK(kfifo_len(&buffer) == 200 * sizeof(int) && work_pending(&transfer_task));
+	lost = dropped;
+	CHECK(kshim_run_hrtimer(&my_hrtimer));
+	CHECK(kfifo_is_full(&buffer) && dropped - lost == 144);
+	CHECK(kshim_run_work(&transfer_task));
+	read_numbers(&f, 256);
+	CHECK(queued_blocks() == 0);
+	CHECK(fops->release(NULL, &f) == 0);
+	CHECK(proc_write(cfops, &f, "timer_period_us=0") == 17);
+	CHECK(proc_write(cfops, &f, "batch=1") == 7);
+}
+
+int main(void) {
+	srandom(1);
+	CHECK(init_module() == 0);
+	fops = kshim_proc_fops("modtimer");
+	cfops = kshim_proc_fops("modconfig");
+	CHECK(fops != NULL && cfops != NULL);
+
+	test_config();
+	test_numbers();
+	test_hrtimer();
+	test_percpu();
+	test_bulk();
+	test_handoff();
+	test_buffer_size();
+
+	cleanup_module();
+	TEST_DONE("t_modtimer");
+}
@@ -0,0 +1,146 @@
+#include "my_mod.c"
+#include "test.h"
+
+/*
+ * Unit tests for my_mod: text commands, seq_file reads split at arbitrary
+ * sizes, the ioctl interface and the stats/query entries. Every case runs
+ * with both storage backends and with one and several shards.
+ */
+
+static char out[1 << 20];
+
+static void rewind_and_read(const struct file_operations *fops, struct file *f, size_t chunk) {
+	fops->llseek(f, 0, SEEK_SET);
+	CHECK(proc_read_all(fops, f, out, sizeof(out), chunk) >= 0);
+}
+
+static void test_module(const char *be, unsigned int shards) {
+	const struct file_operations *fops;
+	const struct file_operations *qfops;
+	struct file f = { 0 };
+	struct file q = { 0 };
+	struct my_mod_ints req;
+	char expect[sizeof(out)];
+	char cmd[32];
+	int vals[1000];
+	int i;
+
+	backend = (char *) be;
+	nr_shards = shards;
+	use_chunks = false;
+	CHECK(kshim_module_init() == 0);
+	fops = kshim_proc_fops("my_mod");
+	qfops = kshim_proc_fops("my_mod_query");
+	CHECK(fops != NULL && qfops != NULL);
+	CHECK(fops->open(NULL, &f) == 0);
+
+	/* A batch is applied as a whole */
+	CHECK(proc_write(fops, &f, "add 1\nadd 2\n\nadd 3\n") == 19);
+	CHECK(list_length() == 3);
+	CHECK(proc_write(fops, &f, "add 4\nbogus\n") == -EINVAL);
+	CHECK(proc_write(fops, &f, "add 4\nadd 5garbage\n") == -EINVAL);
+	CHECK(proc_write(fops, &f, "add 5add 6\n") == -EINVAL);
+	CHECK(proc_write(fops, &f, "add 4\ncleanupXYZ\n") == -EINVAL);
+	CHECK(proc_write(fops, &f, "remove 1 2\n") == -EINVAL);
+	CHECK(list_length() == 3);
+	CHECK(proc_write(fops, &f, "add 4 \nremove 4\t\n") == 17);
+	CHECK(list_length() == 3);
+	CHECK(proc_write(fops, &f, "remove 2\n") == 9);
+	CHECK(list_length() == 2);
+	CHECK(count_value(1) == 1 && count_value(2) == 0 && count_value(3) == 1);
+	/* A removal in the batch may drop the chunk the first add went to */
+	CHECK(proc_write(fops, &f, "add 5\nremove 5\nadd 6\n") == 21);
+	CHECK(count_value(5) == 0 && count_value(6) == 1);
+	CHECK(proc_write(fops, &f, "remove 6\n") == 9);
+	/* A removal may have to copy the chunks the same batch added to */
+	CHECK(proc_write(fops, &f, "add 5\nadd 9\nremove 5\nadd 10\nremove 9\nremove 10\n") == 47);
+	CHECK(count_value(5) == 0 && count_value(9) == 0 && list_length() == 2);
+
+	/* A line split across writes is completed by the next one */
+	CHECK(proc_write(fops, &f, "add 1\nadd 12") == 12);
+	CHECK(count_value(1) == 2 && count_value(12) == 0);
+	CHECK(proc_write(fops, &f, "34\nadd 2\n") == 9);
+	CHECK(count_value(1234) == 1 && count_value(2) == 1 && count_value(12) == 0);
+	/* A failed write leaves the kept line as it was */
+	CHECK(proc_write(fops, &f, "remove 1") == 8);
+	CHECK(proc_write(fops, &f, "\nbogus\n") == -EINVAL);
+	CHECK(count_value(1) == 2);
+	CHECK(proc_write(fops, &f, "234\nremove 2\nremove 1") == 21);
+	CHECK(count_value(1234) == 0 && count_value(2) == 0 && count_value(1) == 2);
+	CHECK(proc_write(fops, &f, "add 1                                                                     ") == -EINVAL);
+	/* ...and the last one is applied at close */
+	fops->release(NULL, &f);
+	CHECK(count_value(1) == 0 && list_length() == 1);
+	CHECK(fops->open(NULL, &f) == 0);
+	CHECK(proc_write(fops, &f, "add 1\n") == 6);
+
+	/* Same output whatever the size of the reads */
+	for (i = 0; i < 3000; i++) {
+		snprintf(cmd, sizeof(cmd), "add %d\n", i % 100);
+		proc_write(fops, &f, cmd);
+	}
+	rewind_and_read(fops, &f, 4096);
+	CHECK(count_lines(out) == 3002);
+	strcpy(expect, out);
+	rewind_and_read(fops, &f, 1);
+	CHECK(strcmp(out, expect) == 0);
+	rewind_and_read(fops, &f, 7);
+	CHECK(strcmp(out, expect) == 0);
+
+	CHECK(proc_write(fops, &f, "remove 7\n") == 9);
+	CHECK(count_value(7) == 0 && count_value(8) == 30);
+	rewind_and_read(fops, &f, 100);
+	CHECK(count_lines(out) == 2972);
+
+	/* Queries */
+	CHECK(qfops->open(NULL, &q) == 0);
+	CHECK(qfops->read(&q, out, sizeof(out), &q.f_pos) == -EINVAL);
+	CHECK(proc_write(qfops, &q, "count 8") == 7);
+	CHECK(qfops->read(&q, out, sizeof(out), &q.f_pos) == 3 && strncmp(out, "30\n", 3) == 0);
+	CHECK(qfops->read(&q, out, sizeof(out), &q.f_pos) == 0);
+	CHECK(proc_write(qfops, &q, "contains 7") == 10);
+	CHECK(qfops->read(&q, out, sizeof(out), &q.f_pos) == 2 && strncmp(out, "0\n", 2) == 0);
+	CHECK(proc_write(qfops, &q, "nothing") == -EINVAL);
+	CHECK(proc_write(qfops, &q, "count 5abc") == -EINVAL);
+	CHECK(proc_write(qfops, &q, "contains 7 8") == -EINVAL);
+	CHECK(proc_write(qfops, &q, "count 8\n") == 8);
+	CHECK(qfops->read(&q, out, sizeof(out), &q.f_pos) == 3 && strncmp(out, "30\n", 3) == 0);
+	qfops->release(NULL, &q);
+
+	/* ioctl */
+	for (i = 0; i < 1000; i++)
+		vals[i] = 1000 + i;
+	req.data = (unsigned long) vals;
+	req.count = 1000;
+	CHECK(fops->unlocked_ioctl(&f, MY_MOD_IOC_ADD, (unsigned long) &req) == 1000);
+	CHECK(list_length() == 3972 && count_value(1999) == 1);
+	req.count = 10;
+	CHECK(fops->unlocked_ioctl(&f, MY_MOD_IOC_SNAPSHOT, (unsigned long) &req) == 10);
+	CHECK(req.total == 3972);
+	CHECK(fops->unlocked_ioctl(&f, 0, (unsigned long) &req) == -ENOTTY);
+	CHECK(fops->unlocked_ioctl(&f, MY_MOD_IOC_ADD, 0) == -EFAULT);
+
+	/* A faulting user buffer fails the write and leaves the list alone */
+	kshim_fault_next = 1;
+	CHECK(proc_write(fops, &f, "add 5\n") == -EFAULT);
+	CHECK(list_length() == 3972);
+
+	CHECK(proc_write(fops, &f, "cleanup\n") == 8);
+	CHECK(list_length() == 0);
+	rewind_and_read(fops, &f, 4096);
+	CHECK(out[0] == '\0');
+
+	fops->release(NULL, &f);
+	kshim_module_exit();
+	CHECK(atomic_read(&nr_allocs) == atomic_read(&nr_frees));
+	CHECK(atomic_read(&nr_chunks) == 0); /* No spare chunk is leaked */
+	CHECK(kshim_warnings == 0); /* The batches never ran out of preallocated chunks */
+}
+
+int main(void) {
+	test_module("list", 1);
+	test_module("list", 4);
+	test_module("chunks", 1);
+	test_module("chunks", 4);
+	TEST_DONE("t_my_mod");
+}
@@ -0,0 +1,352 @@
+#include "opcional.c"
+#include "test.h"
+
+/*
+ * Unit tests for /dev/prodcons: every minor is its own channel, created on
+ * the first open and freed with the last close, and channels don't see each
+ * other's data. The shared-memory mode is checked with a producer and a
+ * consumer that only touch the mapped ring.
+ */
+
+static const struct file_operations *fops;
+
+typedef struct {
+	struct inode inode;
+	struct file prod;
+	struct file cons;
+} pair_t;
+
+static void* open_consumer(void *arg) {
+	pair_t *p = arg;
+
+	CHECK(fops->open(&p->inode, &p->cons) == 0);
+	return NULL;
+}
+
+static void open_pair(pair_t *p, unsigned int minor) {
+	pthread_t tid;
+
+	memset(p, 0, sizeof(*p));
+	p->inode.i_rdev = MKDEV(major, minor);
+	p->prod.f_mode = FMODE_WRITE;
+	p->cons.f_mode = FMODE_READ;
+	pthread_create(&tid, NULL, open_consumer, p);
+	CHECK(fops->open(&p->inode, &p->prod) == 0);
+	pthread_join(tid, NULL);
+}
+
+static void close_pair(pair_t *p) {
+	CHECK(fops->release(&p->inode, &p->prod) == 0);
+	CHECK(fops->release(&p->inode, &p->cons) == 0);
+}
+
+static void test_isolation(void) {
+	pair_t a, b;
+	char buf[16];
+
+	CHECK(channels[0] == NULL && channels[7] == NULL);
+	open_pair(&a, 0);
+	open_pair(&b, 7);
+	CHECK(channels[0] != NULL && channels[7] != NULL && channels[0] != channels[7]);
+	CHECK(channels[0]->users == 2 && channels[7]->users == 2);
+
+	CHECK(fops->write(&a.prod, "aaaa", 4, NULL) == 4);
+	CHECK(fops->write(&b.prod, "bb", 2, NULL) == 2);
+	CHECK(fops->read(&b.cons, buf, sizeof(buf), NULL) == 2 && memcmp(buf, "bb", 2) == 0);
+	CHECK(fops->read(&a.cons, buf, sizeof(buf), NULL) == 4 && memcmp(buf, "aaaa", 4) == 0);
+
+	/* Closing one channel leaves the other alone */
+	close_pair(&a);
+	CHECK(channels[0] == NULL && channels[7] != NULL);
+	CHECK(fops->poll(&b.prod, NULL) == (POLLOUT | POLLWRNORM));
+	close_pair(&b);
+	CHECK(channels[7] == NULL);
+}
+
+/* A non-blocking open that fails doesn't leave the channel behind */
+static void test_failed_open(void) {
+	struct inode inode = { .i_rdev = MKDEV(major, 3) };
+	struct file f = { .f_mode = FMODE_READ, .f_flags = O_NONBLOCK };
+
+	CHECK(fops->open(&inode, &f) == -EAGAIN);
+	CHECK(channels[3] == NULL);
+}
+
+#define STREAM_LEN (1 << 20)
+
+static void* stream(void *arg) {
+	pair_t *p = arg;
+	static __thread char buf[8192];
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < STREAM_LEN) {
+		n = fops->read(&p->cons, buf, sizeof(buf), NULL);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	CHECK(done == STREAM_LEN);
+	return NULL;
+}
+
+/* Several pipelines at once, one per minor */
+static void test_parallel(void) {
+	static char buf[STREAM_LEN];
+	pair_t pairs[4];
+	pthread_t tids[4];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		open_pair(&pairs[i], 10 + i);
+		pthread_create(&tids[i], NULL, stream, &pairs[i]);
+	}
+	for (i = 0; i < 4; i++)
+		CHECK(fops->write(&pairs[i].prod, buf, STREAM_LEN, NULL) == STREAM_LEN);
+	for (i = 0; i < 4; i++) {
+		pthread_join(tids[i], NULL);
+		close_pair(&pairs[i]);
+	}
+}
+
+/*
+ * Shared-memory mode, driven the way a process would drive its mapping (see
+ * prodcons_ioctl.h): the only calls into the module are to sleep and wake.
+ */
+#define MMAP_LEN (4 << 20)
+
+static struct prodcons_ring_ctl *map_ring(struct file *f) {
+	struct vm_area_struct vma = { .vm_flags = VM_SHARED };
+
+	CHECK(fops->mmap(f, &vma) == 0);
+	return vma.kshim_addr;
+}
+
+static void* mmap_consume(void *arg) {
+	pair_t *p = arg;
+	struct prodcons_ring_ctl *ctl = map_ring(&p->cons);
+	unsigned char *data = (unsigned char *) ctl + ctl->data_offset;
+	__u32 head, tail = 0;
+	size_t done = 0;
+	int ok = 1;
+
+	for (;;) {
+		head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			__atomic_store_n(&ctl->cons_waiting, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE) == tail &&
+			    fops->unlocked_ioctl(&p->cons, PRODCONS_IOC_WAIT, 0) == -EPIPE)
+				break;
+			__atomic_store_n(&ctl->cons_waiting, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		for (; tail != head; tail++, done++)
+			ok &= (data[tail & (ctl->size - 1)] == (unsigned char) (done * 13));
+		__atomic_store_n(&ctl->tail, tail, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ctl->prod_waiting, __ATOMIC_RELAXED))
+			fops->unlocked_ioctl(&p->cons, PRODCONS_IOC_WAKE, 0);
+	}
+	CHECK(ok);
+	CHECK(done == MMAP_LEN);
+	return NULL;
+}
+
+static void test_mmap(void) {
+	struct vm_area_struct priv = { 0 };
+	struct prodcons_ring_ctl *ctl;
+	unsigned char *data;
+	__u32 head = 0, tail, n;
+	pair_t p;
+	pthread_t tid;
+	char buf[4];
+
+	open_pair(&p, 20);
+	CHECK(fops->unlocked_ioctl(&p.prod, PRODCONS_IOC_RING_SIZE, 0) == ring_size);
+	CHECK(fops->unlocked_ioctl(&p.prod, PRODCONS_IOC_WAIT, 0) == -EINVAL);
+	CHECK(fops->mmap(&p.prod, &priv) == -EINVAL);
+
+	/* Only an empty channel can be mapped */
+	CHECK(fops->write(&p.prod, "x", 1, NULL) == 1);
+	CHECK(fops->mmap(&p.prod, &(struct vm_area_struct) { .vm_flags = VM_SHARED }) == -EBUSY);
+	CHECK(fops->read(&p.cons, buf, sizeof(buf), NULL) == 1);
+
+	ctl = map_ring(&p.prod);
+	CHECK(ctl->size == ring_size && ctl->data_offset == PAGE_SIZE);
+	data = (unsigned char *) ctl + ctl->data_offset;
+	CHECK(fops->write(&p.prod, "x", 1, NULL) == -EBUSY);
+	CHECK(fops->read(&p.cons, buf, sizeof(buf), NULL) == -EBUSY);
+	CHECK(fops->poll(&p.prod, NULL) == (POLLOUT | POLLWRNORM));
+
+	pthread_create(&tid, NULL, mmap_consume, &p);
+	while (head < MMAP_LEN) {
+		tail = __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE);
+		if (head - tail == ctl->size) {
+			__atomic_store_n(&ctl->prod_waiting, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (head - __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE) == ctl->size)
+				CHECK(fops->unlocked_ioctl(&p.prod, PRODCONS_IOC_WAIT, 0) == 0);
+			__atomic_store_n(&ctl->prod_waiting, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		/* Uneven pieces so head wraps at every possible offset */
+		n = min(min(ctl->size - (head - tail), (__u32) (head % 5000 + 1)), MMAP_LEN - head);
+		for (; n > 0; n--, head++)
+			data[head & (ctl->size - 1)] = (unsigned char) (head * 13);
+		__atomic_store_n(&ctl->head, head, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ctl->cons_waiting, __ATOMIC_RELAXED))
+			fops->unlocked_ioctl(&p.prod, PRODCONS_IOC_WAKE, 0);
+	}
+
+	/* The consumer drains the ring and gets -EPIPE once the producer leaves */
+	CHECK(fops->release(&p.inode, &p.prod) == 0);
+	pthread_join(tid, NULL);
+	CHECK(fops->release(&p.inode, &p.cons) == 0);
+	CHECK(channels[20] == NULL);
+}
+
+/* splice()/sendfile(): pipe pages go into the ring, and ring data leaves in new pages */
+static void test_splice(void) {
+	static char in[3 * PAGE_SIZE + 100], out[sizeof(in)], junk[PIPE_DEF_BUFFERS * PAGE_SIZE];
+	struct pipe_inode_info pipe;
+	loff_t pos = 0;
+	size_t i;
+	pair_t p;
+
+	for (i = 0; i < sizeof(in); i++)
+		in[i] = i * 31;
+	kshim_pipe_init(&pipe);
+	open_pair(&p, 30);
+
+	CHECK(kshim_pipe_fill(&pipe, in, sizeof(in)) == sizeof(in));
+	CHECK(fops->splice_write(&pipe, &p.prod, &pos, sizeof(in), 0) == sizeof(in));
+	CHECK(pipe.nrbufs == 0);
+	CHECK(fops->read(&p.cons, out, sizeof(out), NULL) == sizeof(in));
+	CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+	CHECK(fops->write(&p.prod, in, sizeof(in), NULL) == sizeof(in));
+	CHECK(fops->splice_read(&p.cons, &pos, &pipe, sizeof(in), 0) == sizeof(in));
+	CHECK(kshim_pipe_drain(&pipe, out, sizeof(out)) == sizeof(in));
+	CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+	/* Only what fits in the pipe leaves the ring */
+	CHECK(fops->write(&p.prod, in, sizeof(in), NULL) == sizeof(in));
+	kshim_pipe_fill(&pipe, junk, (PIPE_DEF_BUFFERS - 1) * PAGE_SIZE);
+	CHECK(fops->splice_read(&p.cons, &pos, &pipe, sizeof(in), 0) == PAGE_SIZE);
+	CHECK(fops->splice_read(&p.cons, &pos, &pipe, sizeof(in), 0) == -EAGAIN);
+	kshim_pipe_drain(&pipe, junk, sizeof(junk));
+	CHECK(memcmp(junk + (PIPE_DEF_BUFFERS - 1) * PAGE_SIZE, in, PAGE_SIZE) == 0);
+	CHECK(fops->read(&p.cons, out, sizeof(out), NULL) == sizeof(in) - PAGE_SIZE);
+	CHECK(memcmp(in + PAGE_SIZE, out, sizeof(in) - PAGE_SIZE) == 0);
+	CHECK(fops->splice_read(&p.cons, &pos, &pipe, sizeof(in), SPLICE_F_NONBLOCK) == -EAGAIN);
+
+	/* Without a reader on the pipe the data stays in the ring */
+	CHECK(fops->write(&p.prod, in, sizeof(in), NULL) == sizeof(in));
+	pipe.readers = 0;
+	CHECK(fops->splice_read(&p.cons, &pos, &pipe, sizeof(in), 0) == -EPIPE);
+	pipe.readers = 1;
+	CHECK(fops->read(&p.cons, out, sizeof(out), NULL) == sizeof(in));
+	CHECK(memcmp(in, out, sizeof(in)) == 0);
+
+	/* A full ring stops a non-blocking splice, leaving the rest in the pipe */
+	for (i = 0; i < ring_size; i += sizeof(junk))
+		CHECK(fops->write(&p.prod, junk, sizeof(junk), NULL) == sizeof(junk));
+	kshim_pipe_fill(&pipe, in, sizeof(in));
+	CHECK(fops->splice_write(&pipe, &p.prod, &pos, sizeof(in), SPLICE_F_NONBLOCK) == -EAGAIN);
+	CHECK(pipe.nrbufs == 4);
+	for (i = 0; i < ring_size; i += sizeof(junk))
+		CHECK(fops->read(&p.cons, junk, sizeof(junk), NULL) == sizeof(junk));
+	CHECK(fops->splice_write(&pipe, &p.prod, &pos, sizeof(in), SPLICE_F_NONBLOCK) == sizeof(in));
+
+	/* End of stream once the producer leaves and the ring is empty */
+	CHECK(fops->release(&p.inode, &p.prod) == 0);
+	CHECK(fops->splice_read(&p.cons, &pos, &pipe, sizeof(in), 0) == sizeof(in));
+	CHECK(fops->splice_read(&p.cons, &pos, &pipe, sizeof(in), 0) == 0);
+	CHECK(kshim_pipe_drain(&pipe, out, sizeof(out)) == sizeof(in));
+	CHECK(memcmp(in, out, sizeof(in)) == 0);
+	CHECK(fops->release(&p.inode, &p.cons) == 0);
+}
+
+/* A fault after the ring wraps still counts the bytes moved before it */
+static void test_fault(void) {
+	static char big[70000];
+	char buf[16];
+	pair_t p;
+
+	open_pair(&p, 50);
+	CHECK(fops->write(&p.prod, big, ring_size - 2, NULL) == (ssize_t) ring_size - 2);
+	CHECK(fops->read(&p.cons, big, sizeof(big), NULL) == (ssize_t) ring_size - 2);
+	kshim_fault_next = 2;
+	CHECK(fops->write(&p.prod, "holamundo", 9, NULL) == 2);
+	CHECK(fops->write(&p.prod, "lamundo", 7, NULL) == 7);
+	kshim_fault_next = 2;
+	CHECK(fops->read(&p.cons, buf, sizeof(buf), NULL) == 2 && memcmp(buf, "ho", 2) == 0);
+	CHECK(fops->read(&p.cons, buf, sizeof(buf), NULL) == 7 && memcmp(buf, "lamundo", 7) == 0);
+	close_pair(&p);
+}
+
+/* Each live channel has its own block in /proc/prodcons_dev_stats */
+static void test_stats(void) {
+	const struct file_operations *sfops = kshim_proc_fops("prodcons_dev_stats");
+	static char buf[8192];
+	struct file f = { 0 };
+	char data[100];
+	const char *blk;
+	pair_t p, q;
+
+	CHECK(sfops != NULL);
+	open_pair(&p, 40);
+	open_pair(&q, 41);
+	CHECK(fops->write(&p.prod, data, sizeof(data), NULL) == sizeof(data));
+	CHECK(fops->read(&p.cons, data, 30, NULL) == 30);
+	p.cons.f_flags = O_NONBLOCK;
+	CHECK(fops->read(&p.cons, data, sizeof(data), NULL) == 70);
+	CHECK(fops->read(&p.cons, data, sizeof(data), NULL) == -EAGAIN);
+
+	CHECK(sfops->open(NULL, &f) == 0);
+	CHECK(proc_read_all(sfops, &f, buf, sizeof(buf), 100) > 0);
+	CHECK(sfops->release(NULL, &f) == 0);
+
+	blk = strstr(buf, "minor=40\n");
+	CHECK(blk != NULL);
+	CHECK(stat_value(blk, "bytes_in") == 100);
+	CHECK(stat_value(blk, "bytes_out") == 100);
+	CHECK(stat_value(blk, "ops_in") == 1);
+	CHECK(stat_value(blk, "ops_out") == 2);
+	CHECK(stat_value(blk, "ring_used") == 0);
+	CHECK(stat_value(blk, "ring_hwm") == 100);
+	CHECK(stat_value(blk, "empty_stalls") == 1);
+	CHECK(stat_value(blk, "full_stalls") == 0);
+	CHECK(stat_value(blk, "prod_count") == 1);
+	CHECK(stat_value(blk, "cons_count") == 1);
+	CHECK(stat_buckets(blk, "cons_blocked_us", 0) == 0);
+
+	/* Minor 41 saw none of it */
+	blk = strstr(buf, "minor=41\n");
+	CHECK(blk != NULL);
+	CHECK(stat_value(blk, "bytes_in") == 0);
+	CHECK(stat_value(blk, "ring_hwm") == 0);
+	CHECK(strstr(buf, "minor=42\n") == NULL);
+
+	close_pair(&p);
+	close_pair(&q);
+}
+
+int main(void) {
+	CHECK(init_module() == 0);
+	fops = kshim_proc_fops("dev/prodcons");
+	CHECK(fops != NULL);
+
+	test_isolation();
+	test_failed_open();
+	test_parallel();
+	test_mmap();
+	test_splice();
+	test_fault();
+	test_stats();
+
+	cleanup_module();
+	TEST_DONE("t_opcional");
+}
@@ -0,0 +1,91 @@
+#ifndef TEST_H
+#define TEST_H
+
+/*
+ * Minimal helpers shared by the unit tests: CHECK() reports and counts
+ * failures without stopping the run, and the proc_* helpers drive a module's
+ * file_operations the way read(2)/write(2) would.
+ */
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		test_failures++; \
+	} \
+} while (0)
+
+#define TEST_DONE(name) do { \
+	printf("%s: %s\n", name, test_failures ? "FAILED" : "ok"); \
+	return test_failures ? 1 : 0; \
+} while (0)
+
+static inline ssize_t proc_write(const struct file_operations *fops, struct file *f, const char *s) {
+	loff_t off = 0;
+
+	return fops->write(f, s, strlen(s), &off);
+}
+
+/* Reads until EOF in "chunk"-sized calls; returns the total or the first error */
+static inline ssize_t proc_read_all(const struct file_operations *fops, struct file *f,
+		char *buf, size_t size, size_t chunk) {
+	size_t total = 0;
+	ssize_t n;
+
+	while (total + chunk < size) {
+		n = fops->read(f, buf + total, chunk, &f->f_pos);
+		if (n < 0)
+			return n;
+		if (n == 0)
+			break;
+		total += n;
+	}
+	buf[total] = '\0';
+	return total;
+}
+
+static inline int count_lines(const char *s) {
+	int n = 0;
+
+	for (; *s; s++)
+		n += (*s == '\n');
+	return n;
+}
+
+/* Value of the first "key=N" line at or after s, or -1 if there is none */
+static inline long long stat_value(const char *s, const char *key) {
+	size_t len = strlen(key);
+
+	for (; s != NULL && *s; s = strchr(s, '\n'), s = s ? s + 1 : NULL) {
+		if (strncmp(s, key, len) == 0 && s[len] == '=')
+			return strtoll(s + len + 1, NULL, 10);
+	}
+	return -1;
+}
+
+/* Sums the "from:count" entries of the histogram line "key" whose bucket starts at "from" or above */
+static inline long long stat_buckets(const char *s, const char *key, long long from) {
+	char *end, *line;
+	long long bucket, total = 0;
+	size_t len = strlen(key);
+
+	for (; s != NULL && *s; s = strchr(s, '\n'), s = s ? s + 1 : NULL) {
+		if (strncmp(s, key, len) == 0 && s[len] == '=')
+			break;
+	}
+	if (s == NULL || *s == '\0')
+		return -1;
+	for (line = (char *) s + len + 1; *line && *line != '\n'; line = end) {
+		bucket = strtoll(line, &end, 10);
+		if (*end++ != ':')
+			return -1;
+		if (bucket >= from)
+			total += strtoll(end, &end, 10);
+		else
+			strtoll(end, &end, 10);
+	}
+	return total;
+}
+
+#endif